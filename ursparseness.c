@@ -4,6 +4,35 @@
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/file.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <dirent.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/epoll.h>
+#include <netdb.h>
+#include <limits.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <linux/openat2.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
 
 //
 //ursparse file format
@@ -21,10 +50,86 @@
 //
 //offset and length are ascii unsigned integers
 //
+//a segment line may start with a record type letter, segments without
+//a type letter are data segments followed by their meat
+//
+//u offset length\n
+//  unwritten (preallocated) range, no meat follows
+//  the decoder allocates the range without writing it
+//
+//r offset length source\n
+//  back-reference, no meat follows
+//  the decoder copies length bytes it already wrote at source to offset
+//
+//h size length\n
+//hash
+//  trailer with logical size of file and its sparse tree hash,
+//  length bytes of lowercase hex, the decoder extends output to size
+//  and checks the hash when asked to verify
+//  length is 0 when the trailer carries only the size
+//  --watch streams follow it with changes and trailers of later sizes,
+//  one giving a smaller size after the last segment leaves the output
+//  file as long as it is
+//
+//l offset length packed\n
+//meat
+//  data segment compressed with lz4 into packed bytes of meat,
+//  z records are the same compressed with zstd, length of either is at
+//  most COMPRESS_MAX_SZ
+//
+//i size length\n
+//meat
+//  index of seekable stream, ends it, size is the logical size of file
+//  meat has a line "offset length pos record" for each data segment in
+//  ascending order, pos and record being where its record starts in the
+//  stream and how long it is, then "%020ld\n" with length of the whole
+//  index record so it is found from the end of the stream
+//  decoders skip it, --extract reads it to decode any range directly
+//
+//k offset length\n
+//hash meat
+//  content defined chunk, data segment whose meat starts with the
+//  lowercase hex hash of its length bytes of data, the decoder adds the
+//  chunk to its chunk store, length is at most CDC_MAX_SZ
+//
+//c offset length\n
+//hash
+//  chunk reference, meat is only the hex hash of a chunk shipped as
+//  k record before, in this or an earlier stream, the decoder copies it
+//  from its chunk store to offset
+//
 
 struct ursparse {
+    char type;
     off_t offset;
     off_t size;
+    off_t source;
+    off_t packed;   //meat size of compressed segment
+};
+
+struct options {
+    size_t blk_sz;
+    unsigned char* hole_byte;
+    int prealloc;
+    int refs;
+    int verify;
+    int threads;
+    const char* prefix; //of shard files
+    off_t range_start;  //restricts sparse and ursparse to [range_start, range_end)
+    off_t range_end;    //0 when not restricted
+    struct throttle* throttle; //of data I/O, 0 when not throttled
+    size_t queue_sz;    //bytes queued per output of sparse fan-out
+    const unsigned char* key; //of encrypted stream, 0 when not encrypted
+    const char* cipher;       //of encrypted stream
+    int codec;                //of data segments, CODEC_AUTO adapts, CODEC_RAW uncompressed
+    int seekable;             //ships data in indexed blocks decoded independently
+    const char* chunks;       //chunk index of sparse, chunk store of ursparse, 0 without chunking
+    off_t store_size;         //most bytes of chunks the chunk store keeps, 0 keeps its own
+    const char* extent_cache; //file or directory caching extent maps of input, 0 without cache
+    int map_format;           //of --map output
+    int durability;           //of decoded output, DURABLE_NONE leaves it to the kernel
+    off_t sync_size;          //bytes written between write-behind syncs
+    int allow_fetch;          //daemon sends files under root to clients asking with <PATH
 };
 
 //parses unsigned integer
@@ -35,6 +140,7 @@ struct ursparse {
 //out_sz     => output number of bytes consumed
 //out_offset => output value of uint
 //              valid only on 'done parsing' return value
+//digits     => in/out number of numerals parsed so far, 0 on first call
 //
 //returns
 //  negative number on error
@@ -42,16 +148,17 @@ struct ursparse {
 //  n intermediate parsing, 
 //    need more data, 
 //    out_offset contains intermediate value, 
-int parse_uint(const char* buff, size_t sz, size_t* out_sz, off_t* out_n)
+int parse_uint(const char* buff, size_t sz, size_t* out_sz, off_t* out_n, size_t* digits)
 {
     if (!buff) return -1;
     if (!sz) return -2;
     if (!out_sz) return -3;
     if (!out_n) return -4;
+    if (!digits) return -5;
     
     size_t i = 0;
 
-    if (!*out_n) {
+    if (!*digits) {
         //consume spaces and newlines before number
         for(; i < sz; ++i)
             if (!(buff[i] == ' ' || buff[i] == '\n' )) break;
@@ -62,6 +169,7 @@ int parse_uint(const char* buff, size_t sz, size_t* out_sz, off_t* out_n)
             //numerals
             *out_n *= 10;
             *out_n += buff[i] - '0';
+            ++*digits;
             continue;
         }
 
@@ -119,352 +227,8353 @@ int parse_newline(const char* buff, size_t sz, size_t* out_sz)
     *out_sz = i;
     return i;
 }
- 
+
+//parses optional record type letter
+//ignores spaces and newlines before it
+//a numeral means untyped data segment and is not consumed
 //
-//writes the meat to output file
+//buff, sz   => input buffer to parse and its size
 //
-int do_meat(const char* buff, size_t sz, size_t* out_sz)
+//out_sz     => output number of bytes consumed
+//out_type   => output record type, 0 for data segments
+//
+//returns
+//  negative number on error
+//  0 done parsing, out_type contains the record type
+//  n intermediate parsing, 
+//    need more data, 
+int parse_type(const char* buff, size_t sz, size_t* out_sz, char* out_type)
 {
-    if (!buff)   return -1;
-    if (!sz)     return -2;
+    if (!buff) return -1;
+    if (!sz) return -2;
     if (!out_sz) return -3;
+    if (!out_type) return -4;
 
-    size_t written_bytes = 0;
+    size_t i = 0;
 
-    while (sz > 0) {
-        ssize_t r = write(1, buff, sz);
+    //consume spaces and newlines before type
+    for(; i < sz; ++i)
+        if (!(buff[i] == ' ' || buff[i] == '\n' )) break;
 
-        if (-1 == r) {
-            perror("ERROR: could not write to output file");
-            *out_sz = written_bytes;
-            return -4;
-        }
+    if (i == sz) {
+        //reach EOB
+        *out_sz = i;
+        return i;
+    }
 
-        written_bytes += r;
-        sz -= r;
-        buff += r;
+    if (buff[i] >= '0' && buff[i] <= '9') {
+        *out_type = 0;
+        *out_sz = i;
+        return 0;
     }
 
-    *out_sz = written_bytes;
-    return written_bytes;
-}
+    if (buff[i] == 'u' || buff[i] == 'r' || buff[i] == 'h' || buff[i] == 'l' || buff[i] == 'z' || buff[i] == 'i' ||
+        buff[i] == 'c' || buff[i] == 'k') {
+        *out_type = buff[i];
+        *out_sz = i + 1;
+        return 0;
+    }
 
+    fprintf(stderr, "ERROR: invalid record type: %c\n", buff[i]);
+    return -1;
+}
+ 
 //
-//writes the hole to output file
+//sparse tree hash
+//
+//content is split into HASH_LEAF_SZ leaves hashed with SHA-256 and combined
+//into a binary tree whose left subtrees are always complete
 //
-int do_hole(off_t offset)
+//  leaf  = H(0x00 || leaf bytes)
+//  node  = H(0x01 || left || right)
+//  final = H(0x02 || size as 8 byte little endian || root)
+//
+//complete subtrees of zeros hash the same wherever they are, so a hole
+//costs O(log n) precomputed subtree pushes instead of hashing its zeros
+//leaves are hashed in parallel in batches
+//
+
+#define HASH_SZ      32
+#define HASH_LEAF_SZ (64 * 1024)
+#define HASH_LEVELS  64
+#define HASH_BATCH   32 //leaves per thread and batch
+
+struct tree_hash {
+    unsigned char zero[HASH_LEVELS][HASH_SZ]; //complete subtrees of zeros
+    unsigned char stack[HASH_LEVELS][HASH_SZ];
+    int level[HASH_LEVELS];
+    int depth;
+    off_t leaves;          //leaves pushed into the tree
+    off_t size;            //bytes hashed
+    unsigned char* batch;  //bytes not pushed into the tree yet
+    size_t batch_sz;
+    size_t batch_cap;
+    unsigned char* digests;
+    int threads;
+};
+
+void hash_leaf(EVP_MD_CTX* ctx, const unsigned char* leaf, size_t sz, unsigned char* out)
 {
-    off_t r = lseek(1, offset, SEEK_SET);
-    if ((off_t)-1 == r) {
-        perror("ERROR: could not write hole to output file");
+    const unsigned char prefix = 0;
+    EVP_DigestInit_ex(ctx, EVP_sha256(), 0);
+    EVP_DigestUpdate(ctx, &prefix, 1);
+    EVP_DigestUpdate(ctx, leaf, sz);
+    EVP_DigestFinal_ex(ctx, out, 0);
+}
+
+void hash_node(const unsigned char* left, const unsigned char* right, unsigned char* out)
+{
+    unsigned char node[1 + 2 * HASH_SZ];
+    node[0] = 1;
+    memcpy(node + 1, left, HASH_SZ);
+    memcpy(node + 1 + HASH_SZ, right, HASH_SZ);
+    EVP_Digest(node, sizeof(node), out, 0, EVP_sha256(), 0);
+}
+
+int tree_hash_init(struct tree_hash* h, int threads)
+{
+    memset(h, 0, sizeof(*h));
+    h->threads = threads < 1 ? 1 : threads;
+    h->batch_cap = (size_t)h->threads * HASH_BATCH * HASH_LEAF_SZ;
+    h->batch = malloc(h->batch_cap);
+    h->digests = malloc((size_t)h->threads * HASH_BATCH * HASH_SZ);
+    if (!h->batch || !h->digests) {
+        fprintf(stderr, "ERROR: could not allocate memory for hashing\n");
+        free(h->batch);
+        free(h->digests);
         return -1;
     }
 
+    EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+    memset(h->batch, 0, HASH_LEAF_SZ);
+    hash_leaf(ctx, h->batch, HASH_LEAF_SZ, h->zero[0]);
+    EVP_MD_CTX_free(ctx);
+
+    for (int i = 1; i < HASH_LEVELS; ++i)
+        hash_node(h->zero[i-1], h->zero[i-1], h->zero[i]);
+
     return 0;
 }
 
-enum ursparse_state { 
-    PARSE_ERROR = -1,
-    PARSE_START = 0,
-    PARSE_OFFSET, 
-    PARSE_SIZE,
-    PARSE_NEWLINE,
-    PARSE_MEAT,
-};
+void tree_hash_free(struct tree_hash* h)
+{
+    free(h->batch);
+    free(h->digests);
+    h->batch = 0;
+    h->digests = 0;
+}
 
-struct ursparse_state_data {
-    struct ursparse ursparse;
-    enum ursparse_state state;
+//pushes complete subtree of 2^level leaves, merging complete siblings
+void tree_hash_push(struct tree_hash* h, int level, const unsigned char* digest)
+{
+    memcpy(h->stack[h->depth], digest, HASH_SZ);
+    h->level[h->depth] = level;
+    ++h->depth;
+    h->leaves += (off_t)1 << level;
+
+    while (h->depth > 1 && h->level[h->depth-1] == h->level[h->depth-2]) {
+        hash_node(h->stack[h->depth-2], h->stack[h->depth-1], h->stack[h->depth-2]);
+        ++h->level[h->depth-2];
+        --h->depth;
+    }
+}
+
+struct leaf_job {
+    const unsigned char* leaves;
+    size_t count;
+    size_t leaf_sz;
+    unsigned char* digests;
 };
 
-//parses ursparse line
-//offset length \n
-//
-//buff, sz => buffer to parse and its size
-//out_sz   => output number of bytes consumed
-//data     => in/out parser internal state
-//
-//returns
-//  negative number on error
-//  0 done parsing ursparse line
-//  n intermediate parsing
-//    need more data
-int parse_ursparse(const char* buff, size_t sz, size_t* out_sz, struct ursparse_state_data* data)
+void* hash_leaves(void* arg)
 {
-    if (!buff)   return -1;
-    if (!sz)     return -2;
-    if (!out_sz) return -3;
-    if (!data)   return -4;
+    struct leaf_job* job = arg;
+    EVP_MD_CTX* ctx = EVP_MD_CTX_new();
 
-    int r = 0;
-    size_t extra_sz = 0;
+    for (size_t i = 0; i < job->count; ++i)
+        hash_leaf(ctx, job->leaves + i * job->leaf_sz, job->leaf_sz, job->digests + i * HASH_SZ);
 
-    switch(data->state) {
+    EVP_MD_CTX_free(ctx);
+    return 0;
+}
 
-    case PARSE_START:
+//hashes count leaves of leaf_sz bytes each, splitting them across threads
+void hash_leaves_parallel(const unsigned char* leaves, size_t count, size_t leaf_sz, unsigned char* digests, int threads)
+{
+    if (!count) return;
 
-        data->state = PARSE_OFFSET;
-        
-    case PARSE_OFFSET:
+    pthread_t ids[threads];
+    struct leaf_job jobs[threads];
+    size_t per_thread = (count + threads - 1) / threads;
+    int started = 0;
 
-        r = parse_uint(buff, sz, out_sz, &(data->ursparse.offset));
-        if (r < 0) {
-            fprintf(stderr, "ERROR: could not parse offset\n");
-            data->state = PARSE_ERROR;
-            return r;
-        }
+    for (size_t first = 0; first < count; first += per_thread, ++started) {
+        jobs[started].leaves = leaves + first * leaf_sz;
+        jobs[started].count = count - first < per_thread ? count - first : per_thread;
+        jobs[started].leaf_sz = leaf_sz;
+        jobs[started].digests = digests + first * HASH_SZ;
+    }
 
-        buff += *out_sz;
-        sz -= *out_sz;
-        extra_sz += *out_sz;
+    //calling thread takes the first job
+    int spawned = 1;
+    for (; spawned < started; ++spawned)
+        if (pthread_create(&ids[spawned], 0, hash_leaves, &jobs[spawned])) break;
+    hash_leaves(&jobs[0]);
+    for (int i = 1; i < started; ++i) {
+        if (i < spawned)
+            pthread_join(ids[i], 0);
+        else
+            hash_leaves(&jobs[i]);
+    }
+}
 
-        if (r > 0) {
-            return *out_sz;
-        }
+//hashes complete leaves of batch in parallel and pushes them into the tree
+//a partial last leaf stays in the batch unless final is set
+void tree_hash_flush(struct tree_hash* h, int final)
+{
+    size_t count = h->batch_sz / HASH_LEAF_SZ;
+    size_t rest = h->batch_sz % HASH_LEAF_SZ;
 
-        data->state = PARSE_SIZE;
+    if (count) {
+        hash_leaves_parallel(h->batch, count, HASH_LEAF_SZ, h->digests, h->threads);
 
-    case PARSE_SIZE:
-        
-        r = parse_uint(buff, sz, out_sz, &(data->ursparse.size));
+        for (size_t i = 0; i < count; ++i)
+            tree_hash_push(h, 0, h->digests + i * HASH_SZ);
 
-        if (r < 0) {
-            fprintf(stderr, "ERROR: could not parse length\n");
-            data->state = PARSE_ERROR;
-            return r;
-        }
+        memmove(h->batch, h->batch + count * HASH_LEAF_SZ, rest);
+        h->batch_sz = rest;
+    }
 
-        buff += *out_sz;
-        sz -= *out_sz;
-        extra_sz += *out_sz;
+    if (final && rest) {
+        unsigned char digest[HASH_SZ];
+        EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+        hash_leaf(ctx, h->batch, rest, digest);
+        EVP_MD_CTX_free(ctx);
+        tree_hash_push(h, 0, digest);
+        h->batch_sz = 0;
+    }
+}
 
-        if (r > 0) {
-            return *out_sz;
-        }
+void tree_hash_update(struct tree_hash* h, const void* data, size_t sz)
+{
+    while (sz > 0) {
+        size_t n = h->batch_cap - h->batch_sz;
+        if (n > sz) n = sz;
 
-        data->state = PARSE_NEWLINE;
+        memcpy(h->batch + h->batch_sz, data, n);
+        h->batch_sz += n;
+        h->size += n;
+        data = (const char*)data + n;
+        sz -= n;
 
-    case PARSE_NEWLINE:
+        if (h->batch_sz == h->batch_cap) tree_hash_flush(h, 0);
+    }
+}
 
-        r = parse_newline(buff, sz, out_sz);
+void tree_hash_zeros(struct tree_hash* h, off_t sz)
+{
+    size_t partial = h->batch_sz % HASH_LEAF_SZ;
+    if (partial && sz > 0) {
+        size_t n = HASH_LEAF_SZ - partial;
+        if (n > sz) n = sz;
 
-        if (r < 0) {
-            fprintf(stderr, "ERROR: could not parse newline\n");
-            data->state = PARSE_ERROR;
-            return r;
-        }
+        memset(h->batch + h->batch_sz, 0, n);
+        h->batch_sz += n;
+        h->size += n;
+        sz -= n;
 
-        buff += *out_sz;
-        sz -= *out_sz;
-        extra_sz += *out_sz;
+        if (h->batch_sz == h->batch_cap) tree_hash_flush(h, 0);
+    }
 
-        if (r > 0) {
-            return *out_sz;
-        }
+    if (sz >= HASH_LEAF_SZ) {
+        tree_hash_flush(h, 0);
 
-        fprintf(stderr, "INFO: processing segment %ld %ld\n", data->ursparse.offset, data->ursparse.size);
+        off_t count = sz / HASH_LEAF_SZ;
+        while (count) {
+            //largest complete subtree starting at current leaf
+            int level = 63 - __builtin_clzll(count);
+            if (h->leaves && __builtin_ctzll(h->leaves) < level) level = __builtin_ctzll(h->leaves);
 
-        r = do_hole(data->ursparse.offset);
-        if (r < 0) {
-            data->state = PARSE_ERROR;
-            return -8;
+            tree_hash_push(h, level, h->zero[level]);
+            count -= (off_t)1 << level;
         }
-        
-        data->state = PARSE_MEAT;
 
-    case PARSE_MEAT: 
+        h->size += sz - sz % HASH_LEAF_SZ;
+        sz %= HASH_LEAF_SZ;
+    }
 
-        r = do_meat(buff, sz > data->ursparse.size ? data->ursparse.size : sz, out_sz);
+    if (sz > 0) {
+        memset(h->batch + h->batch_sz, 0, sz);
+        h->batch_sz += sz;
+        h->size += sz;
+    }
+}
 
-        if (r < 0) {
-            fprintf(stderr, "ERROR: could not process meat\n");
-            data->state = PARSE_ERROR;
-            return r;
-        }
+void tree_hash_final(struct tree_hash* h, unsigned char* out)
+{
+    tree_hash_flush(h, 1);
 
-        if (data->ursparse.size < *out_sz) {
-            fprintf(stderr, "ERROR: meat processor broken\n");
-            data->state = PARSE_ERROR;
-            return -7;
-        }
+    while (h->depth > 1) {
+        hash_node(h->stack[h->depth-2], h->stack[h->depth-1], h->stack[h->depth-2]);
+        --h->depth;
+    }
 
-        data->ursparse.size -= *out_sz;
-        *out_sz += extra_sz;
+    unsigned char final[1 + 8 + HASH_SZ];
+    final[0] = 2;
+    for (int i = 0; i < 8; ++i)
+        final[1 + i] = (unsigned long long)h->size >> (8 * i);
+    memcpy(final + 9, h->stack[0], HASH_SZ);
 
-        if (!data->ursparse.size) {
-            //reset parsing state
-            memset(data, 0, sizeof(*data));
-            return 0;
-        }
+    EVP_Digest(final, h->depth ? sizeof(final) : 9, out, 0, EVP_sha256(), 0);
+}
 
-        return *out_sz;
+void hash_hex(const unsigned char* digest, char* hex)
+{
+    for (int i = 0; i < HASH_SZ; ++i)
+        sprintf(hex + 2 * i, "%02x", digest[i]);
+}
 
-    case PARSE_ERROR:
-        return -5;
+//
+//throttling of data I/O with token buckets
+//
+//every read, write or copy of data takes tokens for its bytes and one
+//operation, buckets refill at the configured rates and hold at most a
+//short burst; operations are cut into slices of the byte rate so waits
+//stay short and even instead of one long stall per large copy
+//
+//callers take tokens before waiting for them, so threads sharing
+//a throttle queue up behind each other's debt without holding the lock
+//
+//adaptive throttle lowers byte rate while operations take longer than
+//target latency and raises it back while they are faster
+//
+#define THROTTLE_SLICES 50      //per second of byte rate
+#define THROTTLE_MIN_SLICE 4096
+#define THROTTLE_BURST 0.05     //seconds of tokens
+#define THROTTLE_MIN_RATE (1 << 20)
+#define THROTTLE_START_RATE (256 << 20) //adaptive without byte rate
+#define THROTTLE_ADAPT 0.1      //seconds between rate adjustments
 
-    default:
-        return -6;
-    }
+struct throttle {
+    double bytes_rate;  //per second, 0 unlimited
+    double ops_rate;
+    double bytes;       //tokens, negative while in debt
+    double ops;
+    double latency;     //target seconds per operation, 0 not adaptive
+    double max_rate;    //adaptive byte rate stays under, 0 unlimited
+    double observed;    //moving average of operation latency
+    double adapted;     //time of last rate adjustment
+    double last;        //time of last refill
+    pthread_mutex_t lock;
+};
+
+double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
-int do_ursparse(int fd_in, int fd_out, size_t blk_sz)
+//rates in bytes and operations per second, latency in seconds,
+//0 for any of them not limited
+void throttle_init(struct throttle* t, double bytes_rate, double ops_rate, double latency)
 {
-    off_t r = lseek(fd_in, 0, SEEK_SET);
-    if (r == -1) {
-        perror("ERROR: output file is not seekable");
-        return 1;
-    }
+    memset(t, 0, sizeof(*t));
+    t->bytes_rate = bytes_rate;
+    t->ops_rate = ops_rate;
+    t->latency = latency;
+    t->max_rate = bytes_rate;
+    if (latency && !bytes_rate) t->bytes_rate = THROTTLE_START_RATE;
+    t->last = t->adapted = now_seconds();
+    pthread_mutex_init(&t->lock, 0);
+}
 
-    char* read_buff = malloc(blk_sz);
-    if (!read_buff) {
-        fprintf(stderr, "ERROR: could not allocate memory: %ld bytes\n", blk_sz);
-        return 2;
-    }
+//waits until an operation of up to sz bytes may start
+//
+//start => set to start of operation, for throttle_done
+//
+//returns number of bytes the operation may transfer
+size_t throttle_take(struct throttle* t, size_t sz, double* start)
+{
+    if (!t) return sz;
 
-    struct ursparse_state_data data;
-    memset(&data, 0, sizeof(data));
+    pthread_mutex_lock(&t->lock);
 
-    while (1) {
-        ssize_t nbytes = read(fd_in, read_buff, blk_sz);
+    double now = now_seconds();
+    double dt = now - t->last;
+    t->last = now;
 
-        if (nbytes == -1) {
-            perror("ERROR: could not read from input file");
-            free(read_buff);
-            return 3;
-        }
+    double wait = 0;
+    size_t n = sz;
 
-        if (!nbytes) break; //EOF reached
+    if (t->bytes_rate) {
+        double slice = t->bytes_rate / THROTTLE_SLICES;
+        if (slice < THROTTLE_MIN_SLICE) slice = THROTTLE_MIN_SLICE;
+        if (n > slice) n = slice;
 
-        for (size_t cursor = 0; cursor < nbytes; ) {
+        double burst = t->bytes_rate * THROTTLE_BURST > slice ? t->bytes_rate * THROTTLE_BURST : slice;
+        t->bytes += dt * t->bytes_rate;
+        if (t->bytes > burst) t->bytes = burst;
 
-            size_t out_sz = 0;
-            int r = parse_ursparse(read_buff + cursor, nbytes - cursor, &out_sz, &data);
+        t->bytes -= n;
+        if (t->bytes < 0) wait = -t->bytes / t->bytes_rate;
+    }
 
-            if (r < 0) {
-                free(read_buff);
-                return 4;
-            }
+    if (t->ops_rate) {
+        double burst = t->ops_rate * THROTTLE_BURST > 1 ? t->ops_rate * THROTTLE_BURST : 1;
+        t->ops += dt * t->ops_rate;
+        if (t->ops > burst) t->ops = burst;
 
-        cursor += out_sz;
-        } 
+        t->ops -= 1;
+        if (t->ops < 0 && -t->ops / t->ops_rate > wait) wait = -t->ops / t->ops_rate;
     }
 
-    free(read_buff);
-    return 0;
-}
+    pthread_mutex_unlock(&t->lock);
 
-int do_sparse_copy_data(int fd_in, int fd_out, off_t start, size_t sz)
-{
-    ssize_t r = copy_file_range(fd_in, &start, fd_out, 0, sz, 0);
-    if (r == -1) {
-        perror("ERROR: could not copy data");
-        return -1;
+    if (wait > 0) {
+        struct timespec ts = { (time_t)wait, (long)((wait - (time_t)wait) * 1e9) };
+        while (-1 == nanosleep(&ts, &ts) && errno == EINTR);
     }
-    return r;
+
+    *start = now_seconds();
+    return n;
 }
 
-int do_sparse_data(int fd_in, int fd_out, size_t blk_sz, unsigned char* hole_byte, off_t start, size_t sz)
+//accounts for operation of granted bytes that transferred done bytes
+void throttle_done(struct throttle* t, size_t granted, size_t done, double start)
 {
-    fprintf(stderr, "INFO: processing segment %ld %ld\n", start, sz);
+    if (!t) return;
 
-    if (4 > dprintf(fd_out, "%ld %ld\n", start, sz)) {
-        perror("ERROR: could not write segment");
-        return -1;
-    }
-    if (-1 == do_sparse_copy_data(fd_in, fd_out, start, sz)) {
-        return -1;
+    double now = now_seconds();
+
+    pthread_mutex_lock(&t->lock);
+
+    //unused tokens go back
+    if (t->bytes_rate && done < granted) t->bytes += granted - done;
+
+    if (t->latency) {
+        t->observed = t->observed ? 0.8 * t->observed + 0.2 * (now - start) : now - start;
+
+        if (now - t->adapted >= THROTTLE_ADAPT) {
+            t->adapted = now;
+            if (t->observed > t->latency) t->bytes_rate *= 0.7;
+            else t->bytes_rate *= 1.1;
+
+            if (t->bytes_rate < THROTTLE_MIN_RATE) t->bytes_rate = THROTTLE_MIN_RATE;
+            if (t->max_rate && t->bytes_rate > t->max_rate) t->bytes_rate = t->max_rate;
+        }
     }
-    return 0;
+
+    pthread_mutex_unlock(&t->lock);
 }
 
-int do_sparse(int fd_in, int fd_out, size_t blk_sz, unsigned char* hole_byte)
+//
+//compression codecs
+//
+//lz4 and zstd are loaded when first used, so neither is needed to build
+//or to run without compression; only their stable one-shot API is used
+//
+#define CODECS 5
+#define CODEC_RAW 0
+#define COMPRESS_MAX_SZ (1 << 20) //of meat in one compressed segment
+
+struct codec {
+    const char* name;
+    char type;      //record type, 0 for data segment
+    int level;
+    double speed;   //assumed bytes/s compressed until measured
+};
+
+//codecs from fastest to strongest
+struct codec codec_info(int i)
 {
-    off_t start  = lseek(fd_in, 0, SEEK_SET);
-    if (start == -1) {
-        perror("ERROR: input file is not seekable");
-        return 1;
-    }
+    struct codec codecs[CODECS] = {
+        { "raw",    0,   0, 0     },
+        { "lz4",    'l', 0, 500e6 },
+        { "zstd-1", 'z', 1, 300e6 },
+        { "zstd-3", 'z', 3, 150e6 },
+        { "zstd-9", 'z', 9, 40e6  },
+    };
+    return codecs[i];
+}
 
-    off_t end = 0;
-    while (1) {
-        start = lseek(fd_in, start, SEEK_DATA);
+//returns codec index, -1 when unknown
+int codec_find(const char* name)
+{
+    for (int i = 0; i < CODECS; ++i)
+        if (!strcmp(codec_info(i).name, name)) return i;
+    return -1;
+}
+
+struct codec_lib {
+    void* lz4;
+    void* zstd;
+    int (*lz4_compress)(const char* src, char* dst, int sz, int cap);
+    int (*lz4_decompress)(const char* src, char* dst, int sz, int cap);
+    void* (*zstd_create_cctx)(void);
+    size_t (*zstd_free_cctx)(void* cctx);
+    size_t (*zstd_compress)(void* cctx, void* dst, size_t cap, const void* src, size_t sz, int level);
+    void* (*zstd_create_dctx)(void);
+    size_t (*zstd_free_dctx)(void* dctx);
+    size_t (*zstd_decompress)(void* dctx, void* dst, size_t cap, const void* src, size_t sz);
+    unsigned (*zstd_is_error)(size_t code);
+    void* cctx;     //zstd contexts, kept across records
+    void* dctx;
+};
+
+//loads library of record type, 'l' lz4 or 'z' zstd
+int codec_load(struct codec_lib* lib, char type)
+{
+    if (type == 'l' && !lib->lz4) {
+        lib->lz4 = dlopen("liblz4.so.1", RTLD_NOW);
+        if (lib->lz4) {
+            lib->lz4_compress = dlsym(lib->lz4, "LZ4_compress_default");
+            lib->lz4_decompress = dlsym(lib->lz4, "LZ4_decompress_safe");
+        }
+        if (!lib->lz4 || !lib->lz4_compress || !lib->lz4_decompress) {
+            fprintf(stderr, "ERROR: could not load lz4: %s\n", dlerror());
+            if (lib->lz4) dlclose(lib->lz4);
+            lib->lz4 = 0;
+            return -1;
+        }
+    }
+
+    if (type == 'z' && !lib->zstd) {
+        lib->zstd = dlopen("libzstd.so.1", RTLD_NOW);
+        if (lib->zstd) {
+            lib->zstd_create_cctx = dlsym(lib->zstd, "ZSTD_createCCtx");
+            lib->zstd_free_cctx = dlsym(lib->zstd, "ZSTD_freeCCtx");
+            lib->zstd_compress = dlsym(lib->zstd, "ZSTD_compressCCtx");
+            lib->zstd_create_dctx = dlsym(lib->zstd, "ZSTD_createDCtx");
+            lib->zstd_free_dctx = dlsym(lib->zstd, "ZSTD_freeDCtx");
+            lib->zstd_decompress = dlsym(lib->zstd, "ZSTD_decompressDCtx");
+            lib->zstd_is_error = dlsym(lib->zstd, "ZSTD_isError");
+        }
+        if (!lib->zstd || !lib->zstd_create_cctx || !lib->zstd_free_cctx || !lib->zstd_compress ||
+            !lib->zstd_create_dctx || !lib->zstd_free_dctx || !lib->zstd_decompress || !lib->zstd_is_error) {
+            fprintf(stderr, "ERROR: could not load zstd: %s\n", dlerror());
+            if (lib->zstd) dlclose(lib->zstd);
+            lib->zstd = 0;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void codec_free(struct codec_lib* lib)
+{
+    if (lib->cctx) lib->zstd_free_cctx(lib->cctx);
+    if (lib->dctx) lib->zstd_free_dctx(lib->dctx);
+    if (lib->lz4) dlclose(lib->lz4);
+    if (lib->zstd) dlclose(lib->zstd);
+    memset(lib, 0, sizeof(*lib));
+}
+
+//compresses block with codec into at most cap bytes
+//
+//returns compressed size, 0 when it does not fit or fails
+size_t codec_compress(struct codec_lib* lib, int codec, const char* src, size_t sz, char* dst, size_t cap)
+{
+    struct codec c = codec_info(codec);
+    if (codec_load(lib, c.type)) return 0;
+
+    if (c.type == 'l') {
+        int r = lib->lz4_compress(src, dst, sz, cap);
+        return r > 0 ? r : 0;
+    }
+
+    if (!lib->cctx) lib->cctx = lib->zstd_create_cctx();
+    if (!lib->cctx) return 0;
+    size_t r = lib->zstd_compress(lib->cctx, dst, cap, src, sz, c.level);
+    return lib->zstd_is_error(r) ? 0 : r;
+}
+
+//decompresses meat of record type into exactly sz bytes
+int codec_decompress(struct codec_lib* lib, char type, const char* src, size_t packed, char* dst, size_t sz)
+{
+    if (codec_load(lib, type)) return -1;
+
+    if (type == 'l') return lib->lz4_decompress(src, dst, packed, sz) == (int)sz ? 0 : -1;
+
+    if (!lib->dctx) lib->dctx = lib->zstd_create_dctx();
+    if (!lib->dctx) return -1;
+    return lib->zstd_decompress(lib->dctx, dst, sz, src, packed) == sz ? 0 : -1;
+}
+
+//
+//output file of decoder
+//
+//holes are recreated by seeking on seekable outputs
+//streamed outputs (pipes, sockets, devices) get zeros written instead,
+//so segments must come in ascending offset order
+//
+//seekable outputs combine meat of adjacent segments into writes ending
+//at file system block boundaries, so segments ending mid-block do not
+//leave the kernel a partial block to read back and merge; only the
+//partial block at the end of a run of data is written short, when a
+//hole, another kind of record or the end of the stream comes
+//
+#define COMBINE_BUFF_SZ (1 << 20)
+#define COMBINE_CONN_SZ (64 << 10) //per stream of event loop decoders, thousands of them
+
+//
+//durability of decoded output
+//
+//none leaves writeback to the kernel, fdatasync syncs each output at the
+//end, writebehind does too and starts writeback of every sync_size bytes
+//written, waiting for the previous ones and dropping them from page
+//cache, so dirty pages of a restore stay within two of them instead of
+//piling up to the dirty limit and stalling writers of other processes;
+//syncfs syncs the file systems of outputs once at the end, the daemon
+//syncs them once for all streams ending meanwhile before answering them
+//
+enum { DURABLE_NONE, DURABLE_FDATASYNC, DURABLE_WRITEBEHIND, DURABLE_SYNCFS };
+
+#define SYNC_SIZE (64 << 20)
+
+//parses --durability name, returns -1 when unknown
+int durability_mode(const char* name)
+{
+    if (!strcmp(name, "none")) return DURABLE_NONE;
+    if (!strcmp(name, "fdatasync")) return DURABLE_FDATASYNC;
+    if (!strcmp(name, "writebehind")) return DURABLE_WRITEBEHIND;
+    if (!strcmp(name, "syncfs")) return DURABLE_SYNCFS;
+    return -1;
+}
+
+struct ursparse_output {
+    int fd;
+    int seekable;
+    off_t pos;    //end of last segment written
+    int fd_src;   //output file opened for reading back-references
+    char* zeros;  //read only zero pages, streamed outputs only
+    int splice;   //zeros are vmspliced into pipe output
+    struct tree_hash* hash; //hash of written content when verifying
+    int verified;
+    int ended;    //trailer seen
+    struct throttle* throttle; //of meat writes, 0 when not throttled
+    char* combine;       //meat waiting for a block boundary, 0 when not combining
+    size_t combine_cap;
+    size_t combine_len;
+    off_t combine_start; //offset of combined meat
+    size_t blk;          //of file system
+    int durability;
+    off_t sync_size;     //of write-behind
+    off_t dirty;         //bytes written since writeback was last started
+    off_t dirty_lo;      //range written since then
+    off_t dirty_hi;
+    off_t behind_lo;     //range under writeback, waited for next time
+    off_t behind_hi;
+};
+
+//starts writeback of range written since last time, once it is sync_size
+//bytes, after waiting for the previous one and dropping it from cache
+int output_write_behind(struct ursparse_output* out, int all)
+{
+    if (!all && out->dirty < out->sync_size) return 0;
+
+    if (out->behind_hi > out->behind_lo) {
+        off_t len = out->behind_hi - out->behind_lo;
+        if (sync_file_range(out->fd, out->behind_lo, len,
+                SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER)) {
+            perror("ERROR: could not write back output file");
+            return -1;
+        }
+        posix_fadvise(out->fd, out->behind_lo, len, POSIX_FADV_DONTNEED);
+    }
+
+    out->behind_lo = out->dirty_lo;
+    out->behind_hi = out->dirty_hi;
+    out->dirty = out->dirty_hi = 0;
+    if (all || out->behind_hi <= out->behind_lo) return 0;
+
+    if (sync_file_range(out->fd, out->behind_lo, out->behind_hi - out->behind_lo, SYNC_FILE_RANGE_WRITE)) {
+        perror("ERROR: could not write back output file");
+        return -1;
+    }
+    return 0;
+}
+
+//accounts range written to seekable output
+int output_written(struct ursparse_output* out, off_t offset, off_t sz)
+{
+    if (out->durability != DURABLE_WRITEBEHIND || !out->seekable || !sz) return 0;
+
+    if (!out->dirty_hi || offset < out->dirty_lo) out->dirty_lo = offset;
+    if (offset + sz > out->dirty_hi) out->dirty_hi = offset + sz;
+    out->dirty += sz;
+    return output_write_behind(out, 0);
+}
+
+//makes output durable as its mode asks, once all of it is written
+//syncfs is left to callers syncing more outputs at once
+int output_sync(struct ursparse_output* out)
+{
+    if (!out->seekable || out->durability == DURABLE_NONE || out->durability == DURABLE_SYNCFS) return 0;
+
+    if (out->durability == DURABLE_WRITEBEHIND && output_write_behind(out, 1)) return -1;
+
+    if (fdatasync(out->fd)) {
+        perror("ERROR: could not sync output file");
+        return -1;
+    }
+    return 0;
+}
+
+//syncs file systems of outputs, each once
+int output_syncfs(struct ursparse_output* outs, int count)
+{
+    dev_t devs[count];
+    int synced = 0;
+    for (int i = 0; i < count; ++i) {
+        struct stat st;
+        if (outs[i].durability != DURABLE_SYNCFS || !outs[i].seekable || fstat(outs[i].fd, &st)) continue;
+
+        int seen = 0;
+        for (int j = 0; j < synced; ++j) seen |= devs[j] == st.st_dev;
+        if (seen) continue;
+
+        if (syncfs(outs[i].fd)) {
+            perror("ERROR: could not sync file system of output file");
+            return -1;
+        }
+        devs[synced++] = st.st_dev;
+    }
+    return 0;
+}
+
+//starts combining meat of seekable output in buffer of about cap bytes
+int output_combine_init(struct ursparse_output* out, size_t cap)
+{
+    struct stat st;
+    if (!out->seekable || fstat(out->fd, &st)) return 0;
+
+    out->blk = st.st_blksize > 0 ? st.st_blksize : 4096;
+    out->combine_cap = cap < 4 * out->blk ? 4 * out->blk : cap;
+    out->combine_cap -= out->combine_cap % out->blk;
+    out->combine = malloc(out->combine_cap);
+    if (!out->combine) {
+        fprintf(stderr, "ERROR: could not allocate memory: %ld bytes\n", out->combine_cap);
+        return -1;
+    }
+    return 0;
+}
+
+//writes meat at offset, paced by throttle
+int output_pwrite(struct ursparse_output* out, const char* buff, size_t sz, off_t offset)
+{
+    while (sz > 0) {
+        double start;
+        size_t n = throttle_take(out->throttle, sz, &start);
+        ssize_t r = pwrite(out->fd, buff, n, offset);
+        throttle_done(out->throttle, n, r > 0 ? r : 0, start);
+
+        if (-1 == r) {
+            if (errno == EINTR) continue;
+            perror("ERROR: could not write to output file");
+            return -1;
+        }
+
+        if (output_written(out, offset, r)) return -1;
+        buff += r;
+        sz -= r;
+        offset += r;
+    }
+    return 0;
+}
+
+//writes all combined meat, called before anything else touches the file
+int output_flush(struct ursparse_output* out)
+{
+    if (!out->combine_len) return 0;
+
+    int r = output_pwrite(out, out->combine, out->combine_len, out->combine_start);
+    out->combine_len = 0;
+    return r;
+}
+
+//writes combined meat of all outputs when the next read of fd may block
+//so a stream that pauses, like --watch, does not hold its last changes back
+int output_flush_idle(int fd, struct ursparse_output* outs, int count)
+{
+    int pending = 0;
+    for (int i = 0; i < count; ++i) pending |= outs[i].combine_len != 0;
+    if (!pending) return 0;
+
+    struct pollfd p = { .fd = fd, .events = POLLIN };
+    if (poll(&p, 1, 0) == 1) return 0;
+
+    for (int i = 0; i < count; ++i)
+        if (output_flush(&outs[i])) return -1;
+    return 0;
+}
+
+//adds meat at output position to combined meat
+//writes it up to the last block boundary when there is no more room
+int output_combine(struct ursparse_output* out, const char* buff, size_t sz)
+{
+    if (out->combine_len && out->combine_start + out->combine_len != out->pos && output_flush(out)) return -1;
+    if (!out->combine_len) out->combine_start = out->pos;
+    out->pos += sz;
+
+    //large meat goes out from its own buffer up to a block boundary
+    off_t end = out->combine_start + out->combine_len + sz;
+    if (!out->combine_len && sz >= out->combine_cap) {
+        size_t n = end - end % out->blk - out->combine_start;
+        if (output_pwrite(out, buff, n, out->combine_start)) return -1;
+        out->combine_start += n;
+        buff += n;
+        sz -= n;
+    }
+
+    while (sz > 0) {
+        size_t n = out->combine_cap - out->combine_len;
+        if (n > sz) n = sz;
+        memcpy(out->combine + out->combine_len, buff, n);
+        out->combine_len += n;
+        buff += n;
+        sz -= n;
+
+        if (out->combine_len < out->combine_cap) break;
+
+        off_t aligned = out->combine_start + out->combine_len;
+        aligned -= aligned % out->blk;
+        size_t head = aligned - out->combine_start;
+        if (output_pwrite(out, out->combine, head, out->combine_start)) return -1;
+
+        memmove(out->combine, out->combine + head, out->combine_len - head);
+        out->combine_len -= head;
+        out->combine_start = aligned;
+    }
+    return 0;
+}
+
+void output_combine_free(struct ursparse_output* out)
+{
+    free(out->combine);
+    out->combine = 0;
+    out->combine_len = 0;
+}
+
+//
+//writes the meat to output file
+//
+int do_meat(struct ursparse_output* out, const char* buff, size_t sz, size_t* out_sz)
+{
+    if (!out)    return -1;
+    if (!buff)   return -1;
+    if (!sz)     return -2;
+    if (!out_sz) return -3;
+
+    if (out->combine) {
+        if (out->hash) tree_hash_update(out->hash, buff, sz);
+        if (output_combine(out, buff, sz)) {
+            *out_sz = 0;
+            return -4;
+        }
+        *out_sz = sz;
+        return sz;
+    }
+
+    size_t written_bytes = 0;
+
+    while (sz > 0) {
+        double start;
+        size_t n = throttle_take(out->throttle, sz, &start);
+        ssize_t r = write(out->fd, buff, n);
+        throttle_done(out->throttle, n, r > 0 ? r : 0, start);
+
+        if (-1 == r) {
+            perror("ERROR: could not write to output file");
+            *out_sz = written_bytes;
+            return -4;
+        }
+
+        if (out->hash) tree_hash_update(out->hash, buff, r);
+        if (output_written(out, out->pos + written_bytes, r)) {
+            *out_sz = written_bytes + r;
+            return -4;
+        }
+
+        written_bytes += r;
+        sz -= r;
+        buff += r;
+    }
+
+    out->pos += written_bytes;
+    *out_sz = written_bytes;
+    return written_bytes;
+}
+
+#define ZEROS_SZ (1 << 20)
+
+//
+//writes zeros to streamed output
+//
+//zeros come from a read only anonymous mapping, all of it backed by the
+//kernel zero page, so nothing is allocated or cleared per hole
+//pipes get references to it with vmsplice, other outputs a plain write
+//
+int do_zeros(struct ursparse_output* out, off_t size)
+{
+    if (!out->zeros) {
+        out->zeros = mmap(0, ZEROS_SZ, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (out->zeros == MAP_FAILED) {
+            out->zeros = 0;
+            perror("ERROR: could not map zero pages");
+            return -1;
+        }
+
+        //larger pipe means fewer wakeups of the reader
+        out->splice = -1 != fcntl(out->fd, F_SETPIPE_SZ, ZEROS_SZ) || errno == EPERM;
+    }
+
+    while (size > 0) {
+        size_t sz = size > ZEROS_SZ ? ZEROS_SZ : size;
+        ssize_t r = -1;
+
+        if (out->splice) {
+            struct iovec iov = { out->zeros, sz };
+            r = vmsplice(out->fd, &iov, 1, 0);
+            if (r == -1 && (errno == EBADF || errno == EINVAL)) {
+                //not a pipe
+                out->splice = 0;
+                continue;
+            }
+        } else {
+            r = write(out->fd, out->zeros, sz);
+        }
+
+        if (r == -1) {
+            if (errno == EINTR) continue;
+            perror("ERROR: could not write hole to output file");
+            return -1;
+        }
+
+        size -= r;
+        out->pos += r;
+    }
+
+    return 0;
+}
+
+//
+//writes the hole to output file
+//
+int do_hole(struct ursparse_output* out, off_t offset)
+{
+    if ((!out->seekable || out->hash) && offset < out->pos) {
+        fprintf(stderr, "ERROR: segment %ld before output position %ld, %s needs ascending segments\n",
+            offset, out->pos, out->seekable ? "verifying" : "streamed output");
+        return -1;
+    }
+
+    if (out->hash) tree_hash_zeros(out->hash, offset - out->pos);
+
+    if (!out->seekable) {
+        return do_zeros(out, offset - out->pos);
+    }
+
+    //meat right after combined meat keeps combining
+    if (out->combine) {
+        if (offset != out->pos && output_flush(out)) return -1;
+        out->pos = offset;
+        return 0;
+    }
+
+    off_t r = lseek(out->fd, offset, SEEK_SET);
+    if ((off_t)-1 == r) {
+        perror("ERROR: could not write hole to output file");
+        return -1;
+    }
+
+    out->pos = offset;
+    return 0;
+}
+
+//clears range of output file and allocates it
+int prealloc_range(struct ursparse_output* out, off_t offset, off_t size)
+{
+    //zero range also clears data already in output file
+    if (!fallocate(out->fd, FALLOC_FL_ZERO_RANGE, offset, size)) return 0;
+
+    //otherwise clear it as hole, then allocate the zeros
+    if (errno == EOPNOTSUPP && !fallocate(out->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size)) {
+        if (!fallocate(out->fd, 0, offset, size)) return 0;
+        if (errno == EOPNOTSUPP) {
+            //a hole reads as zeros too, only the file size is left to extend
+            struct stat st;
+            if (!fstat(out->fd, &st) && st.st_size < offset + size && ftruncate(out->fd, offset + size)) {
+                perror("ERROR: could not extend output file");
+                return -1;
+            }
+            return 0;
+        }
+    }
+
+    if (errno != EOPNOTSUPP) {
+        perror("ERROR: could not preallocate range in output file");
+        return -1;
+    }
+
+    //no way to clear it but writing zeros
+    if (!out->zeros) {
+        out->zeros = mmap(0, ZEROS_SZ, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (out->zeros == MAP_FAILED) {
+            out->zeros = 0;
+            perror("ERROR: could not map zero pages");
+            return -1;
+        }
+    }
+
+    while (size > 0) {
+        ssize_t r = pwrite(out->fd, out->zeros, size > ZEROS_SZ ? ZEROS_SZ : size, offset);
+        if (r == -1 && errno == EINTR) continue;
+        if (r == -1) {
+            perror("ERROR: could not clear unwritten range in output file");
+            return -1;
+        }
+        offset += r;
+        size -= r;
+    }
+    return 0;
+}
+
+//
+//preallocates unwritten range in output file
+//
+int do_prealloc(struct ursparse_output* out, off_t offset, off_t size)
+{
+    if (!out->seekable || out->hash) {
+        //reads as zeros
+        int r = do_hole(out, offset + size);
+        if (r || !out->seekable) return r;
+    }
+
+    out->pos = offset + size;
+    if (output_flush(out)) return -1;
+
+    int r = prealloc_range(out, offset, size);
+    return r ? r : output_written(out, offset, size);
+}
+
+//
+//hashes already written range of output file
+//
+int do_ref_hash(struct ursparse_output* out, off_t size, off_t source)
+{
+    char buff[65536];
+    while (size > 0) {
+        ssize_t r = pread(out->fd_src, buff, size > sizeof(buff) ? sizeof(buff) : size, source);
+        if (r == -1) {
+            perror("ERROR: could not read back-reference");
+            return -1;
+        }
+        if (!r) {
+            fprintf(stderr, "ERROR: back-reference past end of output file\n");
+            return -1;
+        }
+        tree_hash_update(out->hash, buff, r);
+        source += r;
+        size -= r;
+    }
+    return 0;
+}
+
+//
+//copies size bytes at source of fd_src to offset of fd
+//clones them when the file system supports it
+//
+//what => names the copied range in errors
+//
+int copy_range(int fd_src, off_t source, int fd, off_t offset, off_t size, const char* what)
+{
+    struct file_clone_range clone = { fd_src, source, size, offset };
+    if (!ioctl(fd, FICLONERANGE, &clone)) return 0;
+
+    while (size > 0) {
+        ssize_t r = copy_file_range(fd_src, &source, fd, &offset, size, 0);
+        if (r == -1 && (errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP || errno == ENOSYS)) break;
+        if (r == -1) {
+            fprintf(stderr, "ERROR: could not copy %s: %s\n", what, strerror(errno));
+            return -1;
+        }
+        if (!r) {
+            fprintf(stderr, "ERROR: %s past end of its file\n", what);
+            return -1;
+        }
+        size -= r;
+    }
+
+    //plain copy through a buffer
+    char buff[65536];
+    while (size > 0) {
+        ssize_t r = pread(fd_src, buff, size > sizeof(buff) ? sizeof(buff) : size, source);
+        if (r == -1) {
+            fprintf(stderr, "ERROR: could not read %s: %s\n", what, strerror(errno));
+            return -1;
+        }
+        if (!r) {
+            fprintf(stderr, "ERROR: %s past end of its file\n", what);
+            return -1;
+        }
+        for (ssize_t done = 0; done < r; ) {
+            ssize_t w = pwrite(fd, buff + done, r - done, offset + done);
+            if (w == -1) {
+                fprintf(stderr, "ERROR: could not write %s: %s\n", what, strerror(errno));
+                return -1;
+            }
+            done += w;
+        }
+        source += r;
+        offset += r;
+        size -= r;
+    }
+
+    return 0;
+}
+
+//
+//copies already written range of output file to offset
+//clones it when the file system supports it
+//
+int do_ref(struct ursparse_output* out, off_t offset, off_t size, off_t source)
+{
+    if (!out->seekable) {
+        fprintf(stderr, "ERROR: back-references need a seekable output file\n");
+        return -1;
+    }
+
+    if (output_flush(out)) return -1;
+
+    if (out->fd_src == -1) {
+        //output is usually opened write only by the shell
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", out->fd);
+        out->fd_src = open(path, O_RDONLY);
+        if (out->fd_src == -1) {
+            perror("ERROR: could not open output file for reading");
+            return -1;
+        }
+    }
+
+    if (out->hash) {
+        int r = do_hole(out, offset);
+        if (r) return r;
+
+        r = do_ref_hash(out, size, source);
+        if (r) return r;
+    }
+    out->pos = offset + size;
+
+    int r = copy_range(out->fd_src, source, out->fd, offset, size, "back-reference");
+    return r ? r : output_written(out, offset, size);
+}
+
+//
+//applies trailer, extending output to logical size of file
+//and checking its hash when verifying
+//
+int do_trailer(struct ursparse_output* out, off_t size, const char* hex)
+{
+    //watched source shrank since the previous trailer
+    if (out->pos > size && out->ended && out->seekable && !out->hash) {
+        if (output_flush(out)) return -1;
+        fprintf(stderr, "INFO: file shrank to %ld, output is not truncated\n", size);
+        out->pos = size;
+    }
+
+    if (out->pos > size) {
+        fprintf(stderr, "ERROR: segments past end of file size %ld\n", size);
+        return -1;
+    }
+
+    int r = do_hole(out, size);
+    if (!r) r = output_flush(out);
+    if (r) return r;
+
+    out->ended = 1;
+
+    struct stat st;
+    if (out->seekable && !fstat(out->fd, &st) && S_ISREG(st.st_mode) && st.st_size < size) {
+        if (-1 == ftruncate(out->fd, size)) {
+            perror("ERROR: could not extend output file");
+            return -1;
+        }
+    }
+
+    if (!out->hash) return 0;
+
+    if (!hex) {
+        fprintf(stderr, "ERROR: trailer carries no hash to verify\n");
+        return -1;
+    }
+
+    unsigned char digest[HASH_SZ];
+    char digest_hex[2 * HASH_SZ + 1];
+    tree_hash_final(out->hash, digest);
+    hash_hex(digest, digest_hex);
+
+    if (memcmp(digest_hex, hex, 2 * HASH_SZ)) {
+        fprintf(stderr, "ERROR: hash mismatch, expected %.*s got %s\n", 2 * HASH_SZ, hex, digest_hex);
+        return -1;
+    }
+
+    fprintf(stderr, "INFO: hash verified %s\n", digest_hex);
+    out->verified = 1;
+    return 0;
+}
+
+//
+//fan-out of decoded stream into more output files
+//
+//meat is written from the same buffer to all outputs at once, a thread
+//per extra output, holes, unwritten ranges, back-references and trailers
+//are applied to each output in turn
+//
+struct fanout {
+    struct ursparse_output* outs;
+    int count;
+    pthread_t* threads; //of outs 1..count-1, outs[0] is written by caller
+    pthread_mutex_t lock;
+    pthread_cond_t go;
+    pthread_cond_t done;
+    unsigned long gen;  //of buffer being written
+    int pending;        //outputs still writing it
+    int failed;
+    int stop;
+    const char* buff;
+    size_t sz;
+};
+
+#define FANOUT_BUFF_SZ (1 << 20)
+
+struct fanout_worker {
+    struct fanout* f;
+    int i;
+};
+
+void* fanout_worker(void* arg)
+{
+    struct fanout_worker* w = arg;
+    struct fanout* f = w->f;
+    unsigned long gen = 0;
+
+    pthread_mutex_lock(&f->lock);
+    while (1) {
+        while (gen == f->gen && !f->stop) pthread_cond_wait(&f->go, &f->lock);
+        if (f->stop) break;
+        gen = f->gen;
+        pthread_mutex_unlock(&f->lock);
+
+        size_t written = 0;
+        int r = do_meat(&f->outs[w->i], f->buff, f->sz, &written);
+
+        pthread_mutex_lock(&f->lock);
+        if (r < 0) f->failed = 1;
+        if (!--f->pending) pthread_cond_signal(&f->done);
+    }
+    pthread_mutex_unlock(&f->lock);
+
+    free(w);
+    return 0;
+}
+
+int fanout_init(struct fanout* f, struct ursparse_output* outs, int count)
+{
+    memset(f, 0, sizeof(*f));
+    f->outs = outs;
+    f->count = count;
+    pthread_mutex_init(&f->lock, 0);
+    pthread_cond_init(&f->go, 0);
+    pthread_cond_init(&f->done, 0);
+
+    f->threads = calloc(count, sizeof(*f->threads));
+    if (!f->threads) {
+        fprintf(stderr, "ERROR: could not allocate memory for output threads\n");
+        f->count = 1;
+        return -1;
+    }
+
+    for (int i = 1; i < count; ++i) {
+        struct fanout_worker* w = malloc(sizeof(*w));
+        if (w) {
+            w->f = f;
+            w->i = i;
+        }
+        if (!w || pthread_create(&f->threads[i], 0, fanout_worker, w)) {
+            fprintf(stderr, "ERROR: could not start output thread\n");
+            free(w);
+            f->count = i;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void fanout_free(struct fanout* f)
+{
+    pthread_mutex_lock(&f->lock);
+    f->stop = 1;
+    pthread_cond_broadcast(&f->go);
+    pthread_mutex_unlock(&f->lock);
+
+    for (int i = 1; i < f->count; ++i)
+        pthread_join(f->threads[i], 0);
+
+    free(f->threads);
+    pthread_cond_destroy(&f->done);
+    pthread_cond_destroy(&f->go);
+    pthread_mutex_destroy(&f->lock);
+}
+
+//writes the meat to all outputs, see do_meat
+int do_fanout_meat(struct fanout* f, const char* buff, size_t sz, size_t* out_sz)
+{
+    pthread_mutex_lock(&f->lock);
+    f->buff = buff;
+    f->sz = sz;
+    f->pending = f->count - 1;
+    f->gen++;
+    pthread_cond_broadcast(&f->go);
+    pthread_mutex_unlock(&f->lock);
+
+    int r = do_meat(&f->outs[0], buff, sz, out_sz);
+
+    pthread_mutex_lock(&f->lock);
+    while (f->pending) pthread_cond_wait(&f->done, &f->lock);
+    if (f->failed) r = -4;
+    pthread_mutex_unlock(&f->lock);
+
+    return r;
+}
+
+int write_all(int fd, const char* buff, size_t sz)
+{
+    while (sz > 0) {
+        ssize_t r = write(fd, buff, sz);
+        if (r == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buff += r;
+        sz -= r;
+    }
+    return 0;
+}
+
+//reads chunk of stream, short only at its end
+ssize_t sink_read(int fd, char* buff, size_t sz)
+{
+    size_t done = 0;
+    while (done < sz) {
+        ssize_t r = read(fd, buff + done, sz - done);
+        if (r == -1 && errno == EINTR) continue;
+        if (r == -1) return -1;
+        if (!r) break;
+        done += r;
+    }
+    return done;
+}
+
+//
+//chunk store of decoder
+//
+//a directory with an index file and pack files pack.ID, chunks are
+//appended back to back to the current pack and the index maps the hash
+//of each chunk to its pack, offset and size and to when it was last used;
+//the index is a header followed by an open addressing table of entries,
+//it is memory mapped so a lookup touches only the pages it probes
+//
+//decoders sharing the store lock the index file, shared while they look up
+//and copy a chunk and exclusive while they add one, so any number of them
+//copy chunks at once; the table doubles once entries fill STORE_LOAD of it,
+//decoders map it again when they find it grew
+//
+//the store keeps at most --store-size bytes of chunks, the least recently
+//used chunk, approximated
+//as the oldest of STORE_SAMPLE random ones, is evicted to make room; its
+//range of the pack is punched out and a pack is removed once none of its
+//chunks are left
+//
+//chunks a stream stores or references are pinned until it ends, so a
+//later reference of the same stream finds them; the store grows past its
+//size rather than evict a pinned chunk; decoders hold the store directory
+//locked shared, the first one to lock it exclusively clears pins left by
+//decoders that died; a reference to a chunk evicted before its stream
+//started leaves its range unwritten and is reported, the daemon names it
+//in its answer so the sender ships it again
+//
+#define CDC_MIN_SZ (4 << 10)  //sizes of content defined chunks
+#define CDC_AVG_SZ (16 << 10)
+#define CDC_MAX_SZ (64 << 10)
+#define STORE_MAGIC "URSSTO01"
+#define STORE_PACKS 1024
+#define STORE_PACK_SZ (1LL << 30)
+#define STORE_SAMPLE 16
+#define STORE_LOAD 0.75
+#define STORE_MIN_CAP (1 << 12) //entries of table of new store
+#define STORE_SIZE (16LL << 30)  //default most bytes of chunks
+
+//index file header, all counters over the life of the store
+struct store_header {
+    char magic[8];
+    uint64_t cap;        //entries of table, a power of two
+    uint64_t count;      //chunks stored
+    uint64_t bytes;      //of chunks stored
+    uint64_t limit;      //most bytes of chunks
+    uint64_t tick;       //advanced by every use of a chunk
+    uint64_t pack_end;   //append position of current pack
+    uint32_t pack;       //slot of current pack
+    uint32_t pack_next;  //id of next pack
+    uint64_t hits;       //chunk references copied
+    uint64_t misses;     //chunk references not found
+    uint64_t stored;     //chunks added
+    uint64_t duplicates; //chunks shipped again while stored
+    uint64_t evicted;
+    uint32_t pack_id[STORE_PACKS];   //of pack in slot, 0 when free
+    uint64_t pack_live[STORE_PACKS]; //chunk bytes left in pack
+};
+
+struct store_entry {
+    unsigned char digest[HASH_SZ];
+    uint64_t offset; //in pack
+    uint64_t used;   //tick of last use
+    uint32_t size;   //0 when entry is free
+    uint32_t pack;   //slot
+    uint32_t pins;   //streams using it, it is not evicted meanwhile
+};
+
+struct digests {
+    unsigned char* v;
+    size_t count;
+    size_t cap;
+};
+
+#define STORE_TABLE ((sizeof(struct store_header) + 4095) & ~4095) //offset of table in index
+
+struct chunk_store {
+    const char* path;
+    off_t limit;       //most bytes of chunks, 0 keeps that of store
+    int opened;
+    int dir;
+    int fd_index;
+    struct store_header* head; //mapped index
+    struct store_entry* table;
+    size_t map_sz;
+    int pack_fd[STORE_PACKS]; //opened packs, -1 when not opened
+    uint32_t pack_id[STORE_PACKS];
+    uint64_t random;
+    EVP_MD_CTX* md;    //checks chunks before storing them
+    off_t hits;        //of this stream
+    off_t stored;
+    off_t duplicates;
+    struct digests pinned; //chunks this stream pinned, unpinned when it ends
+    struct digests missed; //references of this stream not found
+    int over;          //store grew past its size
+};
+
+//adds digest to list
+int digests_add(struct digests* l, const unsigned char* digest)
+{
+    if (l->count == l->cap) {
+        size_t cap = l->cap ? 2 * l->cap : 1024;
+        unsigned char* v = realloc(l->v, cap * HASH_SZ);
+        if (!v) {
+            fprintf(stderr, "ERROR: could not allocate memory for chunk hashes\n");
+            return -1;
+        }
+        l->v = v;
+        l->cap = cap;
+    }
+    memcpy(l->v + l->count++ * HASH_SZ, digest, HASH_SZ);
+    return 0;
+}
+
+//returns entry of hash, or free entry where it goes
+struct store_entry* chunk_store_find(const struct chunk_store* s, const unsigned char* digest)
+{
+    uint64_t word;
+    memcpy(&word, digest, sizeof(word));
+    uint64_t mask = s->head->cap - 1;
+
+    for (uint64_t i = word & mask; ; i = (i + 1) & mask) {
+        struct store_entry* e = &s->table[i];
+        if (!e->size || !memcmp(e->digest, digest, HASH_SZ)) return e;
+    }
+}
+
+//locks or unlocks file of store, retrying when interrupted
+int store_flock(const struct chunk_store* s, int fd, int op)
+{
+    while (flock(fd, op)) {
+        if (errno == EINTR) continue;
+        fprintf(stderr, "ERROR: could not %s chunk store %s: %s\n", op == LOCK_UN ? "unlock" : "lock", s->path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int chunk_store_lock(struct chunk_store* s, int op);
+int chunk_store_release(struct chunk_store* s);
+
+//unpins chunks pinned by this stream
+void chunk_store_unpin(struct chunk_store* s)
+{
+    if (!s->pinned.count || !s->head || chunk_store_lock(s, LOCK_SH)) return;
+
+    for (size_t i = 0; i < s->pinned.count; ++i) {
+        struct store_entry* e = chunk_store_find(s, s->pinned.v + i * HASH_SZ);
+        if (e->size && e->pins) __atomic_sub_fetch(&e->pins, 1, __ATOMIC_RELAXED);
+    }
+    s->pinned.count = 0;
+
+    chunk_store_release(s);
+}
+
+void chunk_store_close(struct chunk_store* s)
+{
+    free(s->missed.v);
+    memset(&s->missed, 0, sizeof(s->missed));
+    if (!s->opened) return;
+    chunk_store_unpin(s);
+    free(s->pinned.v);
+    memset(&s->pinned, 0, sizeof(s->pinned));
+    for (int i = 0; i < STORE_PACKS; ++i)
+        if (s->pack_fd[i] != -1) close(s->pack_fd[i]);
+    if (s->head) munmap(s->head, s->map_sz);
+    if (s->fd_index != -1) close(s->fd_index);
+    if (s->dir != -1) close(s->dir);
+    EVP_MD_CTX_free(s->md);
+    s->opened = 0;
+}
+
+//maps index as large as its table is now
+int chunk_store_map(struct chunk_store* s, uint64_t cap)
+{
+    if (s->head) munmap(s->head, s->map_sz);
+
+    s->map_sz = STORE_TABLE + cap * sizeof(struct store_entry);
+    s->head = mmap(0, s->map_sz, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd_index, 0);
+    if (s->head == MAP_FAILED) {
+        s->head = 0;
+        fprintf(stderr, "ERROR: could not map chunk store %s: %s\n", s->path, strerror(errno));
+        return -1;
+    }
+
+    s->table = (struct store_entry*)((char*)s->head + STORE_TABLE);
+    return 0;
+}
+
+//locks index, shared or exclusive, mapping it again when another decoder grew it
+int chunk_store_lock(struct chunk_store* s, int op)
+{
+    if (store_flock(s, s->fd_index, op)) return -1;
+
+    uint64_t cap = s->head->cap;
+    if (STORE_TABLE + cap * sizeof(struct store_entry) == s->map_sz) return 0;
+    if (!chunk_store_map(s, cap)) return 0;
+
+    chunk_store_release(s);
+    return -1;
+}
+
+//unlocks index
+int chunk_store_release(struct chunk_store* s)
+{
+    return store_flock(s, s->fd_index, LOCK_UN);
+}
+
+//doubles table, exclusive lock held
+int chunk_store_grow(struct chunk_store* s)
+{
+    uint64_t cap = s->head->cap;
+    uint64_t count = s->head->count;
+
+    struct store_entry* entries = malloc(count * sizeof(*entries));
+    if (!entries) {
+        fprintf(stderr, "ERROR: could not allocate memory for chunk store\n");
+        return -1;
+    }
+
+    uint64_t n = 0;
+    for (uint64_t i = 0; i < cap; ++i)
+        if (s->table[i].size) entries[n++] = s->table[i];
+
+    if (ftruncate(s->fd_index, STORE_TABLE + 2 * cap * sizeof(struct store_entry)) || chunk_store_map(s, 2 * cap)) {
+        fprintf(stderr, "ERROR: could not grow chunk store %s: %s\n", s->path, strerror(errno));
+        free(entries);
+        return -1;
+    }
+
+    //entries move to where the wider mask sends them
+    s->head->cap = 2 * cap;
+    memset(s->table, 0, cap * sizeof(struct store_entry));
+    for (uint64_t i = 0; i < n; ++i)
+        *chunk_store_find(s, entries[i].digest) = entries[i];
+
+    free(entries);
+    return 0;
+}
+
+//creates index of new store, exclusive lock held
+int chunk_store_create(struct chunk_store* s)
+{
+    uint64_t cap = STORE_MIN_CAP;
+    if (ftruncate(s->fd_index, STORE_TABLE + cap * sizeof(struct store_entry))) return -1;
+
+    struct store_header head;
+    memset(&head, 0, sizeof(head));
+    memcpy(head.magic, STORE_MAGIC, sizeof(head.magic));
+    head.cap = cap;
+    head.limit = s->limit ? s->limit : STORE_SIZE;
+    head.pack_next = 1;
+    return pwrite(s->fd_index, &head, sizeof(head), 0) == sizeof(head) ? 0 : -1;
+}
+
+int chunk_store_open(struct chunk_store* s)
+{
+    if (s->opened) return 0;
+
+    if (!s->path) {
+        fprintf(stderr, "ERROR: chunk records need a chunk store, see --chunks\n");
+        return -1;
+    }
+
+    s->opened = 1;
+    s->dir = s->fd_index = -1;
+    for (int i = 0; i < STORE_PACKS; ++i) s->pack_fd[i] = -1;
+    s->random = getpid() ^ (uint64_t)time(0) << 20;
+
+    if (mkdir(s->path, 0777) && errno != EEXIST) {
+        fprintf(stderr, "ERROR: could not create chunk store %s: %s\n", s->path, strerror(errno));
+        return -1;
+    }
+
+    s->dir = open(s->path, O_RDONLY | O_DIRECTORY);
+    int alone = s->dir != -1 && !flock(s->dir, LOCK_EX | LOCK_NB);
+    if (s->dir != -1) s->fd_index = openat(s->dir, "index", O_RDWR | O_CREAT, 0666);
+    s->md = EVP_MD_CTX_new();
+    if (s->fd_index == -1 || !s->md) {
+        fprintf(stderr, "ERROR: could not open chunk store %s: %s\n", s->path, strerror(errno));
+        return -1;
+    }
+
+    //another decoder may be creating it
+    if (store_flock(s, s->fd_index, LOCK_EX)) return -1;
+
+    struct stat st;
+    int r = fstat(s->fd_index, &st);
+    if (!r && !st.st_size) {
+        r = chunk_store_create(s);
+        if (!r) r = fstat(s->fd_index, &st);
+    }
+
+    struct store_header head;
+    if (!r && pread(s->fd_index, &head, sizeof(head), 0) != sizeof(head)) r = -1;
+    if (!r && (memcmp(head.magic, STORE_MAGIC, sizeof(head.magic)) || !head.cap || (head.cap & (head.cap - 1)) ||
+        st.st_size != STORE_TABLE + head.cap * sizeof(struct store_entry))) {
+        fprintf(stderr, "ERROR: %s is not a chunk store\n", s->path);
+        store_flock(s, s->fd_index, LOCK_UN);
+        return -1;
+    }
+
+    if (store_flock(s, s->fd_index, LOCK_UN)) return -1;
+
+    if (r) {
+        fprintf(stderr, "ERROR: could not open chunk store %s: %s\n", s->path, strerror(errno));
+        return -1;
+    }
+    if (chunk_store_map(s, head.cap)) return -1;
+
+    //no other decoder uses the store, pins left are of decoders that died
+    if (alone) {
+        if (chunk_store_lock(s, LOCK_EX)) return -1;
+        for (uint64_t i = 0; i < s->head->cap; ++i) s->table[i].pins = 0;
+        if (chunk_store_release(s)) return -1;
+    }
+
+    //unlocked, another decoder would clear the pins of this one
+    if (store_flock(s, s->dir, LOCK_SH)) return -1;
+
+    if (s->limit) s->head->limit = s->limit;
+    return 0;
+}
+
+//marks entry used now and pins it until stream ends, lock held
+int chunk_store_touch(struct chunk_store* s, struct store_entry* e)
+{
+    //shared lock holders touch at once
+    uint64_t tick = __atomic_add_fetch(&s->head->tick, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->used, tick, __ATOMIC_RELAXED);
+
+    if (digests_add(&s->pinned, e->digest)) return -1;
+    __atomic_add_fetch(&e->pins, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+//returns descriptor of pack in slot, creating it when asked to
+int chunk_store_pack(struct chunk_store* s, uint32_t slot, int create)
+{
+    uint32_t id = s->head->pack_id[slot];
+    if (s->pack_fd[slot] != -1 && s->pack_id[slot] == id) return s->pack_fd[slot];
+
+    //slot was reused by another decoder
+    if (s->pack_fd[slot] != -1) close(s->pack_fd[slot]);
+
+    char name[32];
+    snprintf(name, sizeof(name), "pack.%u", id);
+    s->pack_fd[slot] = openat(s->dir, name, create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0666);
+    s->pack_id[slot] = id;
+    if (s->pack_fd[slot] == -1)
+        fprintf(stderr, "ERROR: could not open chunk pack %s/%s: %s\n", s->path, name, strerror(errno));
+    return s->pack_fd[slot];
+}
+
+//removes entry, exclusive lock held
+void chunk_store_remove(struct chunk_store* s, struct store_entry* e)
+{
+    struct store_header* h = s->head;
+    uint32_t slot = e->pack;
+
+    int fd = chunk_store_pack(s, slot, 0);
+    if (fd != -1) fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, e->offset, e->size);
+
+    h->bytes -= e->size;
+    h->pack_live[slot] -= e->size;
+    --h->count;
+    ++h->evicted;
+
+    if (!h->pack_live[slot] && slot != h->pack) {
+        char name[32];
+        snprintf(name, sizeof(name), "pack.%u", h->pack_id[slot]);
+        unlinkat(s->dir, name, 0);
+        h->pack_id[slot] = 0;
+    }
+
+    //shifts later entries of the probe run back so lookups never stop short
+    uint64_t mask = h->cap - 1;
+    uint64_t i = e - s->table;
+    for (uint64_t j = (i + 1) & mask; s->table[j].size; j = (j + 1) & mask) {
+        uint64_t word;
+        memcpy(&word, s->table[j].digest, sizeof(word));
+        uint64_t home = word & mask;
+        int movable = i <= j ? home <= i || home > j : home <= i && home > j;
+        if (!movable) continue;
+
+        s->table[i] = s->table[j];
+        i = j;
+    }
+    s->table[i].size = 0;
+}
+
+//evicts least recently used chunk not pinned, exclusive lock held
+//
+//returns -1 when all chunks are pinned
+int chunk_store_evict(struct chunk_store* s)
+{
+    uint64_t mask = s->head->cap - 1;
+    struct store_entry* oldest = 0;
+    for (int n = 0; n < STORE_SAMPLE; ++n) {
+        s->random ^= s->random << 13;
+        s->random ^= s->random >> 7;
+        s->random ^= s->random << 17;
+
+        //first unpinned entry at or after a random one
+        uint64_t i = s->random & mask;
+        uint64_t left = mask + 1;
+        for (; left && (!s->table[i].size || s->table[i].pins); --left) i = (i + 1) & mask;
+        if (!left) return -1;
+        if (!oldest || s->table[i].used < oldest->used) oldest = &s->table[i];
+    }
+    chunk_store_remove(s, oldest);
+    return 0;
+}
+
+//starts next pack, exclusive lock held
+int chunk_store_next_pack(struct chunk_store* s)
+{
+    struct store_header* h = s->head;
+
+    uint32_t slot = 0;
+    while (slot < STORE_PACKS && h->pack_id[slot]) ++slot;
+
+    if (slot == STORE_PACKS) {
+        //all slots hold packs with some chunks left, empty the emptiest without pinned chunks
+        char pinned[STORE_PACKS] = { 0 };
+        for (uint64_t i = 0; i < h->cap; ++i)
+            if (s->table[i].size && s->table[i].pins) pinned[s->table[i].pack] = 1;
+        pinned[h->pack] = 1;
+
+        for (uint32_t i = 0; i < STORE_PACKS; ++i)
+            if (!pinned[i] && (slot == STORE_PACKS || h->pack_live[i] < h->pack_live[slot])) slot = i;
+        if (slot == STORE_PACKS) {
+            fprintf(stderr, "ERROR: every pack of chunk store %s holds pinned chunks\n", s->path);
+            return -1;
+        }
+
+        for (uint64_t i = 0; i < h->cap && h->pack_live[slot]; )
+            if (s->table[i].size && s->table[i].pack == slot)
+                chunk_store_remove(s, &s->table[i]); //shifts next entry here
+            else
+                ++i;
+        h->pack_id[slot] = 0;
+    }
+
+    h->pack_id[slot] = h->pack_next++;
+    h->pack_live[slot] = 0;
+    if (-1 == chunk_store_pack(s, slot, 1)) {
+        h->pack_id[slot] = 0;
+        return -1;
+    }
+
+    //the previous pack goes once none of its chunks are left
+    uint32_t last = h->pack;
+    h->pack = slot;
+    h->pack_end = 0;
+    if (h->pack_id[last] && !h->pack_live[last] && last != slot) {
+        char name[32];
+        snprintf(name, sizeof(name), "pack.%u", h->pack_id[last]);
+        unlinkat(s->dir, name, 0);
+        h->pack_id[last] = 0;
+    }
+    return 0;
+}
+
+//adds chunk, exclusive lock held
+int chunk_store_add(struct chunk_store* s, const unsigned char* digest, const char* buff, size_t sz)
+{
+    struct store_header* h = s->head;
+
+    while (h->count && h->bytes + sz > h->limit) {
+        if (!chunk_store_evict(s)) continue;
+        if (!s->over) fprintf(stderr, "WARNING: chunk store %s grows past its size, all its chunks are in use\n", s->path);
+        s->over = 1;
+        break;
+    }
+
+    if (h->count + 1 > h->cap * STORE_LOAD && chunk_store_grow(s)) return -1;
+    h = s->head;
+
+    if ((!h->pack_id[h->pack] || h->pack_end + sz > STORE_PACK_SZ) && chunk_store_next_pack(s)) return -1;
+
+    int fd = chunk_store_pack(s, h->pack, 0);
+    if (fd == -1) return -1;
+
+    for (size_t done = 0; done < sz; ) {
+        ssize_t r = pwrite(fd, buff + done, sz - done, h->pack_end + done);
+        if (r == -1 && errno == EINTR) continue;
+        if (r == -1) {
+            fprintf(stderr, "ERROR: could not write chunk to store %s: %s\n", s->path, strerror(errno));
+            return -1;
+        }
+        done += r;
+    }
+
+    //found after evictions, they shift entries
+    struct store_entry* e = chunk_store_find(s, digest);
+    memcpy(e->digest, digest, HASH_SZ);
+    e->offset = h->pack_end;
+    e->size = sz;
+    e->pack = h->pack;
+    e->pins = 0;
+    if (chunk_store_touch(s, e)) return -1;
+
+    h->pack_end += sz;
+    h->pack_live[h->pack] += sz;
+    h->bytes += sz;
+    ++h->count;
+    ++h->stored;
+    return 0;
+}
+
+//checks chunk against its hash and stores it unless already there
+//
+//hex => 2 * HASH_SZ lowercase hex digits, not terminated
+int chunk_store_put(struct chunk_store* s, const char* hex, const char* buff, size_t sz)
+{
+    unsigned char digest[HASH_SZ];
+    char name[2 * HASH_SZ + 1];
+    hash_leaf(s->md, (const unsigned char*)buff, sz, digest);
+    hash_hex(digest, name);
+
+    if (memcmp(name, hex, 2 * HASH_SZ)) {
+        fprintf(stderr, "ERROR: chunk does not match its hash %.*s\n", 2 * HASH_SZ, hex);
+        return -1;
+    }
+
+    if (chunk_store_lock(s, LOCK_EX)) return -1;
+
+    int r = 0;
+    struct store_entry* e = chunk_store_find(s, digest);
+    if (e->size) {
+        r = chunk_store_touch(s, e);
+        ++s->head->duplicates;
+        ++s->duplicates;
+    } else {
+        r = chunk_store_add(s, digest, buff, sz);
+        if (!r) ++s->stored;
+    }
+
+    if (chunk_store_release(s)) r = -1;
+    return r;
+}
+
+//finds stored chunk of sz bytes and keeps the store locked until
+//chunk_store_release, so it is not evicted while copied
+//
+//offset => output, where chunk starts in pack
+//
+//returns descriptor of its pack, -2 when it is not in the store, -1 on error
+int chunk_store_get(struct chunk_store* s, const char* hex, size_t sz, off_t* offset)
+{
+    unsigned char digest[HASH_SZ];
+    for (int i = 0; i < HASH_SZ; ++i) {
+        unsigned int byte;
+        if (1 != sscanf(hex + 2 * i, "%2x", &byte)) {
+            fprintf(stderr, "ERROR: invalid chunk hash %.*s\n", 2 * HASH_SZ, hex);
+            return -1;
+        }
+        digest[i] = byte;
+    }
+
+    if (chunk_store_lock(s, LOCK_SH)) return -1;
+
+    struct store_entry* e = chunk_store_find(s, digest);
+    if (!e->size || e->size != sz) {
+        __atomic_add_fetch(&s->head->misses, 1, __ATOMIC_RELAXED);
+        if (chunk_store_release(s)) return -1;
+        return digests_add(&s->missed, digest) ? -1 : -2;
+    }
+
+    if (chunk_store_touch(s, e)) {
+        chunk_store_release(s);
+        return -1;
+    }
+    __atomic_add_fetch(&s->head->hits, 1, __ATOMIC_RELAXED);
+    ++s->hits;
+
+    *offset = e->offset;
+    int fd = chunk_store_pack(s, e->pack, 0);
+    if (fd == -1) chunk_store_release(s);
+    return fd;
+}
+
+//reports hit rate of stream and of store
+void chunk_store_report(const struct chunk_store* s)
+{
+    const struct store_header* h = s->head;
+    off_t chunks = s->hits + s->stored + s->duplicates;
+    uint64_t all = h->hits + h->stored + h->duplicates;
+
+    fprintf(stderr, "INFO: chunk store: %ld references hit, %zu missed, %ld chunks stored, %ld already stored (%.1f%% hits)\n",
+        s->hits, s->missed.count, s->stored, s->duplicates, chunks ? 100.0 * s->hits / chunks : 0.0);
+    fprintf(stderr, "INFO: chunk store: %lu chunks of %lu bytes, %lu hits, %lu misses, %lu evicted (%.1f%% hits overall)\n",
+        h->count, h->bytes, h->hits, h->misses, h->evicted, all ? 100.0 * h->hits / all : 0.0);
+}
+
+//reports references of stream not found, their ranges are not written
+//
+//returns their count
+size_t chunk_store_missed(const struct chunk_store* s)
+{
+    if (s->missed.count)
+        fprintf(stderr, "ERROR: %zu chunk references not in chunk store %s, output is incomplete\n", s->missed.count, s->path);
+    return s->missed.count;
+}
+
+enum ursparse_state { 
+    PARSE_ERROR = -1,
+    PARSE_START = 0,
+    PARSE_TYPE,
+    PARSE_OFFSET, 
+    PARSE_SIZE,
+    PARSE_SOURCE,
+    PARSE_NEWLINE,
+    PARSE_MEAT,
+};
+
+//called for each segment line instead of applying it, the meat is skipped
+//
+//segment => parsed segment line
+//pos     => stream position of its meat
+//
+//returns non zero to stop parsing
+typedef int (*segment_fn)(const struct ursparse* segment, off_t pos, void* ctx);
+
+struct ursparse_state_data {
+    struct ursparse ursparse;
+    enum ursparse_state state;
+    size_t digits; //numerals of uint being parsed
+    char digest[2 * HASH_SZ]; //hex hash of trailer
+    struct ursparse_output* out; //outputs written, more than one for fan-out
+    int out_count;
+    struct fanout* fanout;       //writes meat when more outputs
+    segment_fn on_segment; //index segments instead of writing them
+    void* ctx;
+    off_t stream_pos;      //stream position of buffer, set by caller
+    off_t range_start;     //output range, range_end is 0 when not restricted
+    off_t range_end;
+    off_t skip;            //meat bytes dropped before the range
+    off_t skip_tail;       //meat bytes dropped past the range
+    struct codec_lib codecs;
+    char* packed;          //meat of compressed segment or chunk
+    size_t packed_pos;     //bytes of it read, with hash of chunk
+    char* unpacked;
+    struct chunk_store chunks;
+};
+
+//resets parsing state for next segment line
+void reset_ursparse_state(struct ursparse_state_data* data)
+{
+    memset(&data->ursparse, 0, sizeof(data->ursparse));
+    data->state = PARSE_START;
+    data->digits = 0;
+    data->skip = 0;
+    data->skip_tail = 0;
+    data->packed_pos = 0;
+}
+
+void free_ursparse_state(struct ursparse_state_data* data)
+{
+    codec_free(&data->codecs);
+    chunk_store_close(&data->chunks);
+    free(data->packed);
+    free(data->unpacked);
+    data->packed = data->unpacked = 0;
+}
+
+//clips segment to output range
+//
+//returns bytes clipped off its start, or -1 when nothing of it is left
+off_t clip_ursparse(struct ursparse* u, const struct ursparse_state_data* data)
+{
+    if (!data->range_end) return 0;
+
+    off_t start = u->offset > data->range_start ? u->offset : data->range_start;
+    off_t end = u->offset + u->size < data->range_end ? u->offset + u->size : data->range_end;
+    if (start >= end) return -1;
+
+    off_t head = start - u->offset;
+    u->offset = start;
+    u->size = end - start;
+    return head;
+}
+
+//returns number of meat bytes the parser drops next,
+//the caller may skip them in input instead of reading them
+off_t ursparse_skippable(const struct ursparse_state_data* data)
+{
+    if (data->state != PARSE_MEAT) return 0;
+    if (data->skip) return data->skip;
+    if (!data->ursparse.size) return data->skip_tail;
+    return 0;
+}
+
+//accounts for n bytes of meat skipped by the caller, see ursparse_skippable
+void ursparse_skipped(struct ursparse_state_data* data, off_t n)
+{
+    if (data->skip) data->skip -= n;
+    else data->skip_tail -= n;
+
+    if (!data->skip && !data->ursparse.size && !data->skip_tail) reset_ursparse_state(data);
+}
+
+//writes meat held in memory to outputs
+int do_buffered_meat(struct ursparse_state_data* data, const char* buff, size_t sz)
+{
+    while (sz) {
+        size_t n = 0;
+        int r = data->fanout ? do_fanout_meat(data->fanout, buff, sz, &n) : do_meat(data->out, buff, sz, &n);
+        if (r < 0) {
+            fprintf(stderr, "ERROR: could not process meat\n");
+            return -1;
+        }
+        buff += n;
+        sz -= n;
+    }
+    return 0;
+}
+
+//writes meat of compressed segment once all of it is read
+int do_unpacked(struct ursparse_state_data* data)
+{
+    struct ursparse* u = &data->ursparse;
+
+    if (!data->unpacked) data->unpacked = malloc(COMPRESS_MAX_SZ);
+    if (!data->unpacked) {
+        fprintf(stderr, "ERROR: could not allocate memory: %d bytes\n", COMPRESS_MAX_SZ);
+        return -1;
+    }
+
+    if (codec_decompress(&data->codecs, u->type, data->packed, u->packed, data->unpacked, u->size)) {
+        fprintf(stderr, "ERROR: could not decompress segment %ld %ld\n", u->offset, u->size);
+        return -1;
+    }
+
+    struct ursparse clipped = *u;
+    off_t head = clip_ursparse(&clipped, data);
+    return do_buffered_meat(data, data->unpacked + head, clipped.size);
+}
+
+//applies chunk record once its hash, and data of k record, are read
+int do_chunk(struct ursparse_state_data* data)
+{
+    struct ursparse* u = &data->ursparse;
+    if (chunk_store_open(&data->chunks)) return -1;
+
+    if (u->type == 'k') {
+        fprintf(stderr, "INFO: processing chunk %ld %ld\n", u->offset, u->size);
+        if (chunk_store_put(&data->chunks, data->digest, data->packed, u->size)) return -1;
+    } else {
+        fprintf(stderr, "INFO: processing chunk reference %ld %ld\n", u->offset, u->size);
+    }
+
+    //stored even when outside of range
+    struct ursparse clipped = *u;
+    off_t head = clip_ursparse(&clipped, data);
+    if (head == -1) return 0;
+
+    int r = 0;
+    for (int i = 0; i < data->out_count && !r; ++i)
+        r = do_hole(&data->out[i], clipped.offset);
+    if (r) return -1;
+
+    if (u->type == 'k') return do_buffered_meat(data, data->packed + head, clipped.size);
+
+    off_t source;
+    int fd = chunk_store_get(&data->chunks, data->digest, u->size, &source);
+    if (fd == -1) return -1;
+
+    //range is left as it is, decoding goes on so the sender learns all misses
+    if (fd == -2) {
+        fprintf(stderr, "WARNING: chunk %.*s of %ld bytes not in chunk store %s, range %ld %ld not written\n",
+            2 * HASH_SZ, data->digest, u->size, data->chunks.path, clipped.offset, clipped.size);
+        for (int i = 0; i < data->out_count && !r; ++i)
+            r = do_hole(&data->out[i], clipped.offset + clipped.size);
+        return r;
+    }
+    source += head;
+
+    //seekable outputs get it cloned, others written like meat
+    int copy = !data->out->hash;
+    for (int i = 0; i < data->out_count; ++i) copy &= data->out[i].seekable;
+
+    for (int i = 0; copy && i < data->out_count && !r; ++i) {
+        r = output_flush(&data->out[i]);
+        if (!r) r = copy_range(fd, source, data->out[i].fd, clipped.offset, clipped.size, "chunk");
+        if (!r) r = output_written(&data->out[i], clipped.offset, clipped.size);
+        data->out[i].pos = clipped.offset + clipped.size;
+    }
+
+    for (size_t done = 0; !copy && done < clipped.size && !r; ) {
+        ssize_t n = pread(fd, data->packed + done, clipped.size - done, source + done);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) {
+            fprintf(stderr, "ERROR: could not read chunk %.*s\n", 2 * HASH_SZ, data->digest);
+            r = -1;
+            break;
+        }
+        done += n;
+    }
+    if (chunk_store_release(&data->chunks)) r = -1;
+    if (!copy && !r) r = do_buffered_meat(data, data->packed, clipped.size);
+    return r;
+}
+
+//parses ursparse line
+//offset length \n
+//
+//buff, sz => buffer to parse and its size
+//out_sz   => output number of bytes consumed
+//data     => in/out parser internal state
+//
+//returns
+//  negative number on error
+//  0 done parsing ursparse line
+//  n intermediate parsing
+//    need more data
+int parse_ursparse(const char* buff, size_t sz, size_t* out_sz, struct ursparse_state_data* data)
+{
+    if (!buff)   return -1;
+    if (!sz)     return -2;
+    if (!out_sz) return -3;
+    if (!data)   return -4;
+
+    int r = 0;
+    size_t extra_sz = 0;
+
+    switch(data->state) {
+
+    case PARSE_START:
+
+        data->state = PARSE_TYPE;
+
+    case PARSE_TYPE:
+
+        r = parse_type(buff, sz, out_sz, &(data->ursparse.type));
+        if (r < 0) {
+            data->state = PARSE_ERROR;
+            return r;
+        }
+
+        buff += *out_sz;
+        sz -= *out_sz;
+        extra_sz += *out_sz;
+
+        if (r > 0) {
+            *out_sz = extra_sz;
+            return extra_sz;
+        }
+
+        data->state = PARSE_OFFSET;
+
+        if (!sz) {
+            //record type ended at end of buffer
+            *out_sz = extra_sz;
+            return extra_sz;
+        }
+        
+    case PARSE_OFFSET:
+
+        r = parse_uint(buff, sz, out_sz, &(data->ursparse.offset), &data->digits);
+        if (r < 0) {
+            fprintf(stderr, "ERROR: could not parse offset\n");
+            data->state = PARSE_ERROR;
+            return r;
+        }
+
+        buff += *out_sz;
+        sz -= *out_sz;
+        extra_sz += *out_sz;
+
+        if (r > 0) {
+            *out_sz = extra_sz;
+            return extra_sz;
+        }
+
+        data->state = PARSE_SIZE;
+        data->digits = 0;
+
+    case PARSE_SIZE:
+        
+        r = parse_uint(buff, sz, out_sz, &(data->ursparse.size), &data->digits);
+
+        if (r < 0) {
+            fprintf(stderr, "ERROR: could not parse length\n");
+            data->state = PARSE_ERROR;
+            return r;
+        }
+
+        buff += *out_sz;
+        sz -= *out_sz;
+        extra_sz += *out_sz;
+
+        if (r > 0) {
+            *out_sz = extra_sz;
+            return extra_sz;
+        }
+
+        data->state = PARSE_SOURCE;
+        data->digits = 0;
+
+    case PARSE_SOURCE:
+
+        if (data->ursparse.type == 'r' || data->ursparse.type == 'l' || data->ursparse.type == 'z') {
+            off_t* n = data->ursparse.type == 'r' ? &data->ursparse.source : &data->ursparse.packed;
+            r = parse_uint(buff, sz, out_sz, n, &data->digits);
+
+            if (r < 0) {
+                fprintf(stderr, "ERROR: could not parse %s\n", data->ursparse.type == 'r' ? "source" : "packed length");
+                data->state = PARSE_ERROR;
+                return r;
+            }
+
+            buff += *out_sz;
+            sz -= *out_sz;
+            extra_sz += *out_sz;
+
+            if (r > 0) {
+                *out_sz = extra_sz;
+                return extra_sz;
+            }
+        }
+
+        data->state = PARSE_NEWLINE;
+
+    case PARSE_NEWLINE:
+
+        r = parse_newline(buff, sz, out_sz);
+
+        if (r < 0) {
+            fprintf(stderr, "ERROR: could not parse newline\n");
+            data->state = PARSE_ERROR;
+            return r;
+        }
+
+        buff += *out_sz;
+        sz -= *out_sz;
+        extra_sz += *out_sz;
+
+        if (r > 0) {
+            *out_sz = extra_sz;
+            return extra_sz;
+        }
+
+        if (data->ursparse.type == 'h' && data->ursparse.size != 2 * HASH_SZ && data->ursparse.size) {
+            fprintf(stderr, "ERROR: invalid hash length %ld\n", data->ursparse.size);
+            data->state = PARSE_ERROR;
+            return -9;
+        }
+
+        if ((data->ursparse.type == 'l' || data->ursparse.type == 'z') &&
+            (data->ursparse.size > COMPRESS_MAX_SZ || data->ursparse.packed > COMPRESS_MAX_SZ)) {
+            fprintf(stderr, "ERROR: invalid compressed segment %ld %ld %ld\n", 
+                data->ursparse.offset, data->ursparse.size, data->ursparse.packed);
+            data->state = PARSE_ERROR;
+            return -9;
+        }
+
+        if ((data->ursparse.type == 'c' || data->ursparse.type == 'k') &&
+            (!data->ursparse.size || data->ursparse.size > CDC_MAX_SZ)) {
+            fprintf(stderr, "ERROR: invalid chunk %ld %ld\n", data->ursparse.offset, data->ursparse.size);
+            data->state = PARSE_ERROR;
+            return -9;
+        }
+
+        if (data->on_segment) {
+            if (data->on_segment(&data->ursparse, data->stream_pos + extra_sz, data->ctx)) {
+                data->state = PARSE_ERROR;
+                return -11;
+            }
+
+            if (data->ursparse.type == 'u' || data->ursparse.type == 'r' || !data->ursparse.size) {
+                *out_sz = extra_sz;
+                reset_ursparse_state(data);
+                return 0;
+            }
+
+            data->state = PARSE_MEAT;
+            *out_sz = extra_sz;
+            return extra_sz;
+        }
+
+        if (data->ursparse.type == 'u' && -1 == clip_ursparse(&data->ursparse, data)) {
+            *out_sz = extra_sz;
+            reset_ursparse_state(data);
+            return 0;
+        }
+
+        if (data->ursparse.type == 'u') {
+            fprintf(stderr, "INFO: processing unwritten segment %ld %ld\n", data->ursparse.offset, data->ursparse.size);
+
+            for (int i = 0; i < data->out_count && !r; ++i)
+                r = do_prealloc(&data->out[i], data->ursparse.offset, data->ursparse.size);
+            if (r < 0) {
+                data->state = PARSE_ERROR;
+                return -8;
+            }
+
+            *out_sz = extra_sz;
+            reset_ursparse_state(data);
+            return 0;
+        }
+
+        if (data->ursparse.type == 'h' && data->range_end) {
+            //file size as seen through the range
+            off_t size = data->ursparse.offset;
+            if (size > data->range_end) size = data->range_end;
+            if (size < data->out->pos) size = data->out->pos;
+            data->ursparse.offset = size;
+        }
+
+        if (data->ursparse.type == 'h' && !data->ursparse.size) {
+            for (int i = 0; i < data->out_count && !r; ++i)
+                r = do_trailer(&data->out[i], data->ursparse.offset, 0);
+
+            if (r) {
+                data->state = PARSE_ERROR;
+                return -10;
+            }
+
+            *out_sz = extra_sz;
+            reset_ursparse_state(data);
+            return 0;
+        }
+
+        if (data->ursparse.type == 'r') {
+            off_t head = clip_ursparse(&data->ursparse, data);
+            if (head == -1) {
+                *out_sz = extra_sz;
+                reset_ursparse_state(data);
+                return 0;
+            }
+
+            data->ursparse.source += head;
+            if (data->range_end && (data->ursparse.source < data->range_start ||
+                data->ursparse.source + data->ursparse.size > data->range_end)) {
+                fprintf(stderr, "ERROR: back-reference %ld %ld %ld to data outside of range\n",
+                    data->ursparse.offset, data->ursparse.size, data->ursparse.source);
+                data->state = PARSE_ERROR;
+                return -9;
+            }
+        }
+
+        if (data->ursparse.type == 'r') {
+            fprintf(stderr, "INFO: processing back-reference %ld %ld %ld\n", data->ursparse.offset, data->ursparse.size, data->ursparse.source);
+
+            if (data->ursparse.source + data->ursparse.size > data->ursparse.offset) {
+                fprintf(stderr, "ERROR: back-reference to data not written yet\n");
+                data->state = PARSE_ERROR;
+                return -9;
+            }
+
+            for (int i = 0; i < data->out_count && !r; ++i)
+                r = do_ref(&data->out[i], data->ursparse.offset, data->ursparse.size, data->ursparse.source);
+            if (r < 0) {
+                data->state = PARSE_ERROR;
+                return -8;
+            }
+
+            *out_sz = extra_sz;
+            reset_ursparse_state(data);
+            return 0;
+        }
+
+        if (data->ursparse.type == 'c' || data->ursparse.type == 'k') {
+            if (!data->packed) data->packed = malloc(COMPRESS_MAX_SZ);
+            if (!data->packed) {
+                fprintf(stderr, "ERROR: could not allocate memory: %d bytes\n", COMPRESS_MAX_SZ);
+                data->state = PARSE_ERROR;
+                return -8;
+            }
+        }
+
+        if (data->ursparse.type == 'i') {
+            //seek index, only --extract reads it
+            data->skip = data->ursparse.size;
+            data->ursparse.type = 0;
+            data->ursparse.size = 0;
+        }
+
+        if ((data->ursparse.type == 'l' || data->ursparse.type == 'z') && data->ursparse.packed) {
+            struct ursparse clipped = data->ursparse;
+            if (-1 == clip_ursparse(&clipped, data)) {
+                //whole meat outside of range
+                data->skip = data->ursparse.packed;
+                data->ursparse.type = 0;
+                data->ursparse.size = 0;
+            } else {
+                fprintf(stderr, "INFO: processing compressed segment %ld %ld %ld\n", 
+                    data->ursparse.offset, data->ursparse.size, data->ursparse.packed);
+
+                for (int i = 0; i < data->out_count && !r; ++i)
+                    r = do_hole(&data->out[i], clipped.offset);
+                if (r < 0) {
+                    data->state = PARSE_ERROR;
+                    return -8;
+                }
+
+                if (!data->packed) data->packed = malloc(COMPRESS_MAX_SZ);
+                if (!data->packed) {
+                    fprintf(stderr, "ERROR: could not allocate memory: %d bytes\n", COMPRESS_MAX_SZ);
+                    data->state = PARSE_ERROR;
+                    return -8;
+                }
+            }
+        }
+
+        if ((data->ursparse.type == 'l' || data->ursparse.type == 'z') && !data->ursparse.packed) {
+            fprintf(stderr, "ERROR: compressed segment %ld %ld without meat\n", data->ursparse.offset, data->ursparse.size);
+            data->state = PARSE_ERROR;
+            return -9;
+        }
+
+        if (!data->ursparse.type && data->ursparse.size && data->range_end) {
+            off_t size = data->ursparse.size;
+            off_t head = clip_ursparse(&data->ursparse, data);
+
+            if (head == -1) {
+                //whole meat outside of range
+                data->skip = size;
+                data->ursparse.size = 0;
+            } else {
+                data->skip = head;
+                data->skip_tail = size - head - data->ursparse.size;
+            }
+        }
+
+        if (!data->ursparse.type && data->ursparse.size) {
+            fprintf(stderr, "INFO: processing segment %ld %ld\n", data->ursparse.offset, data->ursparse.size);
+
+            for (int i = 0; i < data->out_count && !r; ++i)
+                r = do_hole(&data->out[i], data->ursparse.offset);
+            if (r < 0) {
+                data->state = PARSE_ERROR;
+                return -8;
+            }
+        }
+        
+        data->state = PARSE_MEAT;
+
+    case PARSE_MEAT: 
+
+        if (!sz) {
+            //segment line ended at end of buffer
+            *out_sz = extra_sz;
+            return extra_sz;
+        }
+
+        if (data->on_segment) {
+            //skip meat
+            size_t n = sz > data->ursparse.size ? data->ursparse.size : sz;
+            data->ursparse.size -= n;
+            *out_sz = extra_sz + n;
+
+            if (data->ursparse.size) return *out_sz;
+
+            reset_ursparse_state(data);
+            return 0;
+        }
+
+        if (data->ursparse.type == 'h') {
+            size_t n = sz > data->ursparse.size ? data->ursparse.size : sz;
+            memcpy(data->digest + 2 * HASH_SZ - data->ursparse.size, buff, n);
+            data->ursparse.size -= n;
+            *out_sz = extra_sz + n;
+
+            if (data->ursparse.size) return *out_sz;
+
+            for (int i = 0; i < data->out_count && !r; ++i)
+                r = do_trailer(&data->out[i], data->ursparse.offset, data->digest);
+
+            if (r) {
+                data->state = PARSE_ERROR;
+                return -10;
+            }
+
+            reset_ursparse_state(data);
+            return 0;
+        }
+
+        if (data->ursparse.type == 'c' || data->ursparse.type == 'k') {
+            //hash of chunk, then data of k record
+            size_t meat = 2 * HASH_SZ + (data->ursparse.type == 'k' ? data->ursparse.size : 0);
+            size_t n = sz > meat - data->packed_pos ? meat - data->packed_pos : sz;
+            size_t hex = data->packed_pos < 2 * HASH_SZ ? 2 * HASH_SZ - data->packed_pos : 0;
+            if (hex > n) hex = n;
+
+            if (hex) memcpy(data->digest + data->packed_pos, buff, hex);
+            if (n > hex) memcpy(data->packed + data->packed_pos + hex - 2 * HASH_SZ, buff + hex, n - hex);
+            data->packed_pos += n;
+            *out_sz = extra_sz + n;
+
+            if (data->packed_pos < meat) return *out_sz;
+
+            if (do_chunk(data)) {
+                data->state = PARSE_ERROR;
+                return -7;
+            }
+
+            reset_ursparse_state(data);
+            return 0;
+        }
+
+        if (data->ursparse.type == 'l' || data->ursparse.type == 'z') {
+            size_t n = sz > data->ursparse.packed - data->packed_pos ? data->ursparse.packed - data->packed_pos : sz;
+            memcpy(data->packed + data->packed_pos, buff, n);
+            data->packed_pos += n;
+            *out_sz = extra_sz + n;
+
+            if (data->packed_pos < data->ursparse.packed) return *out_sz;
+
+            if (do_unpacked(data)) {
+                data->state = PARSE_ERROR;
+                return -7;
+            }
+
+            reset_ursparse_state(data);
+            return 0;
+        }
+
+        if (data->skip) {
+            //meat before the range
+            size_t n = sz > data->skip ? data->skip : sz;
+            data->skip -= n;
+            buff += n;
+            sz -= n;
+            extra_sz += n;
+        }
+
+        if (sz && data->ursparse.size) {
+            size_t n = sz > data->ursparse.size ? data->ursparse.size : sz;
+            r = data->fanout ? do_fanout_meat(data->fanout, buff, n, out_sz) : do_meat(data->out, buff, n, out_sz);
+
+            if (r < 0) {
+                fprintf(stderr, "ERROR: could not process meat\n");
+                data->state = PARSE_ERROR;
+                return r;
+            }
+
+            if (data->ursparse.size < *out_sz) {
+                fprintf(stderr, "ERROR: meat processor broken\n");
+                data->state = PARSE_ERROR;
+                return -7;
+            }
+
+            data->ursparse.size -= *out_sz;
+            buff += *out_sz;
+            sz -= *out_sz;
+            extra_sz += *out_sz;
+        }
+
+        if (sz && !data->ursparse.size && data->skip_tail) {
+            //meat past the range
+            size_t n = sz > data->skip_tail ? data->skip_tail : sz;
+            data->skip_tail -= n;
+            extra_sz += n;
+        }
+
+        *out_sz = extra_sz;
+
+        if (!data->skip && !data->ursparse.size && !data->skip_tail) {
+            //reset parsing state
+            reset_ursparse_state(data);
+            return 0;
+        }
+
+        return *out_sz;
+
+    case PARSE_ERROR:
+        return -5;
+
+    default:
+        return -6;
+    }
+}
+
+//
+//skips input bytes without reading them, seeking when possible
+//and splicing pipes to /dev/null otherwise
+//
+//fd_null => /dev/null, opened on first use
+//
+//returns bytes skipped, 0 when input has to be read instead, -1 on error
+//
+off_t do_skip_input(int fd_in, off_t sz, int* fd_null)
+{
+    off_t pos = lseek(fd_in, 0, SEEK_CUR);
+    if (pos != -1) {
+        struct stat st;
+        if (!fstat(fd_in, &st) && S_ISREG(st.st_mode) && pos + sz > st.st_size) {
+            //let read report the truncated input
+            return 0;
+        }
+
+        if (-1 == lseek(fd_in, sz, SEEK_CUR)) {
+            perror("ERROR: could not seek input file");
+            return -1;
+        }
+        return sz;
+    }
+
+    if (*fd_null == -1) {
+        *fd_null = open("/dev/null", O_WRONLY);
+        if (*fd_null == -1) return 0;
+    }
+
+    ssize_t r = splice(fd_in, 0, *fd_null, 0, sz, SPLICE_F_MOVE);
+    if (r == -1 && errno == EINTR) return do_skip_input(fd_in, sz, fd_null);
+    if (r == -1 && errno == EINVAL) return 0; //not a pipe
+    if (r == -1) {
+        perror("ERROR: could not skip input");
+        return -1;
+    }
+
+    //0 is end of input, read reports it
+    return r;
+}
+
+//decodes ursparse stream
+//
+//fd_out, out_count => output files, the same content is written to each
+int do_ursparse(int fd_in, const int* fd_out, int out_count, const struct options* opts)
+{
+    size_t blk_sz = opts->blk_sz;
+
+    struct ursparse_output outs[out_count];
+    memset(outs, 0, sizeof(outs));
+
+    for (int i = 0; i < out_count; ++i) {
+        struct ursparse_output* out = &outs[i];
+        out->fd = fd_out[i];
+        out->fd_src = -1;
+        out->seekable = -1 != lseek(fd_out[i], 0, SEEK_CUR);
+        out->throttle = opts->throttle;
+        out->durability = opts->durability;
+        out->sync_size = opts->sync_size;
+
+        if (!out->seekable)
+            fprintf(stderr, "INFO: output file is not seekable, writing holes as zeros\n");
+
+        //streamed output carries the range only
+        if (!out->seekable) out->pos = opts->range_start;
+
+        if (output_combine_init(out, COMBINE_BUFF_SZ)) {
+            for (int j = 0; j < i; ++j) output_combine_free(&outs[j]);
+            return 2;
+        }
+    }
+
+    //outputs get the same content, hashing the first one verifies all
+    struct ursparse_output* out = &outs[0];
+
+    struct tree_hash hash;
+    if (opts->verify) {
+        if (tree_hash_init(&hash, opts->threads)) return 2;
+        out->hash = &hash;
+    }
+
+    //outputs sync once per buffer, small ones would spend more on wakeups than writes
+    if (out_count > 1 && blk_sz < FANOUT_BUFF_SZ) blk_sz = FANOUT_BUFF_SZ;
+
+    struct fanout fanout;
+    if (out_count > 1 && fanout_init(&fanout, outs, out_count)) {
+        fanout_free(&fanout);
+        if (out->hash) tree_hash_free(out->hash);
+        return 2;
+    }
+
+    char* read_buff = malloc(blk_sz);
+    if (!read_buff) {
+        fprintf(stderr, "ERROR: could not allocate memory: %ld bytes\n", blk_sz);
+        if (out_count > 1) fanout_free(&fanout);
+        if (out->hash) tree_hash_free(out->hash);
+        return 2;
+    }
+
+    struct ursparse_state_data data;
+    memset(&data, 0, sizeof(data));
+    data.out = outs;
+    data.out_count = out_count;
+    if (out_count > 1) data.fanout = &fanout;
+    data.range_start = opts->range_start;
+    data.range_end = opts->range_end;
+    data.chunks.path = opts->chunks;
+    data.chunks.limit = opts->store_size;
+
+    int fd_null = -1;
+    int ret = 0;
+    while (!ret) {
+        //meat outside of range is skipped rather than read
+        off_t skip = ursparse_skippable(&data);
+        if (skip >= blk_sz) {
+            off_t r = do_skip_input(fd_in, skip, &fd_null);
+            if (r < 0) {
+                ret = 3;
+                break;
+            }
+            if (r) {
+                ursparse_skipped(&data, r);
+                continue;
+            }
+        }
+
+        if (output_flush_idle(fd_in, outs, out_count)) {
+            ret = 4;
+            break;
+        }
+
+        ssize_t nbytes = read(fd_in, read_buff, blk_sz);
+
+        if (nbytes == -1) {
+            perror("ERROR: could not read from input file");
+            ret = 3;
+            break;
+        }
+
+        if (!nbytes) break; //EOF reached
+
+        for (size_t cursor = 0; cursor < nbytes; ) {
+
+            size_t out_sz = 0;
+            int r = parse_ursparse(read_buff + cursor, nbytes - cursor, &out_sz, &data);
+
+            if (r < 0) {
+                ret = 4;
+                break;
+            }
+
+        cursor += out_sz;
+        } 
+    }
+
+    if (!ret && data.state != PARSE_START && data.state != PARSE_TYPE) {
+        fprintf(stderr, "ERROR: input file ends in the middle of a segment\n");
+        ret = 4;
+    }
+
+    for (int i = 0; i < out_count && !ret; ++i)
+        if (output_flush(&outs[i]) || output_sync(&outs[i])) ret = 4;
+    if (!ret && output_syncfs(outs, out_count)) ret = 4;
+
+    if (!ret && opts->verify && !out->verified) {
+        fprintf(stderr, "ERROR: no hash to verify in input file\n");
+        ret = 5;
+    }
+
+    if (!ret && data.chunks.opened) chunk_store_report(&data.chunks);
+    if (!ret && chunk_store_missed(&data.chunks)) ret = 5;
+
+    if (out_count > 1) fanout_free(&fanout);
+    if (out->hash) tree_hash_free(out->hash);
+    free_ursparse_state(&data);
+    for (int i = 0; i < out_count; ++i) {
+        if (outs[i].fd_src != -1) close(outs[i].fd_src);
+        if (outs[i].zeros) munmap(outs[i].zeros, ZEROS_SZ);
+        output_combine_free(&outs[i]);
+    }
+    if (fd_null != -1) close(fd_null);
+    free(read_buff);
+    return ret;
+}
+
+//opens output file, connecting to it when it is a unix socket
+//
+//returns file descriptor, -1 on error
+int open_output(const char* path, int flags)
+{
+    struct stat st;
+    if (stat(path, &st) || !S_ISSOCK(st.st_mode)) {
+        int fd = open(path, flags, 0666);
+        if (fd == -1) fprintf(stderr, "ERROR: could not open %s: %s\n", path, strerror(errno));
+        return fd;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "ERROR: socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd != -1 && connect(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+        close(fd);
+        fd = -1;
+    }
+    if (fd == -1) fprintf(stderr, "ERROR: could not connect to %s: %s\n", path, strerror(errno));
+    return fd;
+}
+
+//
+//extent map of a sparse file
+//
+//extents are reported in ascending offset order, holes are not reported
+//extent flags not requested by the caller are dropped and adjacent
+//extents with equal flags are merged, shared extents only when they are
+//physically contiguous too
+//
+
+#define EXTENT_UNWRITTEN 0x1
+#define EXTENT_SHARED    0x2
+
+struct extent {
+    off_t offset;
+    off_t size;
+    off_t physical; //-1 when unknown
+    unsigned flags;
+};
+
+typedef int (*extent_fn)(const struct extent* e, void* ctx);
+
+struct extent_walk {
+    unsigned keep;
+    off_t start; //range walked
+    off_t end;
+    struct extent pending;
+    extent_fn fn;
+    void* ctx;
+};
+
+//clips extent to range [start, end)
+//returns 0 when nothing of it is left
+int extent_clip(struct extent* e, off_t start, off_t end)
+{
+    if (e->offset < start) {
+        off_t d = start - e->offset;
+        if (d >= e->size) return 0;
+        e->offset += d;
+        e->size -= d;
+        if (e->physical != -1) e->physical += d;
+    }
+
+    if (e->offset >= end) return 0;
+    if (e->offset + e->size > end) e->size = end - e->offset;
+    return e->size > 0;
+}
+
+//queues extent into walk, reporting the previous one when it can not be merged
+int extent_push(struct extent_walk* walk, struct extent e)
+{
+    if (!extent_clip(&e, walk->start, walk->end)) return 0;
+
+    e.flags &= walk->keep;
+
+    struct extent* p = &walk->pending;
+    if (p->size && p->flags == e.flags && p->offset + p->size == e.offset &&
+        (!(e.flags & EXTENT_SHARED) || p->physical + p->size == e.physical)) {
+        p->size += e.size;
+        return 0;
+    }
+
+    if (p->size) {
+        int r = walk->fn(p, walk->ctx);
+        if (r) return r;
+    }
+
+    *p = e;
+    return 0;
+}
+
+int extent_flush(struct extent_walk* walk)
+{
+    if (!walk->pending.size) return 0;
+
+    int r = walk->fn(&walk->pending, walk->ctx);
+    walk->pending.size = 0;
+    return r;
+}
+
+//walks extents with SEEK_DATA/SEEK_HOLE
+//no unwritten extents or physical offsets are reported
+int walk_extents_seek(int fd, struct extent_walk* walk)
+{
+    off_t start = walk->start;
+    while (start < walk->end) {
+        start = lseek(fd, start, SEEK_DATA);
         if (start == -1) {
             if (errno == ENXIO) {
                  //EOF reached
                  break; 
             }
-            perror("ERROR: could not seek");
-            return 1;
+            perror("ERROR: could not seek");
+            return -1;
+        }
+    
+        off_t end = lseek(fd, start, SEEK_HOLE);
+        if (end == -1) {
+            perror("ERROR: could not seek");
+            return -1;
+        }
+
+        struct extent e = { start, end - start, -1, 0 };
+        int r = extent_push(walk, e);
+        if (r) return r;
+
+        start = end;
+    }
+
+    return extent_flush(walk);
+}
+
+#define FIEMAP_BATCH 512
+
+//walks extents with FIEMAP
+//
+//returns
+//  1 FIEMAP not supported by the file system
+//  0 success
+//  negative number on error
+//  callback return value when it stops the walk
+int walk_extents_fiemap(int fd, struct extent_walk* walk)
+{
+    struct fiemap* fm = malloc(sizeof(*fm) + FIEMAP_BATCH * sizeof(struct fiemap_extent));
+    if (!fm) {
+        fprintf(stderr, "ERROR: could not allocate memory for extent map\n");
+        return -1;
+    }
+
+    off_t start = walk->start;
+    off_t file_sz = walk->end;
+    int last = 0;
+    int r = 0;
+
+    while (!last && start < file_sz) {
+        memset(fm, 0, sizeof(*fm));
+        fm->fm_start = start;
+        fm->fm_length = file_sz - start;
+        //flush delayed allocations on first call so they show up as extents
+        fm->fm_flags = start != walk->start ? 0 : FIEMAP_FLAG_SYNC;
+        fm->fm_extent_count = FIEMAP_BATCH;
+
+        if (-1 == ioctl(fd, FS_IOC_FIEMAP, fm)) {
+            if (start == walk->start && (errno == EOPNOTSUPP || errno == ENOTTY || errno == EINVAL || errno == EBADR)) {
+                r = 1;
+                break;
+            }
+            perror("ERROR: could not map extents");
+            r = -1;
+            break;
+        }
+
+        if (!fm->fm_mapped_extents) break;
+
+        for (unsigned i = 0; i < fm->fm_mapped_extents; ++i) {
+            struct fiemap_extent* fe = &fm->fm_extents[i];
+
+            if (fe->fe_flags & FIEMAP_EXTENT_LAST) last = 1;
+
+            off_t offset = fe->fe_logical;
+            off_t size = fe->fe_length;
+            if (offset >= file_sz) {
+                //preallocated past EOF
+                last = 1;
+                break;
+            }
+            if (offset + size > file_sz) size = file_sz - offset;
+
+            struct extent e = { offset, size, fe->fe_physical, 0 };
+            if (fe->fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_ENCODED | FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_NOT_ALIGNED))
+                e.physical = -1;
+            if (fe->fe_flags & FIEMAP_EXTENT_UNWRITTEN)
+                e.flags |= EXTENT_UNWRITTEN;
+            if ((fe->fe_flags & FIEMAP_EXTENT_SHARED) && e.physical != -1)
+                e.flags |= EXTENT_SHARED;
+
+            r = extent_push(walk, e);
+            if (r) break;
+
+            start = offset + size;
+        }
+        if (r) break;
+    }
+
+    free(fm);
+    if (r) return r;
+
+    return extent_flush(walk);
+}
+
+//walks extents of file range with size already known, see walk_extents_range
+//FIEMAP is tried on regular files only
+int walk_extents_sized(int fd, int regular, off_t size, off_t start, off_t end, unsigned keep, extent_fn fn, void* ctx)
+{
+    struct extent_walk walk;
+    memset(&walk, 0, sizeof(walk));
+    walk.keep = keep;
+    walk.start = start;
+    walk.end = end < size ? end : size;
+    walk.fn = fn;
+    walk.ctx = ctx;
+
+    if (regular) {
+        int r = walk_extents_fiemap(fd, &walk);
+        if (r <= 0) return r;
+    }
+
+    return walk_extents_seek(fd, &walk);
+}
+
+//walks extents of file range [start, end) calling fn for each of them,
+//extents are clipped to the range
+//
+//fd   => file to map
+//end  => clamped to file size
+//keep => extent flags the caller is interested in
+//
+//returns
+//  0 success
+//  negative number on error
+//  callback return value when it stops the walk
+int walk_extents_range(int fd, off_t start, off_t end, unsigned keep, extent_fn fn, void* ctx)
+{
+    struct stat st;
+    if (-1 == fstat(fd, &st)) {
+        perror("ERROR: could not stat input file");
+        return -1;
+    }
+
+    //block devices report no size
+    off_t size = S_ISREG(st.st_mode) ? st.st_size : lseek(fd, 0, SEEK_END);
+    if (-1 == size || -1 == lseek(fd, 0, SEEK_SET)) {
+        perror("ERROR: input file is not seekable");
+        return -1;
+    }
+
+    return walk_extents_sized(fd, S_ISREG(st.st_mode), size, start, end, keep, fn, ctx);
+}
+
+//walks extents of whole file, see walk_extents_range
+int walk_extents(int fd, unsigned keep, extent_fn fn, void* ctx)
+{
+    return walk_extents_range(fd, 0, INT64_MAX, keep, fn, ctx);
+}
+
+//extent map kept in memory
+struct extent_list {
+    struct extent* extents;
+    size_t count;
+    size_t capacity;
+};
+
+int extent_list_add(const struct extent* e, void* ctx)
+{
+    struct extent_list* l = ctx;
+
+    if (l->count == l->capacity) {
+        size_t capacity = l->capacity ? l->capacity * 2 : 1024;
+        struct extent* extents = realloc(l->extents, capacity * sizeof(*extents));
+        if (!extents) {
+            fprintf(stderr, "ERROR: could not allocate memory for extent map\n");
+            return -1;
+        }
+        l->extents = extents;
+        l->capacity = capacity;
+    }
+
+    l->extents[l->count++] = *e;
+    return 0;
+}
+
+//
+//extent map cache
+//
+//the cache keeps the extent map of a whole file so walks of it replay the
+//map instead of asking the file system again, it is valid while device,
+//inode, size, mtime and ctime of the file stay the same
+//
+//the cache is the file given, or an entry named by device and inode in
+//it when it is a directory; a header is followed by LEB128 varints, four
+//per extent: gap since end of previous extent, size, zigzag delta of
+//physical offset from end of previous extent, and flags
+//all header integers are 64-bit little endian
+//
+//a map walked less than EXTENT_CACHE_RACY seconds after ctime is not
+//cached, a write right after the walk may leave the timestamps the same
+//
+#define EXTENT_CACHE_MAGIC "URSEXT01"
+#define EXTENT_CACHE_RACY 2
+#define EXTENT_CACHE_VARINTS 40 //most bytes of an extent
+
+struct extent_cache_header {
+    char magic[8];
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    uint64_t mtime_sec;
+    uint64_t mtime_nsec;
+    uint64_t ctime_sec;
+    uint64_t ctime_nsec;
+    uint64_t count;  //of extents
+    uint64_t bytes;  //of varints
+};
+
+void extent_cache_header_init(struct extent_cache_header* h, const struct stat* st)
+{
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, EXTENT_CACHE_MAGIC, sizeof(h->magic));
+    h->dev = htole64(st->st_dev);
+    h->ino = htole64(st->st_ino);
+    h->size = htole64(st->st_size);
+    h->mtime_sec = htole64(st->st_mtim.tv_sec);
+    h->mtime_nsec = htole64(st->st_mtim.tv_nsec);
+    h->ctime_sec = htole64(st->st_ctim.tv_sec);
+    h->ctime_nsec = htole64(st->st_ctim.tv_nsec);
+}
+
+//path of cache entry of file
+void extent_cache_path(const char* cache, const struct stat* st, char* path, size_t sz)
+{
+    struct stat cache_st;
+    if (!stat(cache, &cache_st) && S_ISDIR(cache_st.st_mode))
+        snprintf(path, sz, "%s/%lx.%lx", cache, (unsigned long)st->st_dev, (unsigned long)st->st_ino);
+    else
+        snprintf(path, sz, "%s", cache);
+}
+
+size_t put_varint(unsigned char* p, uint64_t n)
+{
+    size_t i = 0;
+    for (; n >= 0x80; n >>= 7) p[i++] = n | 0x80;
+    p[i++] = n;
+    return i;
+}
+
+//returns bytes read, 0 when p ends before the varint does
+size_t get_varint(const unsigned char* p, const unsigned char* end, uint64_t* n)
+{
+    *n = 0;
+    for (size_t i = 0; p + i < end && i < 10; ++i) {
+        *n |= (uint64_t)(p[i] & 0x7f) << (7 * i);
+        if (!(p[i] & 0x80)) return i + 1;
+    }
+    return 0;
+}
+
+//reads cached extent map of file
+//
+//returns 0 when read, 1 when there is no valid one
+int extent_cache_load(const char* path, const struct stat* st, struct extent_list* l)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return 1;
+
+    struct extent_cache_header h, want;
+    extent_cache_header_init(&want, st);
+
+    struct stat cache_st;
+    unsigned char* map = MAP_FAILED;
+    int r = 1;
+    if (pread(fd, &h, sizeof(h), 0) == sizeof(h) && !memcmp(&h, &want, offsetof(struct extent_cache_header, count)) &&
+        !fstat(fd, &cache_st) && cache_st.st_size == sizeof(h) + le64toh(h.bytes)) {
+        map = mmap(0, cache_st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) return 1;
+
+    uint64_t count = le64toh(h.count);
+    const unsigned char* p = map + sizeof(h);
+    const unsigned char* end = map + cache_st.st_size;
+    struct extent e = { 0, 0, 0, 0 };
+
+    for (uint64_t i = 0; i < count; ++i) {
+        uint64_t v[4];
+        for (int j = 0; j < 4; ++j) {
+            size_t n = get_varint(p, end, &v[j]);
+            if (!n) goto done;
+            p += n;
+        }
+
+        e.offset += e.size + v[0];
+        e.physical += e.size + (int64_t)(v[2] >> 1 ^ -(v[2] & 1));
+        e.size = v[1];
+        e.flags = v[3];
+
+        if (extent_list_add(&e, l)) goto done;
+    }
+    r = p == end ? 0 : 1;
+
+done:
+    munmap(map, cache_st.st_size);
+    if (r) l->count = 0;
+    return r;
+}
+
+//writes extent map of file to cache, replacing it at once
+int extent_cache_save(const char* path, const struct stat* st, const struct extent_list* l)
+{
+    unsigned char* buff = malloc(l->count * EXTENT_CACHE_VARINTS + 1);
+    if (!buff) {
+        fprintf(stderr, "ERROR: could not allocate memory for extent cache\n");
+        return -1;
+    }
+
+    size_t sz = 0;
+    struct extent prev = { 0, 0, 0, 0 };
+    for (size_t i = 0; i < l->count; ++i) {
+        const struct extent* e = &l->extents[i];
+        int64_t delta = e->physical - (prev.physical + prev.size);
+        sz += put_varint(buff + sz, e->offset - (prev.offset + prev.size));
+        sz += put_varint(buff + sz, e->size);
+        sz += put_varint(buff + sz, (uint64_t)delta << 1 ^ (uint64_t)(delta >> 63));
+        sz += put_varint(buff + sz, e->flags);
+        prev = *e;
+    }
+
+    struct extent_cache_header h;
+    extent_cache_header_init(&h, st);
+    h.count = htole64(l->count);
+    h.bytes = htole64(sz);
+
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, getpid());
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    int r = fd == -1 || write_all(fd, (const char*)&h, sizeof(h)) || write_all(fd, (const char*)buff, sz);
+    if (fd != -1 && close(fd)) r = 1;
+    if (!r && rename(tmp, path)) r = 1;
+
+    if (r) {
+        fprintf(stderr, "WARNING: could not write extent cache %s: %s\n", path, strerror(errno));
+        unlink(tmp);
+    }
+    free(buff);
+    return 0;
+}
+
+//walks extents of file range like walk_extents_range, replaying the extent
+//map of the whole file from cache when it is still valid, and caching
+//it otherwise
+//
+//cache => file or directory of extent cache, 0 walks without it
+int walk_extents_cached(int fd, off_t start, off_t end, unsigned keep, const char* cache, extent_fn fn, void* ctx)
+{
+    struct stat st;
+    if (!cache || fstat(fd, &st) || !S_ISREG(st.st_mode))
+        return walk_extents_range(fd, start, end, keep, fn, ctx);
+
+    char path[PATH_MAX];
+    extent_cache_path(cache, &st, path, sizeof(path));
+
+    struct extent_list map;
+    memset(&map, 0, sizeof(map));
+
+    int r = extent_cache_load(path, &st, &map);
+    if (!r) fprintf(stderr, "INFO: extent cache hit, %zu extents\n", map.count);
+
+    if (r) {
+        r = walk_extents(fd, EXTENT_UNWRITTEN | EXTENT_SHARED, extent_list_add, &map);
+        if (!r) fprintf(stderr, "INFO: extent cache miss, %zu extents walked\n", map.count);
+
+        //the walk may have flushed delayed allocations, changing ctime
+        struct stat now;
+        if (!r && !fstat(fd, &now) && now.st_ctim.tv_sec + EXTENT_CACHE_RACY <= time(0))
+            r = extent_cache_save(path, &now, &map);
+        else if (!r)
+            fprintf(stderr, "INFO: file changed too recently to cache its extents\n");
+    }
+
+    struct extent_walk walk;
+    memset(&walk, 0, sizeof(walk));
+    walk.keep = keep;
+    walk.start = start;
+    walk.end = end < st.st_size ? end : st.st_size;
+    walk.fn = fn;
+    walk.ctx = ctx;
+
+    //skips extents ending before range
+    size_t lo = 0, hi = map.count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (map.extents[mid].offset + map.extents[mid].size <= start) lo = mid + 1;
+        else hi = mid;
+    }
+
+    for (size_t i = lo; i < map.count && map.extents[i].offset < walk.end && !r; ++i)
+        r = extent_push(&walk, map.extents[i]);
+    if (!r) r = extent_flush(&walk);
+
+    free(map.extents);
+    return r;
+}
+
+//
+//allocation bitmap
+//
+//one bit per ALLOC_BLOCK_SZ block of the file, set when any of it holds
+//data; extents are rounded out to blocks, which file systems allocate in
+//anyway, so byte counts are exact but for the partial last block
+//
+//rank counts allocated blocks before a block: superblocks of
+//ALLOC_SUPER_WORDS words keep the count before them, the rest is at most
+//as many popcounts; select finds the nth allocated block: every
+//ALLOC_SELECT_SAMPLE-th one has its superblock sampled, superblocks
+//between two samples are binary searched, then words are popcounted
+//
+//stored as header of 64-bit little endian integers followed by the
+//words, little endian, bit n of word w is block 64 * w + n
+//
+#define ALLOC_BLOCK_SZ 4096
+#define ALLOC_SUPER_WORDS 8
+#define ALLOC_SELECT_SAMPLE 4096
+#define ALLOC_BITMAP_MAGIC "URSBMP01"
+
+struct alloc_bitmap {
+    uint64_t* words;
+    size_t word_count;
+    uint64_t* supers;  //allocated blocks before each superblock, one more than superblocks
+    uint32_t* samples; //superblock of every ALLOC_SELECT_SAMPLE-th allocated block
+    off_t size;        //of file
+    uint64_t blocks;   //allocated
+};
+
+struct alloc_bitmap_header {
+    char magic[8];
+    uint64_t block_sz;
+    uint64_t size;   //of file
+    uint64_t blocks; //allocated
+    uint64_t words;
+};
+
+int alloc_bitmap_init(struct alloc_bitmap* b, off_t size)
+{
+    memset(b, 0, sizeof(*b));
+    b->size = size;
+    uint64_t bits = (size + ALLOC_BLOCK_SZ - 1) / ALLOC_BLOCK_SZ;
+    b->word_count = (bits + 63) / 64;
+    b->words = calloc(b->word_count + 1, sizeof(*b->words));
+    if (!b->words) {
+        fprintf(stderr, "ERROR: could not allocate memory for allocation bitmap\n");
+        return -1;
+    }
+    return 0;
+}
+
+void alloc_bitmap_free(struct alloc_bitmap* b)
+{
+    free(b->words);
+    free(b->supers);
+    free(b->samples);
+    memset(b, 0, sizeof(*b));
+}
+
+//extent_fn setting blocks of data extents, call alloc_bitmap_index after
+int alloc_bitmap_add(const struct extent* e, void* ctx)
+{
+    struct alloc_bitmap* b = ctx;
+    if (e->flags & EXTENT_UNWRITTEN) return 0;
+
+    uint64_t first = e->offset / ALLOC_BLOCK_SZ;
+    uint64_t end = (e->offset + e->size + ALLOC_BLOCK_SZ - 1) / ALLOC_BLOCK_SZ;
+    if (end > b->word_count * 64) end = b->word_count * 64;
+
+    while (first < end) {
+        uint64_t n = 64 - first % 64;
+        if (n > end - first) n = end - first;
+        uint64_t mask = n == 64 ? ~0ull : ((1ull << n) - 1) << (first % 64);
+        b->words[first / 64] |= mask;
+        first += n;
+    }
+    return 0;
+}
+
+//builds rank and select directories
+int alloc_bitmap_index(struct alloc_bitmap* b)
+{
+    size_t supers = (b->word_count + ALLOC_SUPER_WORDS - 1) / ALLOC_SUPER_WORDS;
+    free(b->supers);
+    b->supers = malloc((supers + 1) * sizeof(*b->supers));
+    if (!b->supers) {
+        fprintf(stderr, "ERROR: could not allocate memory for allocation bitmap\n");
+        return -1;
+    }
+
+    uint64_t count = 0;
+    for (size_t s = 0; s < supers; ++s) {
+        b->supers[s] = count;
+        for (size_t w = s * ALLOC_SUPER_WORDS; w < (s + 1) * ALLOC_SUPER_WORDS && w < b->word_count; ++w)
+            count += __builtin_popcountll(b->words[w]);
+    }
+    b->supers[supers] = count;
+    b->blocks = count;
+
+    free(b->samples);
+    b->samples = malloc((count / ALLOC_SELECT_SAMPLE + 1) * sizeof(*b->samples));
+    if (!b->samples) {
+        fprintf(stderr, "ERROR: could not allocate memory for allocation bitmap\n");
+        return -1;
+    }
+
+    size_t s = 0;
+    for (uint64_t k = 0; k <= count / ALLOC_SELECT_SAMPLE; ++k) {
+        while (s + 1 < supers && b->supers[s + 1] <= k * ALLOC_SELECT_SAMPLE) ++s;
+        b->samples[k] = s;
+    }
+    return 0;
+}
+
+//allocated blocks before block
+uint64_t alloc_bitmap_rank(const struct alloc_bitmap* b, uint64_t block)
+{
+    size_t w = block / 64;
+    if (w >= b->word_count) return b->blocks;
+
+    uint64_t r = b->supers[w / ALLOC_SUPER_WORDS];
+    for (size_t i = w - w % ALLOC_SUPER_WORDS; i < w; ++i)
+        r += __builtin_popcountll(b->words[i]);
+    return r + __builtin_popcountll(b->words[w] & ((1ull << (block % 64)) - 1));
+}
+
+//block holding the nth allocated block, counting from 0
+//n has to be less than the allocated blocks
+uint64_t alloc_bitmap_select(const struct alloc_bitmap* b, uint64_t n)
+{
+    size_t k = n / ALLOC_SELECT_SAMPLE;
+    size_t lo = b->samples[k];
+    size_t hi = k + 1 <= b->blocks / ALLOC_SELECT_SAMPLE ? b->samples[k + 1] + 1 :
+                (b->word_count + ALLOC_SUPER_WORDS - 1) / ALLOC_SUPER_WORDS;
+
+    //last superblock with fewer than n + 1 blocks before it
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (b->supers[mid] <= n) lo = mid;
+        else hi = mid;
+    }
+
+    n -= b->supers[lo];
+    size_t w = lo * ALLOC_SUPER_WORDS;
+    for (;; ++w) {
+        uint64_t c = __builtin_popcountll(b->words[w]);
+        if (n < c) break;
+        n -= c;
+    }
+
+    uint64_t word = b->words[w];
+    for (; n; --n) word &= word - 1;
+    return w * 64 + __builtin_ctzll(word);
+}
+
+//allocated bytes before offset
+off_t alloc_bitmap_rank_bytes(const struct alloc_bitmap* b, off_t offset)
+{
+    if (offset > b->size) offset = b->size;
+
+    uint64_t block = offset / ALLOC_BLOCK_SZ;
+    off_t r = alloc_bitmap_rank(b, block) * ALLOC_BLOCK_SZ;
+    if (b->words[block / 64] >> (block % 64) & 1) r += offset % ALLOC_BLOCK_SZ;
+    return r;
+}
+
+//offset with n allocated bytes before it, file size when there are no more
+off_t alloc_bitmap_select_bytes(const struct alloc_bitmap* b, off_t n)
+{
+    uint64_t k = n / ALLOC_BLOCK_SZ;
+    if (k >= b->blocks) return b->size;
+
+    off_t offset = alloc_bitmap_select(b, k) * ALLOC_BLOCK_SZ + n % ALLOC_BLOCK_SZ;
+    return offset < b->size ? offset : b->size;
+}
+
+int alloc_bitmap_write(const struct alloc_bitmap* b, int fd)
+{
+    struct alloc_bitmap_header h;
+    memcpy(h.magic, ALLOC_BITMAP_MAGIC, sizeof(h.magic));
+    h.block_sz = htole64(ALLOC_BLOCK_SZ);
+    h.size = htole64(b->size);
+    h.blocks = htole64(b->blocks);
+    h.words = htole64(b->word_count);
+
+    if (write_all(fd, (const char*)&h, sizeof(h))) return -1;
+
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+    return write_all(fd, (const char*)b->words, b->word_count * sizeof(*b->words));
+#else
+    for (size_t i = 0; i < b->word_count; ++i) {
+        uint64_t le = htole64(b->words[i]);
+        if (write_all(fd, (const char*)&le, sizeof(le))) return -1;
+    }
+    return 0;
+#endif
+}
+
+//
+//physical ranges of shared extents already shipped as data
+//sorted by physical offset, ranges do not overlap
+//
+struct shared_range {
+    off_t physical;
+    off_t size;
+    off_t offset; //where the range was shipped in the file
+};
+
+struct shared_map {
+    struct shared_range* ranges;
+    size_t count;
+    size_t capacity;
+};
+
+//returns index of first range ending after physical
+size_t shared_map_find(const struct shared_map* map, off_t physical)
+{
+    size_t lo = 0, hi = map->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (map->ranges[mid].physical + map->ranges[mid].size <= physical)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+int shared_map_insert(struct shared_map* map, size_t i, struct shared_range range)
+{
+    if (map->count == map->capacity) {
+        size_t capacity = map->capacity ? map->capacity * 2 : 256;
+        struct shared_range* ranges = realloc(map->ranges, capacity * sizeof(*ranges));
+        if (!ranges) {
+            fprintf(stderr, "ERROR: could not allocate memory for shared extents\n");
+            return -1;
+        }
+        map->ranges = ranges;
+        map->capacity = capacity;
+    }
+
+    memmove(map->ranges + i + 1, map->ranges + i, (map->count - i) * sizeof(*map->ranges));
+    map->ranges[i] = range;
+    ++map->count;
+    return 0;
+}
+
+
+struct sparse_ctx {
+    int fd_in;
+    int fd_out;
+    const struct options* opts;
+    off_t data_offset; //data run not written yet
+    off_t data_size;
+    struct shared_map shared;
+    enum { COPY_RANGE, COPY_SPLICE, COPY_READ } copy;
+    char* buff;        //read buffer of COPY_READ
+    struct tree_hash* hash;
+    struct compressor* compress; //ships data in compressed blocks
+    struct chunker* chunks;      //ships data in content defined chunks
+};
+
+#define COPY_BUFF_SZ (1 << 20)
+
+//reads data through buffer, hashing it when verifying
+int do_sparse_read_data(struct sparse_ctx* c, off_t start, size_t sz, int write)
+{
+    if (!c->buff) {
+        c->buff = malloc(COPY_BUFF_SZ);
+        if (!c->buff) {
+            fprintf(stderr, "ERROR: could not allocate memory: %d bytes\n", COPY_BUFF_SZ);
+            return -1;
+        }
+    }
+
+    while (sz > 0) {
+        double t0;
+        size_t n = throttle_take(c->opts->throttle, sz > COPY_BUFF_SZ ? COPY_BUFF_SZ : sz, &t0);
+        ssize_t r = pread(c->fd_in, c->buff, n, start);
+        throttle_done(c->opts->throttle, n, r > 0 ? r : 0, t0);
+        if (r == -1) {
+            perror("ERROR: could not read data");
+            return -1;
+        }
+        if (!r) {
+            fprintf(stderr, "ERROR: input file shrunk while reading it\n");
+            return -1;
+        }
+
+        if (c->hash) tree_hash_update(c->hash, c->buff, r);
+
+        if (write && write_all(c->fd_out, c->buff, r)) {
+            perror("ERROR: could not copy data");
+            return -1;
+        }
+
+        start += r;
+        sz -= r;
+    }
+
+    return 0;
+}
+
+//copies data to output
+//copy_file_range between files, splice into pipes, read and write otherwise
+int do_sparse_copy_data(struct sparse_ctx* c, off_t start, size_t sz)
+{
+    if (c->hash) c->copy = COPY_READ;
+
+    while (sz > 0 && c->copy != COPY_READ) {
+        double t0;
+        size_t n = throttle_take(c->opts->throttle, sz, &t0);
+        ssize_t r = c->copy == COPY_RANGE ?
+            copy_file_range(c->fd_in, &start, c->fd_out, 0, n, 0) :
+            splice(c->fd_in, &start, c->fd_out, 0, n, SPLICE_F_MORE);
+        throttle_done(c->opts->throttle, n, r > 0 ? r : 0, t0);
+
+        if (r == -1 && (errno == EINVAL || errno == EXDEV || errno == EOPNOTSUPP || errno == ENOSYS || errno == EBADF)) {
+            //not supported between these files, try next method
+            ++c->copy;
+            continue;
+        }
+        if (r == -1) {
+            if (errno == EINTR) continue;
+            perror("ERROR: could not copy data");
+            return -1;
+        }
+        if (!r) {
+            fprintf(stderr, "ERROR: input file shrunk while reading it\n");
+            return -1;
+        }
+
+        sz -= r;
+    }
+
+    if (!sz) return 0;
+
+    return do_sparse_read_data(c, start, sz, 1);
+}
+
+//hashes hole up to offset
+void do_sparse_hash_hole(struct sparse_ctx* c, off_t offset)
+{
+    if (c->hash && offset > c->hash->size) tree_hash_zeros(c->hash, offset - c->hash->size);
+}
+
+//
+//adaptive compression of data segments
+//
+//data is shipped in COMPRESS_BLOCK_SZ segments, each raw or compressed
+//with the codec expected to get it through output soonest: compressing
+//takes 1/speed and shipping takes ratio/link seconds per byte of data,
+//receiver drains buffered output while next block is compressed so the
+//slower of the two is the cost of a codec,
+//speed and ratio of each codec are moving averages over blocks it packed
+//and link is how fast the receiver takes output, measured while writes
+//wait for it; every COMPRESS_PROBE blocks a neighbouring codec is tried
+//so estimates follow changing data and links
+//
+//blocks that barely shrink mark data incompressible, it is shipped raw
+//with an occasional lz4 probe until it compresses again, and does not
+//skew estimates of codecs for compressible data
+//
+#define COMPRESS_BLOCK_SZ (256 << 10)
+#define COMPRESS_PROBE 16
+#define COMPRESS_STALL 0.001    //seconds a write waits when output is full
+#define COMPRESS_LINK 1e9       //assumed bytes/s of output until it stalls
+#define COMPRESS_GAIN 0.95      //most ratio of compressible block
+#define COMPRESS_RETRY 2        //blocks between probes of incompressible data
+#define CODEC_AUTO -1
+
+//data segment of seekable stream, see i record
+struct seek_frame {
+    off_t offset;
+    off_t size;
+    off_t pos;     //of its record in stream
+    off_t record;  //length of its record
+};
+
+struct compressor {
+    int codec;          //fixed codec, CODEC_AUTO adapts
+    struct codec_lib lib;
+    char* in;
+    char* out;
+    double speed[CODECS];   //bytes/s of compressing
+    double ratio[CODECS];   //bytes shipped per byte of data
+    double link;            //bytes/s of output
+    double last;            //end of previous write
+    double stalled;         //seconds writes waited for output
+    int incompressible;     //blocks since data stopped compressing, 0 compresses
+    unsigned blocks;
+    off_t count[CODECS];    //blocks, data bytes and shipped bytes per codec
+    off_t data[CODECS];
+    off_t shipped[CODECS];
+    off_t pos;              //bytes of stream written
+    struct seek_frame* frames; //blocks written, indexed when seekable
+    size_t frame_count;
+    size_t frame_cap;
+};
+
+int compressor_init(struct compressor* c, int codec)
+{
+    memset(c, 0, sizeof(*c));
+    c->codec = codec;
+    c->link = COMPRESS_LINK;
+    c->last = now_seconds();
+    for (int i = 0; i < CODECS; ++i) {
+        c->speed[i] = codec_info(i).speed;
+        c->ratio[i] = i == CODEC_RAW ? 1 : 0.5;
+    }
+
+    c->in = malloc(COMPRESS_BLOCK_SZ);
+    c->out = malloc(COMPRESS_BLOCK_SZ);
+    if (!c->in || !c->out) {
+        fprintf(stderr, "ERROR: could not allocate memory for compression\n");
+        return -1;
+    }
+
+    //fail now rather than on first block when a codec is missing,
+    //auto picks any of them, a fixed codec needs its own library only
+    if (codec == CODEC_AUTO) return codec_load(&c->lib, 'l') || codec_load(&c->lib, 'z') ? -1 : 0;
+    if (codec != CODEC_RAW) return codec_load(&c->lib, codec_info(codec).type);
+    return 0;
+}
+
+void compressor_free(struct compressor* c)
+{
+    codec_free(&c->lib);
+    free(c->in);
+    free(c->out);
+    free(c->frames);
+}
+
+//returns codec for next block
+int compressor_pick(struct compressor* c)
+{
+    if (c->codec != CODEC_AUTO) return c->codec;
+
+    if (c->incompressible) return c->incompressible++ % COMPRESS_RETRY ? CODEC_RAW : 1;
+
+    int best = 0;
+    double best_cost = 0;
+    for (int i = 0; i < CODECS; ++i) {
+        double compress = i == CODEC_RAW ? 0 : 1 / c->speed[i];
+        double ship = c->ratio[i] / c->link;
+        double cost = compress > ship ? compress : ship;
+        if (!i || cost < best_cost) {
+            best = i;
+            best_cost = cost;
+        }
+    }
+
+    unsigned probe = c->blocks++ % COMPRESS_PROBE;
+    if (probe == 0 && best > 1) return best - 1;
+    if (probe == COMPRESS_PROBE / 2 && best < CODECS - 1) return best + 1;
+    return best;
+}
+
+void compressor_report(const struct compressor* c)
+{
+    off_t data = 0, shipped = 0;
+    for (int i = 0; i < CODECS; ++i) {
+        if (!c->count[i]) continue;
+        fprintf(stderr, "INFO: %-6s %ld blocks, %ld bytes shipped as %ld\n",
+            codec_info(i).name, c->count[i], c->data[i], c->shipped[i]);
+        data += c->data[i];
+        shipped += c->shipped[i];
+    }
+    fprintf(stderr, "INFO: compressed %ld bytes to %ld (%.1f%%), output stalled %.3f s\n",
+        data, shipped, data ? 100.0 * shipped / data : 100.0, c->stalled);
+}
+
+//reads data block into buff, hashing it when verifying
+int do_sparse_read_block(struct sparse_ctx* c, char* buff, off_t start, size_t sz)
+{
+    size_t done = 0;
+    while (done < sz) {
+        double t0;
+        size_t n = throttle_take(c->opts->throttle, sz - done, &t0);
+        ssize_t r = pread(c->fd_in, buff + done, n, start + done);
+        throttle_done(c->opts->throttle, n, r > 0 ? r : 0, t0);
+        if (r == -1 && errno == EINTR) continue;
+        if (r == -1) {
+            perror("ERROR: could not read data");
+            return -1;
+        }
+        if (!r) {
+            fprintf(stderr, "ERROR: input file shrunk while reading it\n");
+            return -1;
+        }
+        done += r;
+    }
+
+    if (c->hash) tree_hash_update(c->hash, buff, sz);
+    return 0;
+}
+
+//ships data block as segment of the codec picked for it
+int do_sparse_block(struct sparse_ctx* c, off_t start, size_t sz)
+{
+    struct compressor* comp = c->compress;
+    if (do_sparse_read_block(c, comp->in, start, sz)) return -1;
+
+    int codec = compressor_pick(comp);
+    size_t packed = 0;
+
+    if (codec != CODEC_RAW) {
+        //block that does not shrink is shipped raw
+        double t0 = now_seconds();
+        packed = codec_compress(&comp->lib, codec, comp->in, sz, comp->out, sz - 1);
+        double t = now_seconds() - t0;
+        double ratio = packed ? (double)packed / sz : 1;
+
+        comp->incompressible = ratio > COMPRESS_GAIN;
+        if (!comp->incompressible) {
+            if (t > 0) comp->speed[codec] = 0.7 * comp->speed[codec] + 0.3 * sz / t;
+            comp->ratio[codec] = 0.7 * comp->ratio[codec] + 0.3 * ratio;
+        }
+        if (!packed) codec = CODEC_RAW;
+    }
+
+    char head[64];
+    int head_sz = packed ?
+        snprintf(head, sizeof(head), "%c %ld %zu %zu\n", codec_info(codec).type, start, sz, packed) :
+        snprintf(head, sizeof(head), "%ld %zu\n", start, sz);
+    const char* meat = packed ? comp->out : comp->in;
+    size_t meat_sz = packed ? packed : sz;
+
+    double t0 = now_seconds();
+    if (write_all(c->fd_out, head, head_sz) || write_all(c->fd_out, meat, meat_sz)) {
+        perror("ERROR: could not write segment");
+        return -1;
+    }
+    double t1 = now_seconds();
+
+    //waiting writes show how fast output drains, writes that did not wait
+    //only show it takes at least what was produced, so estimate only rises
+    double shipped = head_sz + meat_sz;
+    double rate = t1 > comp->last ? shipped / (t1 - comp->last) : COMPRESS_LINK;
+    if (rate > COMPRESS_LINK) rate = COMPRESS_LINK;
+    if (t1 - t0 > COMPRESS_STALL) {
+        comp->link = 0.7 * comp->link + 0.3 * rate;
+        comp->stalled += t1 - t0;
+    } else if (rate > comp->link) {
+        comp->link = 0.7 * comp->link + 0.3 * rate;
+    }
+    comp->last = t1;
+
+    comp->count[codec]++;
+    comp->data[codec] += sz;
+    comp->shipped[codec] += meat_sz;
+
+    if (c->opts->seekable) {
+        if (comp->frame_count == comp->frame_cap) {
+            size_t cap = comp->frame_cap ? 2 * comp->frame_cap : 1024;
+            struct seek_frame* frames = realloc(comp->frames, cap * sizeof(*frames));
+            if (!frames) {
+                fprintf(stderr, "ERROR: could not allocate memory for seek index\n");
+                return -1;
+            }
+            comp->frames = frames;
+            comp->frame_cap = cap;
+        }
+        struct seek_frame f = { start, sz, comp->pos, head_sz + meat_sz };
+        comp->frames[comp->frame_count++] = f;
+    }
+    comp->pos += head_sz + meat_sz;
+    return 0;
+}
+
+//
+//content defined chunking of data segments
+//
+//data is cut where a gear hash of the last CDC_WINDOW bytes has its top
+//bits clear (FastCDC), so where a chunk ends depends only on the bytes
+//around it, and content shifted by an insertion upstream is cut into the
+//same chunks; CDC_BITS_S bits are tested before CDC_AVG_SZ and CDC_BITS_L
+//past it, which keeps chunk sizes close to the average
+//
+//the hash rolls two bytes per step, testing the first against a shifted
+//mask, which sits a bit below the top so both bytes test the same bits of
+//the hash, and scans two stripes of a chunk in lockstep, as independent
+//dependency chains keep the cpu busy while each waits for its previous
+//step; the hash forgets a byte after CDC_WINDOW of them, so a stripe
+//starts hashing that far before it and cuts where a serial scan does
+//
+//each chunk is hashed like a tree hash leaf, chunks the chunk index lists
+//are shipped as c references, the rest as k records, and the index is
+//appended with them once the receiver stored the stream, it lists what the
+//chunk store of the receiver holds when every stream shipped with it was
+//decoded into that store; a stream written to output has nobody to answer,
+//its chunks are listed once it is written
+//
+//the daemon answers a stream with the chunks it missed, having evicted
+//them since they were listed, the index forgets them and the stream is
+//sent again, its last attempt ships every chunk as k record
+//
+#define CDC_BITS_S 16
+#define CDC_BITS_L 12
+#define CDC_WINDOW 64       //bytes the hash depends on
+#define CDC_STRIPE 2048     //bytes each lane scans before lanes are checked
+#define CDC_BUFF_SZ (4 << 20)
+#define CHUNK_INDEX_MAGIC "URSCHK01"
+#define CHUNK_RETRIES 2     //streams sent again when daemon misses chunks
+
+struct chunker {
+    uint64_t gear[256];
+    uint64_t gear_ls[256];  //gear shifted left by one
+    char* buff;             //data not cut yet
+    EVP_MD_CTX* md;
+    const char* path;       //of chunk index
+    int fd_index;
+    unsigned char* table;   //open addressing set of chunk hashes, a zero word is a free slot
+    size_t cap;
+    size_t count;
+    unsigned char* fresh;   //hashes of k records, appended to index at the end
+    size_t fresh_count;
+    size_t fresh_cap;
+    int forgotten;          //receiver missed chunks, index is written anew
+    int refs;               //ships listed chunks as c references
+    off_t chunks;           //chunks cut, their data bytes, and those shipped as k records
+    off_t bytes;
+    off_t novel;
+    off_t novel_bytes;
+    double cutting;         //seconds spent finding chunk ends
+};
+
+//returns slot of hash in chunk index, free slot when it is not there
+unsigned char* chunk_index_slot(const struct chunker* k, const unsigned char* digest)
+{
+    uint64_t word;
+    memcpy(&word, digest, sizeof(word));
+
+    for (size_t i = word & (k->cap - 1); ; i = (i + 1) & (k->cap - 1)) {
+        unsigned char* slot = k->table + i * HASH_SZ;
+        uint64_t w;
+        memcpy(&w, slot, sizeof(w));
+        if (!w || !memcmp(slot, digest, HASH_SZ)) return slot;
+    }
+}
+
+//adds hash to chunk index
+//
+//returns 1 when it was there, 0 when added, -1 on error
+int chunk_index_add(struct chunker* k, const unsigned char* digest)
+{
+    if (2 * (k->count + 1) > k->cap) {
+        //keep it at most half full
+        struct chunker grown = *k;
+        grown.cap = k->cap ? 2 * k->cap : 1 << 16;
+        grown.table = calloc(grown.cap, HASH_SZ);
+        if (!grown.table) {
+            fprintf(stderr, "ERROR: could not allocate memory for chunk index\n");
+            return -1;
+        }
+
+        for (size_t i = 0; i < k->cap; ++i) {
+            const unsigned char* slot = k->table + i * HASH_SZ;
+            uint64_t w;
+            memcpy(&w, slot, sizeof(w));
+            if (w) memcpy(chunk_index_slot(&grown, slot), slot, HASH_SZ);
+        }
+
+        free(k->table);
+        k->table = grown.table;
+        k->cap = grown.cap;
+    }
+
+    unsigned char* slot = chunk_index_slot(k, digest);
+    if (!memcmp(slot, digest, HASH_SZ)) return 1;
+
+    memcpy(slot, digest, HASH_SZ);
+    ++k->count;
+    return 0;
+}
+
+//removes hash from chunk index when it is there
+void chunk_index_forget(struct chunker* k, const unsigned char* digest)
+{
+    unsigned char* slot = k->cap ? chunk_index_slot(k, digest) : 0;
+    if (!slot || memcmp(slot, digest, HASH_SZ)) return;
+
+    //shifts later hashes of the probe run back so lookups never stop short
+    size_t mask = k->cap - 1;
+    size_t i = (slot - k->table) / HASH_SZ;
+    for (size_t j = (i + 1) & mask; ; j = (j + 1) & mask) {
+        const unsigned char* next = k->table + j * HASH_SZ;
+        uint64_t word;
+        memcpy(&word, next, sizeof(word));
+        if (!word) break;
+
+        size_t home = word & mask;
+        int movable = i <= j ? home <= i || home > j : home <= i && home > j;
+        if (!movable) continue;
+
+        memcpy(k->table + i * HASH_SZ, next, HASH_SZ);
+        i = j;
+    }
+    memset(k->table + i * HASH_SZ, 0, HASH_SZ);
+    --k->count;
+    k->forgotten = 1;
+}
+
+//reads chunk index, creating it when missing
+int chunk_index_load(struct chunker* k)
+{
+    k->fd_index = open(k->path, O_RDWR | O_CREAT | O_APPEND, 0666);
+    if (k->fd_index == -1) {
+        fprintf(stderr, "ERROR: could not open chunk index %s: %s\n", k->path, strerror(errno));
+        return -1;
+    }
+
+    //another encoder may be creating it
+    flock(k->fd_index, LOCK_EX);
+
+    struct stat st;
+    int r = fstat(k->fd_index, &st);
+    if (!r && !st.st_size) r = write_all(k->fd_index, CHUNK_INDEX_MAGIC, sizeof(CHUNK_INDEX_MAGIC) - 1);
+    if (r) fprintf(stderr, "ERROR: could not create chunk index %s: %s\n", k->path, strerror(errno));
+
+    char magic[sizeof(CHUNK_INDEX_MAGIC) - 1];
+    if (!r && st.st_size && (pread(k->fd_index, magic, sizeof(magic), 0) != sizeof(magic) ||
+        memcmp(magic, CHUNK_INDEX_MAGIC, sizeof(magic)) || (st.st_size - sizeof(magic)) % HASH_SZ)) {
+        fprintf(stderr, "ERROR: %s is not a chunk index\n", k->path);
+        r = -1;
+    }
+
+    unsigned char digests[1024 * HASH_SZ];
+    for (off_t pos = sizeof(magic); !r && pos < st.st_size; ) {
+        ssize_t n = pread(k->fd_index, digests, sizeof(digests), pos);
+        if (n <= 0 || n % HASH_SZ) {
+            fprintf(stderr, "ERROR: could not read chunk index %s\n", k->path);
+            r = -1;
+            break;
+        }
+        for (ssize_t i = 0; i < n && !r; i += HASH_SZ)
+            r = chunk_index_add(k, digests + i) < 0;
+        pos += n;
+    }
+
+    flock(k->fd_index, LOCK_UN);
+    return r ? -1 : 0;
+}
+
+int chunker_init(struct chunker* k, const char* path)
+{
+    memset(k, 0, sizeof(*k));
+    k->path = path;
+    k->fd_index = -1;
+    k->refs = 1;
+
+    //splitmix64, every encoder must cut alike
+    uint64_t x = 0;
+    for (int i = 0; i < 256; ++i) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        k->gear[i] = z ^ (z >> 31);
+        k->gear_ls[i] = k->gear[i] << 1;
+    }
+
+    k->buff = malloc(CDC_BUFF_SZ);
+    k->md = EVP_MD_CTX_new();
+    if (!k->buff || !k->md) {
+        fprintf(stderr, "ERROR: could not allocate memory for chunking\n");
+        return -1;
+    }
+
+    return chunk_index_load(k);
+}
+
+void chunker_free(struct chunker* k)
+{
+    if (k->fd_index != -1) close(k->fd_index);
+    EVP_MD_CTX_free(k->md);
+    free(k->buff);
+    free(k->table);
+    free(k->fresh);
+}
+
+//writes chunk index anew with the hashes it holds, those other encoders
+//appended meanwhile are dropped, which only ships their chunks again
+int chunk_index_rewrite(struct chunker* k)
+{
+    char* buff = malloc(sizeof(CHUNK_INDEX_MAGIC) - 1 + k->count * HASH_SZ);
+    if (!buff) {
+        fprintf(stderr, "ERROR: could not allocate memory for chunk index\n");
+        return -1;
+    }
+
+    size_t sz = sizeof(CHUNK_INDEX_MAGIC) - 1;
+    memcpy(buff, CHUNK_INDEX_MAGIC, sz);
+    for (size_t i = 0; i < k->cap; ++i) {
+        const unsigned char* slot = k->table + i * HASH_SZ;
+        uint64_t w;
+        memcpy(&w, slot, sizeof(w));
+        if (!w) continue;
+        memcpy(buff + sz, slot, HASH_SZ);
+        sz += HASH_SZ;
+    }
+
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", k->path, getpid());
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    int r = fd == -1 || write_all(fd, buff, sz);
+    if (fd != -1 && close(fd)) r = 1;
+    if (!r && rename(tmp, k->path)) r = 1;
+
+    if (r) {
+        fprintf(stderr, "ERROR: could not write chunk index %s: %s\n", k->path, strerror(errno));
+        unlink(tmp);
+    }
+    free(buff);
+    return r ? -1 : 0;
+}
+
+//appends hashes of chunks shipped as k records to chunk index,
+//called once the receiver stored them
+int chunker_commit(struct chunker* k)
+{
+    if (k->forgotten) return chunk_index_rewrite(k);
+
+    if (write_all(k->fd_index, (const char*)k->fresh, k->fresh_count * HASH_SZ)) {
+        fprintf(stderr, "ERROR: could not append to chunk index %s: %s\n", k->path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+void chunker_report(const struct chunker* k)
+{
+    fprintf(stderr, "INFO: cut %ld bytes into %ld chunks at %.2f GB/s, shipped %ld chunks of %ld bytes (%.1f%%)\n",
+        k->bytes, k->chunks, k->cutting > 0 ? k->bytes / k->cutting / 1e9 : 0.0,
+        k->novel, k->novel_bytes, k->bytes ? 100.0 * k->novel_bytes / k->bytes : 0.0);
+}
+
+//gear hash of CDC_WINDOW bytes before p, as left by rolling it over them
+uint64_t cdc_warm(const struct chunker* k, const unsigned char* p)
+{
+    uint64_t h = 0;
+    for (int i = -CDC_WINDOW; i < 0; i += 2) {
+        h = (h << 2) + k->gear_ls[p[i]];
+        h += k->gear[p[i+1]];
+    }
+    return h;
+}
+
+//returns end of first chunk ending in (lo, hi], 0 when none does
+//lo and hi are even, lo is at least CDC_WINDOW
+size_t cdc_scan(const struct chunker* k, const unsigned char* p, size_t lo, size_t hi, int bits)
+{
+    uint64_t mask = ~0ull << (64 - bits) >> 1;
+    uint64_t mask_ls = mask << 1;
+    uint64_t h = cdc_warm(k, p + lo);
+
+    for (size_t i = lo; i < hi; i += 2) {
+        h = (h << 2) + k->gear_ls[p[i]];
+        if (!(h & mask_ls)) return i + 1;
+        h += k->gear[p[i+1]];
+        if (!(h & mask)) return i + 2;
+    }
+    return 0;
+}
+
+//cdc_scan of two stripes at a time in lockstep
+size_t cdc_scan_lanes(const struct chunker* k, const unsigned char* p, size_t lo, size_t hi, int bits)
+{
+    uint64_t mask = ~0ull << (64 - bits) >> 1;
+    uint64_t mask_ls = mask << 1;
+
+    for (; hi - lo >= 2 * CDC_STRIPE; lo += 2 * CDC_STRIPE) {
+        const unsigned char* a = p + lo;
+        const unsigned char* b = a + CDC_STRIPE;
+        uint64_t ha = cdc_warm(k, a);
+        uint64_t hb = cdc_warm(k, b);
+
+        for (size_t i = 0; i < CDC_STRIPE; i += 2) {
+            ha = (ha << 2) + k->gear_ls[a[i]];
+            hb = (hb << 2) + k->gear_ls[b[i]];
+            int hit = !(ha & mask_ls) | !(hb & mask_ls);
+            ha += k->gear[a[i+1]];
+            hb += k->gear[b[i+1]];
+            hit |= !(ha & mask) | !(hb & mask);
+
+            if (__builtin_expect(hit, 0)) {
+                //first stripe ends first
+                size_t end = cdc_scan(k, p, lo + i, lo + CDC_STRIPE, bits);
+                return end ? end : cdc_scan(k, p, lo + CDC_STRIPE + i, lo + 2 * CDC_STRIPE, bits);
+            }
+        }
+    }
+
+    return lo < hi ? cdc_scan(k, p, lo, hi, bits) : 0;
+}
+
+//returns length of chunk starting at p, sz bytes of data follow it
+size_t cdc_cut(const struct chunker* k, const unsigned char* p, size_t sz)
+{
+    if (sz <= CDC_MIN_SZ) return sz;
+
+    size_t normal = (sz < CDC_AVG_SZ ? sz : CDC_AVG_SZ) & ~1;
+    size_t end = sz < CDC_MAX_SZ ? sz : CDC_MAX_SZ;
+
+    size_t cut = cdc_scan_lanes(k, p, CDC_MIN_SZ, normal, CDC_BITS_S);
+    if (!cut) cut = cdc_scan_lanes(k, p, normal, end & ~1, CDC_BITS_L);
+    return cut ? cut : end;
+}
+
+//ships chunk as k record, or c reference when it is in chunk index
+int do_sparse_chunk(struct sparse_ctx* c, off_t start, const char* buff, size_t sz)
+{
+    struct chunker* k = c->chunks;
+
+    unsigned char digest[HASH_SZ];
+    hash_leaf(k->md, (const unsigned char*)buff, sz, digest);
+
+    int listed = chunk_index_add(k, digest);
+    if (listed < 0) return -1;
+    int known = listed && k->refs;
+
+    if (!listed && k->fresh_count == k->fresh_cap) {
+        size_t cap = k->fresh_cap ? 2 * k->fresh_cap : 1024;
+        unsigned char* fresh = realloc(k->fresh, cap * HASH_SZ);
+        if (!fresh) {
+            fprintf(stderr, "ERROR: could not allocate memory for chunk index\n");
+            return -1;
+        }
+        k->fresh = fresh;
+        k->fresh_cap = cap;
+    }
+    if (!listed) memcpy(k->fresh + k->fresh_count++ * HASH_SZ, digest, HASH_SZ);
+
+    char head[64 + 2 * HASH_SZ];
+    int head_sz = snprintf(head, sizeof(head), "%c %ld %zu\n", known ? 'c' : 'k', start, sz);
+    hash_hex(digest, head + head_sz);
+    head_sz += 2 * HASH_SZ;
+
+    if (write_all(c->fd_out, head, head_sz) || (!known && write_all(c->fd_out, buff, sz))) {
+        perror("ERROR: could not write chunk");
+        return -1;
+    }
+
+    ++k->chunks;
+    k->bytes += sz;
+    if (!known) {
+        ++k->novel;
+        k->novel_bytes += sz;
+    }
+    return 0;
+}
+
+//ships data segment in content defined chunks, cut where they end
+//wherever the data sits in the buffer
+int do_sparse_chunks(struct sparse_ctx* c, off_t start, size_t sz)
+{
+    struct chunker* k = c->chunks;
+    size_t held = 0; //bytes read but not shipped, data at start
+
+    while (sz || held) {
+        size_t n = CDC_BUFF_SZ - held < sz ? CDC_BUFF_SZ - held : sz;
+        if (n && do_sparse_read_block(c, k->buff + held, start + held, n)) return -1;
+        held += n;
+        sz -= n;
+
+        //a chunk is cut only once it can reach CDC_MAX_SZ, or the segment ends
+        size_t pos = 0;
+        while (held - pos >= CDC_MAX_SZ || (!sz && pos < held)) {
+            double t0 = now_seconds();
+            size_t len = cdc_cut(k, (const unsigned char*)k->buff + pos, held - pos);
+            k->cutting += now_seconds() - t0;
+
+            if (do_sparse_chunk(c, start + pos, k->buff + pos, len)) return -1;
+            pos += len;
+        }
+
+        memmove(k->buff, k->buff + pos, held - pos);
+        start += pos;
+        held -= pos;
+    }
+
+    return 0;
+}
+
+int do_sparse_data(struct sparse_ctx* c, off_t start, size_t sz)
+{
+    fprintf(stderr, "INFO: processing segment %ld %ld\n", start, sz);
+
+    do_sparse_hash_hole(c, start);
+
+    if (c->chunks) return do_sparse_chunks(c, start, sz);
+
+    while (c->compress && sz) {
+        size_t n = sz > COMPRESS_BLOCK_SZ ? COMPRESS_BLOCK_SZ : sz;
+        if (do_sparse_block(c, start, n)) return -1;
+        start += n;
+        sz -= n;
+    }
+    if (c->compress) return 0;
+
+    if (4 > dprintf(c->fd_out, "%ld %ld\n", start, sz)) {
+        perror("ERROR: could not write segment");
+        return -1;
+    }
+    if (-1 == do_sparse_copy_data(c, start, sz)) {
+        return -1;
+    }
+    return 0;
+}
+
+//writes trailer with file size, and hash when verifying
+int do_sparse_trailer(struct sparse_ctx* c, off_t size)
+{
+    if (!c->hash) {
+        if (0 > dprintf(c->fd_out, "h %ld 0\n", size)) {
+            perror("ERROR: could not write trailer");
+            return -1;
+        }
+        return 0;
+    }
+
+    do_sparse_hash_hole(c, size);
+
+    unsigned char digest[HASH_SZ];
+    char hex[2 * HASH_SZ + 1];
+    tree_hash_final(c->hash, digest);
+    hash_hex(digest, hex);
+
+    fprintf(stderr, "INFO: hash %s\n", hex);
+
+    if (0 > dprintf(c->fd_out, "h %ld %d\n%s", size, 2 * HASH_SZ, hex)) {
+        perror("ERROR: could not write hash");
+        return -1;
+    }
+    return 0;
+}
+
+//writes seek index of blocks written, it ends the stream
+int do_sparse_index(struct sparse_ctx* c, off_t size)
+{
+    struct compressor* comp = c->compress;
+
+    //4 numbers of up to 20 digits per line, and the tail
+    size_t cap = comp->frame_count * 84 + 21;
+    char* meat = malloc(cap);
+    if (!meat) {
+        fprintf(stderr, "ERROR: could not allocate memory for seek index\n");
+        return -1;
+    }
+
+    size_t sz = 0;
+    for (size_t i = 0; i < comp->frame_count; ++i) {
+        const struct seek_frame* f = &comp->frames[i];
+        sz += snprintf(meat + sz, cap - sz, "%ld %ld %ld %ld\n", f->offset, f->size, f->pos, f->record);
+    }
+
+    char head[64];
+    int head_sz = snprintf(head, sizeof(head), "i %ld %zu\n", size, sz + 21);
+    sz += snprintf(meat + sz, cap - sz, "%020ld\n", (off_t)(head_sz + sz + 21));
+
+    fprintf(stderr, "INFO: seek index of %zu blocks\n", comp->frame_count);
+
+    int r = write_all(c->fd_out, head, head_sz) || write_all(c->fd_out, meat, sz);
+    if (r) perror("ERROR: could not write seek index");
+    free(meat);
+    return r ? -1 : 0;
+}
+
+int do_sparse_unwritten(int fd_out, off_t start, size_t sz)
+{
+    fprintf(stderr, "INFO: processing unwritten segment %ld %ld\n", start, sz);
+
+    if (6 > dprintf(fd_out, "u %ld %ld\n", start, sz)) {
+        perror("ERROR: could not write segment");
+        return -1;
+    }
+    return 0;
+}
+
+int do_sparse_ref(int fd_out, off_t start, size_t sz, off_t source)
+{
+    fprintf(stderr, "INFO: processing back-reference %ld %ld %ld\n", start, sz, source);
+
+    if (8 > dprintf(fd_out, "r %ld %ld %ld\n", start, sz, source)) {
+        perror("ERROR: could not write segment");
+        return -1;
+    }
+    return 0;
+}
+
+int do_sparse_flush(struct sparse_ctx* c)
+{
+    if (!c->data_size) return 0;
+
+    int r = do_sparse_data(c, c->data_offset, c->data_size);
+    c->data_size = 0;
+    return r;
+}
+
+//queues data range, adjacent ranges are shipped as one segment
+int do_sparse_queue(struct sparse_ctx* c, off_t start, off_t sz)
+{
+    if (c->data_size && c->data_offset + c->data_size == start) {
+        c->data_size += sz;
+        return 0;
+    }
+
+    int r = do_sparse_flush(c);
+    if (r) return r;
+
+    c->data_offset = start;
+    c->data_size = sz;
+    return 0;
+}
+
+//ships shared extent, parts whose physical blocks were already shipped
+//become back-references to where they were shipped
+int do_sparse_shared(struct sparse_ctx* c, const struct extent* e)
+{
+    off_t physical = e->physical;
+    off_t end = e->physical + e->size;
+
+    while (physical < end) {
+        off_t offset = e->offset + (physical - e->physical);
+        size_t i = shared_map_find(&c->shared, physical);
+        struct shared_range* range = i < c->shared.count ? &c->shared.ranges[i] : 0;
+
+        if (range && range->physical <= physical) {
+            off_t range_end = range->physical + range->size;
+            off_t sz = (range_end < end ? range_end : end) - physical;
+
+            int r = do_sparse_flush(c);
+            if (r) return r;
+
+            r = do_sparse_ref(c->fd_out, offset, sz, range->offset + (physical - range->physical));
+            if (r) return r;
+
+            if (c->hash) {
+                //contents of reference are not shipped but are hashed
+                do_sparse_hash_hole(c, offset);
+                r = do_sparse_read_data(c, offset, sz, 0);
+                if (r) return r;
+            }
+
+            physical += sz;
+            continue;
+        }
+
+        off_t gap_end = range && range->physical < end ? range->physical : end;
+        struct shared_range shipped = { physical, gap_end - physical, offset };
+
+        int r = shared_map_insert(&c->shared, i, shipped);
+        if (r) return r;
+
+        r = do_sparse_queue(c, offset, shipped.size);
+        if (r) return r;
+
+        physical = gap_end;
+    }
+
+    return 0;
+}
+
+int do_sparse_extent(const struct extent* e, void* ctx)
+{
+    struct sparse_ctx* c = ctx;
+
+    if (e->flags & EXTENT_UNWRITTEN) {
+        //reads as zeros, never ship it
+        if (!c->opts->prealloc) return 0;
+
+        int r = do_sparse_flush(c);
+        if (r) return r;
+
+        //hashed as a hole when reached
+        return do_sparse_unwritten(c->fd_out, e->offset, e->size);
+    }
+
+    if (e->flags & EXTENT_SHARED) return do_sparse_shared(c, e);
+
+    return do_sparse_queue(c, e->offset, e->size);
+}
+
+//encodes sparse input file into ursparse stream
+//
+//chunks => chunk index, 0 when data is not shipped in chunks, the caller
+//          commits it once the receiver stored the stream
+int do_sparse_with(int fd_in, int fd_out, const struct options* opts, struct chunker* chunks)
+{
+    struct sparse_ctx ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.fd_in = fd_in;
+    ctx.fd_out = fd_out;
+    ctx.opts = opts;
+
+    struct tree_hash hash;
+    if (opts->verify) {
+        if (tree_hash_init(&hash, opts->threads)) return 1;
+        ctx.hash = &hash;
+    }
+
+    //seekable streams ship even raw data in blocks
+    struct compressor comp;
+    if (opts->codec != CODEC_RAW || opts->seekable) {
+        ctx.compress = &comp;
+        if (compressor_init(&comp, opts->codec)) {
+            compressor_free(&comp);
+            if (ctx.hash) tree_hash_free(ctx.hash);
+            return 1;
+        }
+    }
+
+    ctx.chunks = chunks;
+
+    unsigned keep = EXTENT_UNWRITTEN;
+    if (opts->refs) keep |= EXTENT_SHARED;
+
+    off_t end = opts->range_end ? opts->range_end : INT64_MAX;
+    int r = walk_extents_cached(fd_in, opts->range_start, end, keep, opts->extent_cache, do_sparse_extent, &ctx);
+    if (!r) r = do_sparse_flush(&ctx);
+
+    //range ends with size trailer so its trailing hole is decoded too
+    struct stat st;
+    int trailer = ctx.hash || opts->range_end || opts->seekable;
+    if (!r && trailer) {
+        r = fstat(fd_in, &st);
+        if (r) perror("ERROR: could not stat input file");
+    }
+    if (!r && opts->range_end && st.st_size > opts->range_end) st.st_size = opts->range_end;
+    if (!r && trailer) r = do_sparse_trailer(&ctx, st.st_size);
+    if (!r && opts->seekable) r = do_sparse_index(&ctx, st.st_size);
+
+    if (ctx.compress) {
+        if (!r) compressor_report(ctx.compress);
+        compressor_free(ctx.compress);
+    }
+    if (ctx.chunks && !r) chunker_report(ctx.chunks);
+    if (ctx.hash) tree_hash_free(ctx.hash);
+    free(ctx.buff);
+    free(ctx.shared.ranges);
+    return r ? 1 : 0;
+}
+
+//encodes sparse input file into ursparse stream, chunks it ships are
+//listed in chunk index once it is written, nothing tells whether they
+//were stored
+int do_sparse(int fd_in, int fd_out, const struct options* opts)
+{
+    if (!opts->chunks) return do_sparse_with(fd_in, fd_out, opts, 0);
+
+    struct chunker chunks;
+    int r = chunker_init(&chunks, opts->chunks);
+    if (!r) r = do_sparse_with(fd_in, fd_out, opts, &chunks);
+    if (!r) r = chunker_commit(&chunks);
+    chunker_free(&chunks);
+    return r ? 1 : 0;
+}
+
+//
+//random access to seekable stream
+//
+//the seek index at the end of the stream tells where the record of each
+//data block starts, blocks overlapping the range are read and decoded
+//directly, split among threads when output is seekable
+//
+#define SEEK_TAIL_SZ 21  //"%020ld\n" ending the index
+
+struct seek_index {
+    off_t size;   //logical size of file
+    struct seek_frame* frames;
+    size_t count;
+};
+
+//reads seek index from end of stream
+int seek_index_read(int fd, struct seek_index* idx)
+{
+    memset(idx, 0, sizeof(*idx));
+
+    struct stat st;
+    if (fstat(fd, &st)) {
+        perror("ERROR: could not stat input file");
+        return -1;
+    }
+
+    char tail[SEEK_TAIL_SZ + 1] = { 0 };
+    off_t len = 0;
+    if (S_ISREG(st.st_mode) && st.st_size > SEEK_TAIL_SZ &&
+        SEEK_TAIL_SZ == pread(fd, tail, SEEK_TAIL_SZ, st.st_size - SEEK_TAIL_SZ)) {
+        tail[SEEK_TAIL_SZ] = 0;
+        len = atoll(tail);
+    }
+    if (tail[SEEK_TAIL_SZ - 1] != '\n' || len <= SEEK_TAIL_SZ || len > st.st_size) {
+        fprintf(stderr, "ERROR: input file has no seek index, encode it with --seekable\n");
+        return -1;
+    }
+
+    char* buff = malloc(len + 1);
+    if (!buff) {
+        fprintf(stderr, "ERROR: could not allocate memory: %ld bytes\n", len + 1);
+        return -1;
+    }
+
+    off_t start = st.st_size - len;
+    int head_sz = 0;
+    off_t meat_sz = 0;
+    if (len != pread(fd, buff, len, start)) {
+        perror("ERROR: could not read seek index");
+        free(buff);
+        return -1;
+    }
+    buff[len] = 0;
+
+    if (2 != sscanf(buff, "i %ld %ld\n%n", &idx->size, &meat_sz, &head_sz) || head_sz + meat_sz != len) {
+        fprintf(stderr, "ERROR: invalid seek index\n");
+        free(buff);
+        return -1;
+    }
+
+    for (const char* p = buff + head_sz; p < buff + len - SEEK_TAIL_SZ; ++p)
+        idx->count += *p == '\n';
+
+    idx->frames = malloc((idx->count + 1) * sizeof(*idx->frames));
+    if (!idx->frames) {
+        fprintf(stderr, "ERROR: could not allocate memory for seek index\n");
+        free(buff);
+        return -1;
+    }
+
+    const char* p = buff + head_sz;
+    for (size_t i = 0; i < idx->count; ++i) {
+        struct seek_frame* f = &idx->frames[i];
+        int n = 0;
+        if (4 != sscanf(p, "%ld %ld %ld %ld\n%n", &f->offset, &f->size, &f->pos, &f->record, &n) ||
+            f->size <= 0 || f->record <= 0 || f->pos + f->record > start || f->offset + f->size > idx->size ||
+            (i && f->offset < f[-1].offset + f[-1].size)) {
+            fprintf(stderr, "ERROR: invalid seek index entry %zu\n", i);
+            free(buff);
+            free(idx->frames);
+            return -1;
+        }
+        p += n;
+    }
+
+    free(buff);
+    return 0;
+}
+
+struct extract_job {
+    pthread_t thread;
+    int fd_in;
+    struct ursparse_output out;
+    const struct seek_frame* frames;
+    size_t count;
+    const struct options* opts;
+    int r;
+};
+
+//decodes records of job frames into its output
+void* extract_worker(void* arg)
+{
+    struct extract_job* j = arg;
+
+    struct ursparse_state_data data;
+    memset(&data, 0, sizeof(data));
+    data.out = &j->out;
+    data.out_count = 1;
+    data.range_start = j->opts->range_start;
+    data.range_end = j->opts->range_end;
+
+    off_t cap = 1;
+    for (size_t i = 0; i < j->count; ++i)
+        if (j->frames[i].record > cap) cap = j->frames[i].record;
+
+    char* buff = malloc(cap);
+    if (!buff) {
+        fprintf(stderr, "ERROR: could not allocate memory: %ld bytes\n", cap);
+        j->r = -1;
+        return 0;
+    }
+
+    for (size_t i = 0; i < j->count && !j->r; ++i) {
+        const struct seek_frame* f = &j->frames[i];
+
+        off_t done = 0;
+        while (done < f->record) {
+            ssize_t r = pread(j->fd_in, buff + done, f->record - done, f->pos + done);
+            if (r == -1 && errno == EINTR) continue;
+            if (r <= 0) break;
+            done += r;
+        }
+        if (done < f->record) {
+            perror("ERROR: could not read segment");
+            j->r = -1;
+            break;
+        }
+
+        for (size_t cursor = 0; cursor < f->record && !j->r; ) {
+            size_t out_sz = 0;
+            if (0 > parse_ursparse(buff + cursor, f->record - cursor, &out_sz, &data)) j->r = -1;
+            cursor += out_sz;
+        }
+
+        if (!j->r && data.state != PARSE_START) {
+            fprintf(stderr, "ERROR: seek index entry %ld %ld does not match a segment\n", f->offset, f->size);
+            j->r = -1;
+        }
+    }
+
+    free_ursparse_state(&data);
+    free(buff);
+    return 0;
+}
+
+//decodes range of seekable stream, or all of it, without reading the rest
+int do_extract(int fd_in, int fd_out, const struct options* opts)
+{
+    struct seek_index idx;
+    if (seek_index_read(fd_in, &idx)) return 3;
+
+    off_t start = opts->range_start;
+    off_t end = opts->range_end ? opts->range_end : idx.size;
+
+    //frames are ascending and disjoint, so are their ends
+    size_t lo = 0, hi = idx.count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (idx.frames[mid].offset + idx.frames[mid].size > start) hi = mid;
+        else lo = mid + 1;
+    }
+    size_t first = lo;
+    for (hi = idx.count; lo < hi; ) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (idx.frames[mid].offset >= end) hi = mid;
+        else lo = mid + 1;
+    }
+    size_t count = lo - first;
+
+    int seekable = -1 != lseek(fd_out, 0, SEEK_CUR);
+    if (!seekable) fprintf(stderr, "INFO: output file is not seekable, writing holes as zeros\n");
+
+    //threads write through own open file descriptions, so they seek independently
+    size_t jobs = seekable ? opts->threads : 1;
+    if (jobs > count) jobs = count;
+    if (!jobs) jobs = 1;
+
+    fprintf(stderr, "INFO: extracting %zu of %zu blocks with %zu threads\n", count, idx.count, jobs);
+
+    struct extract_job job[jobs];
+    memset(job, 0, sizeof(job));
+
+    int r = 0;
+    size_t next = first;
+    for (size_t i = 0; i < jobs; ++i) {
+        struct extract_job* j = &job[i];
+        j->fd_in = fd_in;
+        j->opts = opts;
+        j->frames = idx.frames + next;
+        j->count = count / jobs + (i < count % jobs);
+        next += j->count;
+
+        j->out.fd = fd_out;
+        j->out.fd_src = -1;
+        j->out.seekable = seekable;
+        j->out.throttle = opts->throttle;
+        j->out.durability = opts->durability;
+        j->out.sync_size = opts->sync_size;
+        if (!seekable) j->out.pos = opts->range_start;
+
+        if (i) j->out.fd = -1;
+        if (i && !r) {
+            char path[64];
+            snprintf(path, sizeof(path), "/proc/self/fd/%d", fd_out);
+            j->out.fd = open(path, O_WRONLY);
+            if (j->out.fd == -1) {
+                perror("ERROR: could not reopen output file");
+                r = -1;
+            }
+        }
+    }
+
+    size_t started = 0;
+    for (; !r && started < jobs; ++started) {
+        if (pthread_create(&job[started].thread, 0, extract_worker, &job[started])) {
+            fprintf(stderr, "ERROR: could not start extract thread\n");
+            r = -1;
+            break;
+        }
+    }
+    for (size_t i = 0; i < started; ++i) {
+        pthread_join(job[i].thread, 0);
+        if (job[i].r) r = -1;
+    }
+
+    //file size as seen through the range, extends output past trailing hole
+    struct ursparse_output* out = &job[jobs - 1].out;
+    off_t size = end < idx.size ? end : idx.size;
+    if (size < out->pos) size = out->pos;
+    if (!r) r = do_trailer(out, size, 0);
+    if (!r) r = output_sync(out);
+    if (!r) r = output_syncfs(out, 1);
+
+    for (size_t i = 0; i < jobs; ++i) {
+        if (i && job[i].out.fd != -1) close(job[i].out.fd);
+        if (job[i].out.fd_src != -1) close(job[i].out.fd_src);
+        if (job[i].out.zeros) munmap(job[i].out.zeros, ZEROS_SZ);
+    }
+    free(idx.frames);
+    return r ? 4 : 0;
+}
+
+//
+//encrypted stream
+//
+//  e CIPHER SALT\n
+//  LEN\n<LEN bytes of ciphertext><tag>
+//  ...
+//  0\n<tag>
+//
+//ursparse stream is cut into records of up to CRYPT_RECORD_SZ bytes, each
+//sealed with AEAD under a stream key derived from the shared key and the
+//random salt; the record header line is authenticated as additional data
+//and the nonce is the offset of the record in the stream, so records can
+//not be altered, reordered or dropped, and the empty last record makes
+//truncation detectable
+//
+//records are sealed and opened by a pool of worker threads while one
+//thread reads records and another writes them in stream order
+//
+#define CRYPT_RECORD_SZ (1 << 20)
+#define CRYPT_KEY_SZ    32
+#define CRYPT_SALT_SZ   16
+#define CRYPT_NONCE_SZ  12
+#define CRYPT_TAG_SZ    16
+#define CRYPT_HEAD_SZ   24  //record header line
+
+const EVP_CIPHER* crypt_cipher(const char* name)
+{
+    if (!strcmp(name, "aes-256-gcm")) return EVP_aes_256_gcm();
+    if (!strcmp(name, "chacha20-poly1305")) return EVP_chacha20_poly1305();
+    return 0;
+}
+
+//AES-GCM when cpu accelerates it, ChaCha20-Poly1305 is faster in software
+const char* crypt_default_cipher()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (!__builtin_cpu_supports("aes") || !__builtin_cpu_supports("pclmul")) return "chacha20-poly1305";
+#endif
+    return "aes-256-gcm";
+}
+
+enum { SLOT_FREE, SLOT_READ, SLOT_BUSY, SLOT_DONE };
+
+struct crypt_slot {
+    int state;
+    off_t offset;        //of record in ursparse stream
+    size_t sz;           //of record data
+    char* head;          //header line, just before out
+    size_t head_sz;
+    unsigned char* in;   //data, followed by tag when opening
+    unsigned char* out;  //data, followed by tag when sealing
+    int failed;
+};
+
+struct crypt {
+    const EVP_CIPHER* cipher;
+    unsigned char key[CRYPT_KEY_SZ]; //of stream
+    int encrypt;
+    int fd_out;
+    struct crypt_slot* slots;
+    size_t count;
+    size_t read;         //records read
+    size_t taken;        //records taken by workers
+    size_t written;      //records written
+    int eof;             //all records read
+    int failed;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+int crypt_record(EVP_CIPHER_CTX* ctx, const struct crypt* c, struct crypt_slot* s)
+{
+    unsigned char nonce[CRYPT_NONCE_SZ] = { 0 };
+    uint64_t offset = htobe64(s->offset);
+    memcpy(nonce + CRYPT_NONCE_SZ - sizeof(offset), &offset, sizeof(offset));
+
+    int n;
+    if (1 != EVP_CipherInit_ex(ctx, 0, 0, 0, nonce, c->encrypt)) return -1;
+    if (1 != EVP_CipherUpdate(ctx, 0, &n, (unsigned char*)s->head, s->head_sz)) return -1;
+    if (s->sz && 1 != EVP_CipherUpdate(ctx, s->out, &n, s->in, s->sz)) return -1;
+    if (!c->encrypt && 1 != EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, CRYPT_TAG_SZ, s->in + s->sz)) return -1;
+    if (1 != EVP_CipherFinal_ex(ctx, s->out + s->sz, &n)) return -1;
+    if (c->encrypt && 1 != EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, CRYPT_TAG_SZ, s->out + s->sz)) return -1;
+    return 0;
+}
+
+void* crypt_worker(void* arg)
+{
+    struct crypt* c = arg;
+
+    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+    int r = !ctx || 1 != EVP_CipherInit_ex(ctx, c->cipher, 0, c->key, 0, c->encrypt);
+
+    pthread_mutex_lock(&c->lock);
+    if (r) {
+        fprintf(stderr, "ERROR: could not initialize cipher\n");
+        c->failed = 1;
+        pthread_cond_broadcast(&c->cond);
+    }
+    while (!c->failed) {
+        while (!c->failed && c->taken == c->read && !c->eof) pthread_cond_wait(&c->cond, &c->lock);
+        if (c->failed || c->taken == c->read) break;
+
+        struct crypt_slot* s = &c->slots[c->taken++ % c->count];
+        s->state = SLOT_BUSY;
+        pthread_mutex_unlock(&c->lock);
+
+        r = crypt_record(ctx, c, s);
+
+        pthread_mutex_lock(&c->lock);
+        s->failed = r;
+        s->state = SLOT_DONE;
+        pthread_cond_broadcast(&c->cond);
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    EVP_CIPHER_CTX_free(ctx);
+    return 0;
+}
+
+//writes records in stream order as workers finish them
+void* crypt_writer(void* arg)
+{
+    struct crypt* c = arg;
+
+    pthread_mutex_lock(&c->lock);
+    while (!c->failed) {
+        struct crypt_slot* s = &c->slots[c->written % c->count];
+        while (!c->failed && !(c->written < c->read && s->state == SLOT_DONE) && !(c->written == c->read && c->eof))
+            pthread_cond_wait(&c->cond, &c->lock);
+        if (c->failed || c->written == c->read) break;
+        pthread_mutex_unlock(&c->lock);
+
+        int r = 0;
+        if (s->failed && c->encrypt) fprintf(stderr, "ERROR: could not encrypt record at %ld\n", s->offset);
+        if (s->failed && !c->encrypt) fprintf(stderr, "ERROR: encrypted record at %ld failed authentication\n", s->offset);
+        if (!s->failed && c->encrypt) r = write_all(c->fd_out, s->head, s->head_sz + s->sz + CRYPT_TAG_SZ);
+        if (!s->failed && !c->encrypt) r = write_all(c->fd_out, (char*)s->out, s->sz);
+        if (r) perror("ERROR: could not write to output file");
+
+        pthread_mutex_lock(&c->lock);
+        if (r || s->failed) c->failed = 1;
+        s->state = SLOT_FREE;
+        c->written++;
+        pthread_cond_broadcast(&c->cond);
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    return 0;
+}
+
+//reads line of encrypted stream, a few bytes per record
+//
+//returns its length with newline, -1 on error
+ssize_t crypt_read_line(int fd, char* buff, size_t sz)
+{
+    size_t n = 0;
+    while (n < sz) {
+        ssize_t r = read(fd, buff + n, 1);
+        if (r == -1 && errno == EINTR) continue;
+        if (r == -1) {
+            perror("ERROR: could not read encrypted stream");
+            return -1;
+        }
+        if (!r) {
+            fprintf(stderr, "ERROR: encrypted stream is truncated\n");
+            return -1;
+        }
+        if (buff[n++] == '\n') return n;
+    }
+
+    fprintf(stderr, "ERROR: invalid encrypted stream line\n");
+    return -1;
+}
+
+//reads next record into free slot
+//
+//returns 1 when it is the last one, 0 when more follow, -1 on error
+int crypt_read(struct crypt* c, int fd_in, struct crypt_slot* s, off_t offset)
+{
+    s->offset = offset;
+    s->failed = 0;
+
+    if (c->encrypt) {
+        ssize_t r = sink_read(fd_in, (char*)s->in, CRYPT_RECORD_SZ);
+        if (r == -1) {
+            perror("ERROR: could not read encoded stream");
+            return -1;
+        }
+        s->sz = r;
+
+        //header goes right before sealed data, so record is written at once
+        char head[CRYPT_HEAD_SZ];
+        s->head_sz = snprintf(head, sizeof(head), "%zu\n", s->sz);
+        s->head = (char*)s->out - s->head_sz;
+        memcpy(s->head, head, s->head_sz);
+        return !r;
+    }
+
+    s->head = (char*)s->out - CRYPT_HEAD_SZ;
+    ssize_t n = crypt_read_line(fd_in, s->head, CRYPT_HEAD_SZ);
+    if (n == -1) return -1;
+    s->head_sz = n;
+
+    size_t used = 0, digits = 0;
+    off_t sz = 0;
+    if (parse_uint(s->head, n, &used, &sz, &digits) || s->head[used] != '\n' || sz > CRYPT_RECORD_SZ) {
+        fprintf(stderr, "ERROR: invalid encrypted record header\n");
+        return -1;
+    }
+    s->sz = sz;
+
+    ssize_t r = sink_read(fd_in, (char*)s->in, s->sz + CRYPT_TAG_SZ);
+    if (r == -1) perror("ERROR: could not read encrypted stream");
+    if (r >= 0 && r != (ssize_t)(s->sz + CRYPT_TAG_SZ)) fprintf(stderr, "ERROR: encrypted stream is truncated\n");
+    if (r != (ssize_t)(s->sz + CRYPT_TAG_SZ)) return -1;
+    return !sz;
+}
+
+//writes or reads stream header and derives stream key from it
+int crypt_header(struct crypt* c, int fd, const struct options* opts)
+{
+    unsigned char salt[CRYPT_SALT_SZ];
+    char line[64];
+    char name[32];
+
+    if (c->encrypt) {
+        if (1 != RAND_bytes(salt, sizeof(salt))) {
+            fprintf(stderr, "ERROR: could not generate salt\n");
+            return -1;
+        }
+        int n = snprintf(line, sizeof(line), "e %s ", opts->cipher);
+        for (int i = 0; i < CRYPT_SALT_SZ; ++i) n += sprintf(line + n, "%02x", salt[i]);
+        line[n++] = '\n';
+        if (write_all(fd, line, n)) {
+            perror("ERROR: could not write to output file");
+            return -1;
+        }
+        strcpy(name, opts->cipher);
+    } else {
+        ssize_t n = crypt_read_line(fd, line, sizeof(line) - 1);
+        if (n == -1) return -1;
+        line[n] = 0;
+
+        int used = 0;
+        if (1 != sscanf(line, "e %31s %n", name, &used) || n - used != 2 * CRYPT_SALT_SZ + 1) {
+            fprintf(stderr, "ERROR: input is not an encrypted stream\n");
+            return -1;
+        }
+        for (int i = 0; i < CRYPT_SALT_SZ; ++i) {
+            unsigned x;
+            if (1 != sscanf(line + used + 2 * i, "%2x", &x)) {
+                fprintf(stderr, "ERROR: invalid salt of encrypted stream\n");
+                return -1;
+            }
+            salt[i] = x;
+        }
+    }
+
+    c->cipher = crypt_cipher(name);
+    if (!c->cipher) {
+        fprintf(stderr, "ERROR: unknown cipher %s\n", name);
+        return -1;
+    }
+
+    unsigned len = sizeof(c->key);
+    if (!HMAC(EVP_sha256(), opts->key, CRYPT_KEY_SZ, salt, sizeof(salt), c->key, &len)) {
+        fprintf(stderr, "ERROR: could not derive stream key\n");
+        return -1;
+    }
+    return 0;
+}
+
+//runs reader, writer and workers over allocated slots
+int crypt_run(struct crypt* c, int fd_in, int threads)
+{
+    pthread_mutex_init(&c->lock, 0);
+    pthread_cond_init(&c->cond, 0);
+
+    pthread_t writer;
+    pthread_t workers[threads];
+    int started = 0;
+    int writing = !pthread_create(&writer, 0, crypt_writer, c);
+    int r = !writing;
+    while (!r && started < threads) {
+        r = pthread_create(&workers[started], 0, crypt_worker, c);
+        if (!r) started++;
+    }
+    if (r) fprintf(stderr, "ERROR: could not start encryption thread\n");
+
+    off_t offset = 0;
+    int last = 0;
+    while (!r && !last) {
+        pthread_mutex_lock(&c->lock);
+        struct crypt_slot* s = &c->slots[c->read % c->count];
+        while (!c->failed && s->state != SLOT_FREE) pthread_cond_wait(&c->cond, &c->lock);
+        r = c->failed;
+        pthread_mutex_unlock(&c->lock);
+        if (r) break;
+
+        last = crypt_read(c, fd_in, s, offset);
+        if (last == -1) break;
+        offset += s->sz;
+
+        pthread_mutex_lock(&c->lock);
+        s->state = SLOT_READ;
+        c->read++;
+        pthread_cond_broadcast(&c->cond);
+        pthread_mutex_unlock(&c->lock);
+    }
+
+    pthread_mutex_lock(&c->lock);
+    c->eof = 1;
+    if (r || last == -1) c->failed = 1;
+    pthread_cond_broadcast(&c->cond);
+    pthread_mutex_unlock(&c->lock);
+
+    for (int i = 0; i < started; ++i) pthread_join(workers[i], 0);
+    if (writing) pthread_join(writer, 0);
+
+    pthread_cond_destroy(&c->cond);
+    pthread_mutex_destroy(&c->lock);
+    return c->failed;
+}
+
+//encrypts ursparse stream read from fd_in, or decrypts it
+int do_crypt(int fd_in, int fd_out, int encrypt, const struct options* opts)
+{
+    struct crypt c;
+    memset(&c, 0, sizeof(c));
+    c.encrypt = encrypt;
+    c.fd_out = fd_out;
+    if (crypt_header(&c, encrypt ? fd_out : fd_in, opts)) return 1;
+
+    //enough records in flight to keep all workers busy while one is written
+    c.count = 2 * opts->threads + 2;
+    c.slots = calloc(c.count, sizeof(*c.slots));
+    int r = !c.slots;
+    for (size_t i = 0; i < c.count && !r; ++i) {
+        c.slots[i].in = malloc(CRYPT_RECORD_SZ + CRYPT_TAG_SZ);
+        unsigned char* out = malloc(CRYPT_HEAD_SZ + CRYPT_RECORD_SZ + CRYPT_TAG_SZ);
+        if (out) c.slots[i].out = out + CRYPT_HEAD_SZ;
+        r = !c.slots[i].in || !out;
+    }
+    if (r) fprintf(stderr, "ERROR: could not allocate memory for encryption\n");
+
+    if (!r) r = crypt_run(&c, fd_in, opts->threads);
+
+    for (size_t i = 0; c.slots && i < c.count; ++i) {
+        free(c.slots[i].in);
+        if (c.slots[i].out) free(c.slots[i].out - CRYPT_HEAD_SZ);
+    }
+    free(c.slots);
+    OPENSSL_cleanse(c.key, sizeof(c.key));
+    return r ? 1 : 0;
+}
+
+struct crypt_stage {
+    int fd_in;
+    int fd_out;
+    const struct options* opts;
+    int r;
+};
+
+void* crypt_encoder(void* arg)
+{
+    struct crypt_stage* e = arg;
+    e->r = do_sparse(e->fd_in, e->fd_out, e->opts);
+    close(e->fd_out);
+    return 0;
+}
+
+void* crypt_decrypter(void* arg)
+{
+    struct crypt_stage* d = arg;
+    d->r = do_crypt(d->fd_in, d->fd_out, 0, d->opts);
+    close(d->fd_out);
+    return 0;
+}
+
+//encodes sparse input file into encrypted stream
+int do_sparse_encrypted(int fd_in, int fd_out, const struct options* opts)
+{
+    int pipe_fd[2];
+    if (-1 == pipe(pipe_fd)) {
+        perror("ERROR: could not create pipe");
+        return 1;
+    }
+    fcntl(pipe_fd[0], F_SETPIPE_SZ, CRYPT_RECORD_SZ);
+
+    //encoder fails on broken pipe when encryption stops early
+    signal(SIGPIPE, SIG_IGN);
+
+    struct crypt_stage e = { fd_in, pipe_fd[1], opts, 0 };
+    pthread_t encoder;
+    if (pthread_create(&encoder, 0, crypt_encoder, &e)) {
+        fprintf(stderr, "ERROR: could not start encoder thread\n");
+        close(pipe_fd[0]);
+        close(pipe_fd[1]);
+        return 1;
+    }
+
+    int r = do_crypt(pipe_fd[0], fd_out, 1, opts);
+    close(pipe_fd[0]);
+    pthread_join(encoder, 0);
+    return r || e.r ? 1 : 0;
+}
+
+//encodes sparse input file, encrypted when there is a key
+int do_sparse_stream(int fd_in, int fd_out, const struct options* opts)
+{
+    return opts->key ? do_sparse_encrypted(fd_in, fd_out, opts) : do_sparse(fd_in, fd_out, opts);
+}
+
+//decrypts encrypted stream and decodes it
+//
+//decoder only gets records that were authenticated, a stream failing
+//authentication or cut short fails even when what was decoded so far
+//looks complete
+int do_ursparse_decrypted(int fd_in, const int* fd_out, int out_count, const struct options* opts)
+{
+    int pipe_fd[2];
+    if (-1 == pipe(pipe_fd)) {
+        perror("ERROR: could not create pipe");
+        return 1;
+    }
+    fcntl(pipe_fd[0], F_SETPIPE_SZ, CRYPT_RECORD_SZ);
+
+    //decryption fails on broken pipe when decoder stops early
+    signal(SIGPIPE, SIG_IGN);
+
+    struct crypt_stage d = { fd_in, pipe_fd[1], opts, 0 };
+    pthread_t decrypter;
+    if (pthread_create(&decrypter, 0, crypt_decrypter, &d)) {
+        fprintf(stderr, "ERROR: could not start decryption thread\n");
+        close(pipe_fd[0]);
+        close(pipe_fd[1]);
+        return 1;
+    }
+
+    int r = do_ursparse(pipe_fd[0], fd_out, out_count, opts);
+    close(pipe_fd[0]);
+    pthread_join(decrypter, 0);
+    return r ? r : d.r;
+}
+
+//
+//fan-out of encoded stream to more outputs
+//
+//encoder writes into a pipe, its content is read once in chunks queued to
+//a writer thread per output; an output more than queue_sz bytes behind
+//stops reading of the pipe until it catches up, so faster outputs run
+//ahead of it by at most that much, failed outputs are dropped
+//
+#define CHUNK_SZ (1 << 20)
+
+struct chunk {
+    int refs;   //outputs still to write it
+    size_t size;
+    char data[];
+};
+
+struct sink;
+
+struct sink_out {
+    const char* path;
+    int fd;
+    struct chunk** ring; //queued chunks
+    size_t ring_sz;
+    size_t head;         //next chunk to write
+    size_t count;        //of chunks queued
+    size_t queued;       //bytes queued
+    off_t written;
+    double stalled;      //seconds reading of stream waited for this output
+    int failed;
+    pthread_t thread;
+    struct sink* sink;
+};
+
+struct sink {
+    struct sink_out* outs;
+    int count;
+    size_t limit;        //bytes queued per output
+    int eof;
+    pthread_mutex_t lock;
+    pthread_cond_t ready; //chunk queued or end of stream
+    pthread_cond_t space; //chunk written
+};
+
+//drops chunk at head of output queue, lock held
+void sink_pop(struct sink_out* out)
+{
+    struct chunk* c = out->ring[out->head];
+    out->head = (out->head + 1) % out->ring_sz;
+    out->count--;
+    out->queued -= c->size;
+    if (!--c->refs) free(c);
+}
+
+void* sink_writer(void* arg)
+{
+    struct sink_out* out = arg;
+    struct sink* s = out->sink;
+
+    pthread_mutex_lock(&s->lock);
+    while (1) {
+        while (!out->count && !s->eof) pthread_cond_wait(&s->ready, &s->lock);
+        if (!out->count) break;
+
+        struct chunk* c = out->ring[out->head];
+        pthread_mutex_unlock(&s->lock);
+
+        int r = write_all(out->fd, c->data, c->size);
+        if (r) fprintf(stderr, "ERROR: could not write to %s: %s, dropping it\n", out->path, strerror(errno));
+
+        pthread_mutex_lock(&s->lock);
+        if (!r) out->written += c->size;
+        sink_pop(out);
+
+        if (r) {
+            out->failed = 1;
+            while (out->count) sink_pop(out);
+        }
+
+        pthread_cond_broadcast(&s->space);
+        if (r) break;
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    return 0;
+}
+
+//queues stream read from fd to all outputs
+//
+//returns number of outputs still writing, -1 on error
+int sink_run(struct sink* s, int fd)
+{
+    int live = s->count;
+
+    while (live) {
+        struct chunk* c = malloc(sizeof(*c) + CHUNK_SZ);
+        if (!c) {
+            fprintf(stderr, "ERROR: could not allocate memory: %d bytes\n", CHUNK_SZ);
+            return -1;
+        }
+
+        ssize_t r = sink_read(fd, c->data, CHUNK_SZ);
+        if (r <= 0) {
+            if (r) perror("ERROR: could not read encoded stream");
+            free(c);
+            return r ? -1 : live;
+        }
+        c->size = r;
+
+        pthread_mutex_lock(&s->lock);
+        live = 0;
+        for (int i = 0; i < s->count; ++i) {
+            struct sink_out* out = &s->outs[i];
+
+            struct timespec t0, t1;
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            while (!out->failed && (out->queued >= s->limit || out->count == out->ring_sz))
+                pthread_cond_wait(&s->space, &s->lock);
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            out->stalled += (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+            if (!out->failed) live++;
+        }
+
+        c->refs = live;
+        for (int i = 0; i < s->count; ++i) {
+            struct sink_out* out = &s->outs[i];
+            if (out->failed) continue;
+            out->ring[(out->head + out->count) % out->ring_sz] = c;
+            out->count++;
+            out->queued += c->size;
+        }
+        if (!live) free(c);
+
+        pthread_cond_broadcast(&s->ready);
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    return live;
+}
+
+struct sink_encoder {
+    int fd_in;
+    int fd_out;
+    const struct options* opts;
+    int r;
+};
+
+void* sink_encoder(void* arg)
+{
+    struct sink_encoder* e = arg;
+    e->r = do_sparse_stream(e->fd_in, e->fd_out, e->opts);
+    close(e->fd_out);
+    return 0;
+}
+
+//encodes sparse input file once into all outputs
+//
+//fds, paths, count => outputs, paths are used in messages
+int do_sparse_fanout(int fd_in, const int* fds, const char** paths, int count, const struct options* opts)
+{
+    struct sink s;
+    memset(&s, 0, sizeof(s));
+    s.count = count;
+    s.limit = opts->queue_sz;
+    pthread_mutex_init(&s.lock, 0);
+    pthread_cond_init(&s.ready, 0);
+    pthread_cond_init(&s.space, 0);
+
+    s.outs = calloc(count, sizeof(*s.outs));
+    if (!s.outs) {
+        fprintf(stderr, "ERROR: could not allocate memory for outputs\n");
+        return 1;
+    }
+
+    int pipe_fd[2];
+    if (-1 == pipe(pipe_fd)) {
+        perror("ERROR: could not create pipe");
+        free(s.outs);
+        return 1;
+    }
+    fcntl(pipe_fd[0], F_SETPIPE_SZ, CHUNK_SZ);
+
+    //a receiver going away fails its writes instead of killing all others
+    signal(SIGPIPE, SIG_IGN);
+
+    int ret = 0;
+    int started = 0;
+    for (; started < count; ++started) {
+        struct sink_out* out = &s.outs[started];
+        out->path = paths[started];
+        out->fd = fds[started];
+        out->sink = &s;
+        out->ring_sz = s.limit / CHUNK_SZ + 1;
+        out->ring = calloc(out->ring_sz, sizeof(*out->ring));
+        if (!out->ring || pthread_create(&out->thread, 0, sink_writer, out)) {
+            fprintf(stderr, "ERROR: could not start output thread\n");
+            free(out->ring);
+            ret = 1;
+            break;
+        }
+    }
+
+    struct sink_encoder e = { fd_in, pipe_fd[1], opts, 0 };
+    pthread_t encoder;
+    if (!ret && pthread_create(&encoder, 0, sink_encoder, &e)) {
+        fprintf(stderr, "ERROR: could not start encoder thread\n");
+        close(pipe_fd[1]);
+        ret = 1;
+    }
+
+    if (!ret) {
+        int live = sink_run(&s, pipe_fd[0]);
+        //encoder fails on broken pipe when nothing is left to write to
+        close(pipe_fd[0]);
+        pthread_join(encoder, 0);
+        if (live != count || e.r) ret = 1;
+    } else {
+        close(pipe_fd[0]);
+    }
+
+    pthread_mutex_lock(&s.lock);
+    s.eof = 1;
+    pthread_cond_broadcast(&s.ready);
+    pthread_mutex_unlock(&s.lock);
+
+    for (int i = 0; i < started; ++i) {
+        struct sink_out* out = &s.outs[i];
+        pthread_join(out->thread, 0);
+        if (out->failed) ret = 1;
+        fprintf(stderr, "INFO: output %s %ld bytes%s, stream waited %.3f s for it\n",
+            out->path, out->written, out->failed ? " failed" : "", out->stalled);
+        free(out->ring);
+    }
+
+    pthread_cond_destroy(&s.space);
+    pthread_cond_destroy(&s.ready);
+    pthread_mutex_destroy(&s.lock);
+    free(s.outs);
+    return ret;
+}
+
+//encodes sparse input file into output files opened by path
+int do_sparse_files(const char** paths, int count, const struct options* opts)
+{
+    int fds[count];
+    int ret = 0;
+    int opened = 0;
+    for (; opened < count; ++opened) {
+        fds[opened] = open_output(paths[opened], O_WRONLY | O_CREAT | O_TRUNC);
+        if (fds[opened] == -1) {
+            ret = 2;
+            break;
+        }
+    }
+
+    if (!ret && count == 1) ret = do_sparse_stream(0, fds[0], opts);
+    if (!ret && count > 1) ret = do_sparse_fanout(0, fds, paths, count, opts);
+
+    for (int i = 0; i < opened; ++i) close(fds[i]);
+    return ret;
+}
+
+//decodes ursparse input into output files opened by path
+int do_ursparse_files(const char** paths, int count, const struct options* opts)
+{
+    int fds[count];
+    int flags = O_WRONLY | O_CREAT;
+    if (!opts->range_end) flags |= O_TRUNC;
+
+    int ret = 0;
+    int opened = 0;
+    for (; opened < count; ++opened) {
+        fds[opened] = open_output(paths[opened], flags);
+        if (fds[opened] == -1) {
+            ret = 2;
+            break;
+        }
+    }
+
+    if (!ret) ret = opts->key ? do_ursparse_decrypted(0, fds, count, opts) : do_ursparse(0, fds, count, opts);
+
+    for (int i = 0; i < opened; ++i) {
+        if (-1 == close(fds[i]) && !ret) {
+            fprintf(stderr, "ERROR: could not close %s: %s\n", paths[i], strerror(errno));
+            ret = 2;
+        }
+    }
+
+    return ret;
+}
+
+//
+//encoder and decoder driven by the caller
+//
+//the decoder is pushed stream bytes as they arrive and the encoder is
+//pulled stream bytes as there is room for them, instead of both owning
+//a blocking read or write loop, so one event loop can drive thousands
+//of transfers from few threads; only file I/O blocks
+//
+
+struct ursparse_decoder {
+    struct ursparse_output out;
+    struct ursparse_state_data data;
+    struct tree_hash hash;
+};
+
+int ursparse_decoder_init(struct ursparse_decoder* d, int fd_out, const struct options* opts)
+{
+    memset(d, 0, sizeof(*d));
+    d->out.fd = fd_out;
+    d->out.fd_src = -1;
+    d->out.seekable = -1 != lseek(fd_out, 0, SEEK_CUR);
+    d->out.throttle = opts->throttle;
+    d->out.durability = opts->durability;
+    d->out.sync_size = opts->sync_size;
+    if (output_combine_init(&d->out, COMBINE_CONN_SZ)) return -1;
+
+    if (opts->verify) {
+        if (tree_hash_init(&d->hash, 1)) return -1;
+        d->out.hash = &d->hash;
+    }
+
+    d->data.out = &d->out;
+    d->data.out_count = 1;
+    d->data.chunks.path = opts->chunks;
+    d->data.chunks.limit = opts->store_size;
+    return 0;
+}
+
+//decodes next sz bytes of stream
+//returns negative number on error
+int ursparse_decoder_feed(struct ursparse_decoder* d, const char* buff, size_t sz)
+{
+    for (size_t cursor = 0; cursor < sz; ) {
+        size_t out_sz = 0;
+        if (parse_ursparse(buff + cursor, sz - cursor, &out_sz, &d->data) < 0) return -1;
+        cursor += out_sz;
+    }
+
+    return 0;
+}
+
+//writes combined meat once no more of the stream is at hand
+int ursparse_decoder_idle(struct ursparse_decoder* d)
+{
+    return output_flush(&d->out);
+}
+
+//checks stream ended where it could
+//returns non zero otherwise
+int ursparse_decoder_finish(struct ursparse_decoder* d)
+{
+    if (d->data.state != PARSE_START && d->data.state != PARSE_TYPE) {
+        fprintf(stderr, "ERROR: stream ends in the middle of a segment\n");
+        return -1;
+    }
+
+    if (output_flush(&d->out) || output_sync(&d->out) || output_syncfs(&d->out, 1)) return -1;
+
+    if (d->out.hash && !d->out.verified) {
+        fprintf(stderr, "ERROR: no hash to verify in stream\n");
+        return -1;
+    }
+
+    if (d->data.chunks.opened) chunk_store_report(&d->data.chunks);
+    if (chunk_store_missed(&d->data.chunks)) return -1;
+
+    return 0;
+}
+
+void ursparse_decoder_free(struct ursparse_decoder* d)
+{
+    if (d->out.hash) tree_hash_free(d->out.hash);
+    if (d->out.fd_src != -1) close(d->out.fd_src);
+    if (d->out.zeros) munmap(d->out.zeros, ZEROS_SZ);
+    output_combine_free(&d->out);
+    free_ursparse_state(&d->data);
+}
+
+struct ursparse_encoder {
+    int fd_in;
+    const struct options* opts;
+    struct extent_list map; //of input file, mapped up front
+    size_t next;            //extent to encode next
+    off_t offset;           //data being pulled
+    off_t left;
+    char line[128];         //segment line being pulled
+    size_t line_len;
+    size_t line_pos;
+    off_t size;             //of input file
+    int done;               //trailer queued
+    struct tree_hash hash;
+    int hashing;
+    off_t hashed;           //end of data hashed
+};
+
+int ursparse_encoder_init(struct ursparse_encoder* e, int fd_in, const struct options* opts)
+{
+    memset(e, 0, sizeof(*e));
+    e->fd_in = fd_in;
+    e->opts = opts;
+
+    struct stat st;
+    if (-1 == fstat(fd_in, &st)) {
+        perror("ERROR: could not stat input file");
+        return -1;
+    }
+    e->size = st.st_size;
+
+    if (opts->verify) {
+        if (tree_hash_init(&e->hash, 1)) return -1;
+        e->hashing = 1;
+    }
+
+    return walk_extents(fd_in, EXTENT_UNWRITTEN, extent_list_add, &e->map);
+}
+
+//pulls up to sz next bytes of stream, back-references are not used
+//
+//returns number of bytes, 0 at end of stream, -1 on error
+ssize_t ursparse_encoder_read(struct ursparse_encoder* e, char* buff, size_t sz)
+{
+    size_t n = 0;
+
+    while (n < sz) {
+        if (e->line_pos < e->line_len) {
+            size_t k = e->line_len - e->line_pos < sz - n ? e->line_len - e->line_pos : sz - n;
+            memcpy(buff + n, e->line + e->line_pos, k);
+            e->line_pos += k;
+            n += k;
+            continue;
+        }
+
+        if (e->left) {
+            size_t k = e->left < sz - n ? e->left : sz - n;
+            ssize_t r = pread(e->fd_in, buff + n, k, e->offset);
+            if (r == -1 && errno == EINTR) continue;
+            if (r <= 0) {
+                if (r) perror("ERROR: could not read input file");
+                else fprintf(stderr, "ERROR: input file shrank while encoding\n");
+                return -1;
+            }
+
+            if (e->hashing) tree_hash_update(&e->hash, buff + n, r);
+            e->offset += r;
+            e->left -= r;
+            n += r;
+            continue;
+        }
+
+        e->line_pos = 0;
+        e->line_len = 0;
+
+        if (e->next < e->map.count) {
+            const struct extent* x = &e->map.extents[e->next++];
+
+            if (x->flags & EXTENT_UNWRITTEN) {
+                //reads as zeros, hashed as a hole
+                e->line_len = e->opts->prealloc ? snprintf(e->line, sizeof(e->line), "u %ld %ld\n", x->offset, x->size) : 0;
+                continue;
+            }
+
+            if (e->hashing) tree_hash_zeros(&e->hash, x->offset - e->hashed);
+            e->hashed = x->offset + x->size;
+
+            e->line_len = snprintf(e->line, sizeof(e->line), "%ld %ld\n", x->offset, x->size);
+            e->offset = x->offset;
+            e->left = x->size;
+            continue;
+        }
+
+        if (e->done) break;
+        e->done = 1;
+
+        if (!e->hashing) {
+            e->line_len = snprintf(e->line, sizeof(e->line), "h %ld 0\n", e->size);
+            continue;
+        }
+
+        unsigned char digest[HASH_SZ];
+        char hex[2 * HASH_SZ + 1];
+        tree_hash_zeros(&e->hash, e->size - e->hashed);
+        tree_hash_final(&e->hash, digest);
+        hash_hex(digest, hex);
+        e->line_len = snprintf(e->line, sizeof(e->line), "h %ld %d\n%s", e->size, 2 * HASH_SZ, hex);
+    }
+
+    return n;
+}
+
+void ursparse_encoder_free(struct ursparse_encoder* e)
+{
+    if (e->hashing) tree_hash_free(&e->hash);
+    free(e->map.extents);
+}
+
+//
+//daemon receiving ursparse streams
+//
+//each connection carries destination path relative to root directory
+//ending with newline, then the ursparse stream; when the client shuts
+//down its side the daemon answers "OK\n" or "ERROR\n" and closes it,
+//naming chunks it misses before "ERROR\n";
+//path starting with < fetches the file instead, its stream is sent back,
+//when fetching is allowed
+//
+//connections are driven by worker threads all waiting on one epoll set,
+//sockets are armed one shot so a connection is served by one worker at
+//a time, which moves what the socket has or takes between it and the
+//decoder or encoder of the connection, doing file I/O meanwhile
+//
+
+//opens unix socket for path with a slash or without colon, TCP socket for
+//[host]:port otherwise, listening on it or connected to it
+//
+//returns file descriptor, -1 on error
+int open_socket(const char* addr, int listening)
+{
+    const char* colon = strrchr(addr, ':');
+    int fd = -1;
+
+    if (strchr(addr, '/') || !colon) {
+        struct sockaddr_un un;
+        memset(&un, 0, sizeof(un));
+        un.sun_family = AF_UNIX;
+        if (strlen(addr) >= sizeof(un.sun_path)) {
+            fprintf(stderr, "ERROR: socket path too long: %s\n", addr);
+            return -1;
+        }
+        strcpy(un.sun_path, addr);
+
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd != -1 && listening) unlink(addr);
+        if (fd != -1 && (listening ? bind(fd, (struct sockaddr*)&un, sizeof(un)) || listen(fd, SOMAXCONN)
+                                   : connect(fd, (struct sockaddr*)&un, sizeof(un)))) {
+            close(fd);
+            fd = -1;
+        }
+    } else {
+        char host[256];
+        snprintf(host, sizeof(host), "%.*s", (int)(colon - addr), addr);
+
+        struct addrinfo hints, *ai = 0;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_socktype = SOCK_STREAM;
+        //listening without host stays on loopback, clients are not authenticated;
+        //connecting without host tries loopback addresses in turn
+        if (!*host && listening) strcpy(host, "127.0.0.1");
+
+        int r = getaddrinfo(*host ? host : 0, colon + 1, &hints, &ai);
+        if (r) {
+            fprintf(stderr, "ERROR: could not resolve %s: %s\n", addr, gai_strerror(r));
+            return -1;
+        }
+
+        for (struct addrinfo* a = ai; a && fd == -1; a = a->ai_next) {
+            fd = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol);
+            if (fd == -1) continue;
+
+            int one = 1;
+            if (listening) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            if (listening ? bind(fd, a->ai_addr, a->ai_addrlen) || listen(fd, SOMAXCONN)
+                          : connect(fd, a->ai_addr, a->ai_addrlen)) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(ai);
+    }
+
+    if (fd == -1) fprintf(stderr, "ERROR: could not %s %s: %s\n", listening ? "listen on" : "connect to", addr, strerror(errno));
+    return fd;
+}
+
+struct connection {
+    int fd;
+    int listening;     //accepts connections instead
+    char path[PATH_MAX];
+    size_t path_len;   //while reading destination path
+    int header;        //destination path is being read
+    int fetch;         //sends file instead of receiving it
+    int fd_file;       //destination, or source when fetching
+    struct ursparse_decoder dec;
+    struct ursparse_encoder* enc; //when fetching
+    char* buff;        //of encoded stream not sent yet
+    size_t buff_len;
+    size_t buff_pos;
+    off_t transferred;
+    struct connection* next; //waiting for syncfs
+};
+
+struct daemon {
+    int epoll;
+    int fd_root;       //destination paths are relative to it
+    const struct options* opts;
+    struct options dec_opts; //of decoders, syncfs is done by the daemon
+    pthread_mutex_t sync_lock;
+    struct connection* sync_queue; //received streams to answer after syncfs
+    int syncing;       //a worker is syncing, it answers the queue too
+};
+
+#define DAEMON_BUFF_SZ (256 << 10)
+#define DAEMON_READS 16 //per wakeup, so one busy connection does not starve others
+#define FETCH_BUFF_SZ (64 << 10)
+
+//opens file of connection, destination to write or source to fetch
+//opens path under directory dir, refusing to leave it through .. or
+//symlinks; openat2 resolves it in one go, older kernels get it walked
+//component by component without following symlinks
+//
+//returns file descriptor, -1 on error with errno set
+int open_beneath(int dir, const char* path, int flags)
+{
+    struct open_how how;
+    memset(&how, 0, sizeof(how));
+    how.flags = flags;
+    how.mode = flags & O_CREAT ? 0666 : 0;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS | RESOLVE_NO_MAGICLINKS;
+
+    int fd = syscall(SYS_openat2, dir, path, &how, sizeof(how));
+    if (fd != -1 || errno != ENOSYS) return fd;
+
+    char name[PATH_MAX];
+    int at = dir;
+    while (1) {
+        while (*path == '/') path++;
+        const char* slash = strchr(path, '/');
+        size_t len = slash ? (size_t)(slash - path) : strlen(path);
+        if (len >= sizeof(name) || (len == 2 && !strncmp(path, "..", 2))) {
+            if (at != dir) close(at);
+            errno = EPERM;
+            return -1;
+        }
+        memcpy(name, path, len);
+        name[len] = 0;
+        path += len;
+        while (*path == '/') path++;
+
+        if (!*path) {
+            fd = openat(at, name, flags | O_NOFOLLOW, 0666);
+        } else {
+            fd = openat(at, len ? name : ".", O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        }
+
+        int err = errno;
+        if (at != dir) close(at);
+        errno = err;
+        if (fd == -1 || !*path) return fd;
+        at = fd;
+    }
+}
+
+int daemon_open(struct daemon* d, struct connection* c)
+{
+    c->header = 0;
+    c->path[c->path_len] = 0;
+
+    int fetch = c->fetch = c->path[0] == '<';
+    const char* path = c->path + fetch;
+
+    if (fetch && !d->opts->allow_fetch) {
+        fprintf(stderr, "ERROR: fetching %s refused, daemon runs without --allow-fetch\n", path);
+        return -1;
+    }
+
+    //stay under root
+    size_t len = strlen(path);
+    if (!len || path[0] == '/' || !strcmp(path, "..") || !strncmp(path, "../", 3) ||
+        strstr(path, "/../") || (len >= 3 && !strcmp(path + len - 3, "/.."))) {
+        fprintf(stderr, "ERROR: path outside of root: %s\n", path);
+        return -1;
+    }
+
+    int flags = fetch ? O_RDONLY | O_CLOEXEC : O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    c->fd_file = open_beneath(d->fd_root, path, flags);
+    if (c->fd_file == -1) {
+        fprintf(stderr, "ERROR: could not open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    if (!fetch) return ursparse_decoder_init(&c->dec, c->fd_file, &d->dec_opts);
+
+    c->enc = malloc(sizeof(*c->enc));
+    c->buff = malloc(FETCH_BUFF_SZ);
+    if (!c->enc || !c->buff) {
+        fprintf(stderr, "ERROR: could not allocate memory for %s\n", path);
+        return -1;
+    }
+
+    return ursparse_encoder_init(c->enc, c->fd_file, d->opts);
+}
+
+//feeds received bytes to connection
+int daemon_feed(struct daemon* d, struct connection* c, const char* buff, size_t sz)
+{
+    c->transferred += sz;
+
+    while (c->header && sz) {
+        if (*buff == '\n') {
+            if (daemon_open(d, c)) return -1;
+        } else if (c->path_len + 1 < sizeof(c->path)) {
+            c->path[c->path_len++] = *buff;
+        } else {
+            fprintf(stderr, "ERROR: path too long\n");
+            return -1;
+        }
+        buff++;
+        sz--;
+    }
+
+    //nothing follows fetch request
+    if (c->enc) return 0;
+
+    return ursparse_decoder_feed(&c->dec, buff, sz);
+}
+
+//sends fetched stream as socket takes it
+//
+//returns
+//  0 socket is full
+//  1 stream sent
+//  negative number on error
+int daemon_send(struct connection* c)
+{
+    for (int i = 0; i < DAEMON_READS; ++i) {
+        if (c->buff_pos == c->buff_len) {
+            ssize_t n = ursparse_encoder_read(c->enc, c->buff, FETCH_BUFF_SZ);
+            if (n <= 0) return n ? -1 : 1;
+            c->buff_len = n;
+            c->buff_pos = 0;
+        }
+
+        ssize_t r = write(c->fd, c->buff + c->buff_pos, c->buff_len - c->buff_pos);
+        if (r == -1 && errno == EINTR) continue;
+        if (r == -1 && errno == EAGAIN) return 0;
+        if (r == -1) {
+            perror("ERROR: could not write connection");
+            return -1;
+        }
+
+        c->buff_pos += r;
+        c->transferred += r;
+    }
+
+    return 0;
+}
+
+//answers client and releases connection
+//
+//received streams are answered "OK\n" or "ERROR\n", the latter after a
+//"MISSING <hash>\n" line for each chunk reference not found, fetched streams
+//are complete only when they end with trailer
+void daemon_answer(struct connection* c, int failed)
+{
+    if (c->fd_file != -1 && -1 == close(c->fd_file) && !c->fetch) {
+        fprintf(stderr, "ERROR: could not close %s: %s\n", c->path, strerror(errno));
+        failed = 1;
+    }
+
+    if (!c->fetch) {
+        //chunks the sender has to ship again
+        const struct digests* missed = &c->dec.data.chunks.missed;
+        for (size_t i = 0; failed && i < missed->count; ++i) {
+            char line[sizeof("MISSING \n") + 2 * HASH_SZ] = "MISSING ";
+            hash_hex(missed->v + i * HASH_SZ, line + 8);
+            line[8 + 2 * HASH_SZ] = '\n';
+            if (write(c->fd, line, 9 + 2 * HASH_SZ) != 9 + 2 * HASH_SZ) break;
+        }
+
+        const char* status = failed ? "ERROR\n" : "OK\n";
+        if (write(c->fd, status, strlen(status))) {}
+    }
+
+    fprintf(stderr, "INFO: %s %s %ld bytes%s\n", c->fetch ? "sent" : "received", c->header ? "-" : c->path,
+        c->transferred, failed ? " failed" : "");
+
+    if (c->enc) ursparse_encoder_free(c->enc);
+    else ursparse_decoder_free(&c->dec);
+    free(c->enc);
+    free(c->buff);
+    close(c->fd);
+    free(c);
+}
+
+//answers received stream once its file system is synced
+//
+//streams ending while a worker syncs queue up, the worker then syncs
+//file systems of all of them at once and answers them, so concurrent
+//streams share syncs instead of each waiting for its own
+void daemon_sync(struct daemon* d, struct connection* c)
+{
+    pthread_mutex_lock(&d->sync_lock);
+    c->next = d->sync_queue;
+    d->sync_queue = c;
+    if (d->syncing) {
+        pthread_mutex_unlock(&d->sync_lock);
+        return;
+    }
+    d->syncing = 1;
+
+    while (d->sync_queue) {
+        struct connection* batch = d->sync_queue;
+        d->sync_queue = 0;
+        pthread_mutex_unlock(&d->sync_lock);
+
+        //each file system once
+        int count = 0;
+        for (struct connection* x = batch; x; x = x->next) ++count;
+        dev_t devs[count];
+        int synced = 0, failed = 0;
+        for (struct connection* x = batch; x && !failed; x = x->next) {
+            struct stat st;
+            failed = fstat(x->fd_file, &st);
+            int seen = 0;
+            for (int j = 0; j < synced && !failed; ++j) seen |= devs[j] == st.st_dev;
+            if (failed || seen) continue;
+
+            failed = syncfs(x->fd_file);
+            if (failed) perror("ERROR: could not sync file system");
+            devs[synced++] = st.st_dev;
+        }
+        fprintf(stderr, "INFO: synced %d file systems for %d streams\n", synced, count);
+
+        while (batch) {
+            struct connection* next = batch->next;
+            daemon_answer(batch, failed);
+            batch = next;
+        }
+
+        pthread_mutex_lock(&d->sync_lock);
+    }
+
+    d->syncing = 0;
+    pthread_mutex_unlock(&d->sync_lock);
+}
+
+//ends connection, see daemon_answer
+void daemon_close(struct daemon* d, struct connection* c, int failed)
+{
+    if (!failed && c->header) {
+        fprintf(stderr, "ERROR: connection closed before path\n");
+        failed = 1;
+    }
+
+    if (!failed && !c->fetch && ursparse_decoder_finish(&c->dec)) failed = 1;
+
+    if (!failed && !c->fetch && d->opts->durability == DURABLE_SYNCFS) {
+        daemon_sync(d, c);
+        return;
+    }
+
+    daemon_answer(c, failed);
+}
+
+void daemon_accept(struct daemon* d, struct connection* l)
+{
+    while (1) {
+        int fd = accept4(l->fd, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno != EAGAIN && errno != EINTR) perror("ERROR: could not accept connection");
+            if (errno != EINTR) break;
+            continue;
+        }
+
+        struct connection* c = calloc(1, sizeof(*c));
+        if (!c) {
+            fprintf(stderr, "ERROR: could not allocate memory for connection\n");
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        c->header = 1;
+        c->fd_file = -1;
+        c->dec.out.fd_src = -1;
+
+        struct epoll_event ev = { EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, { .ptr = c } };
+        if (epoll_ctl(d->epoll, EPOLL_CTL_ADD, fd, &ev)) {
+            perror("ERROR: could not watch connection");
+            close(fd);
+            free(c);
+        }
+    }
+
+    struct epoll_event ev = { EPOLLIN | EPOLLONESHOT, { .ptr = l } };
+    epoll_ctl(d->epoll, EPOLL_CTL_MOD, l->fd, &ev);
+}
+
+void* daemon_worker(void* arg)
+{
+    struct daemon* d = arg;
+
+    char* buff = malloc(DAEMON_BUFF_SZ);
+    if (!buff) {
+        fprintf(stderr, "ERROR: could not allocate memory: %d bytes\n", DAEMON_BUFF_SZ);
+        return 0;
+    }
+
+    while (1) {
+        struct epoll_event ev;
+        int n = epoll_wait(d->epoll, &ev, 1, -1);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1) {
+            perror("ERROR: could not wait for connections");
+            break;
+        }
+
+        struct connection* c = ev.data.ptr;
+        if (c->listening) {
+            daemon_accept(d, c);
+            continue;
+        }
+
+        int done = 0;
+        int failed = 0;
+        for (int i = 0; i < DAEMON_READS && !done && !c->enc; ++i) {
+            ssize_t r = read(c->fd, buff, DAEMON_BUFF_SZ);
+            if (r == -1 && errno == EINTR) continue;
+            if (r == -1 && errno == EAGAIN) {
+                //stream may pause, do not hold its meat back
+                if (!c->header && ursparse_decoder_idle(&c->dec)) done = failed = 1;
+                break;
+            }
+
+            if (r == -1) perror("ERROR: could not read connection");
+            if (r <= 0) {
+                done = 1;
+                failed = r < 0;
+                break;
+            }
+
+            if (daemon_feed(d, c, buff, r)) done = failed = 1;
+        }
+
+        if (!done && c->enc) {
+            int r = daemon_send(c);
+            done = r != 0;
+            failed = r < 0;
+        }
+
+        if (done) {
+            epoll_ctl(d->epoll, EPOLL_CTL_DEL, c->fd, 0);
+            daemon_close(d, c, failed);
+            continue;
+        }
+
+        ev.events = (c->enc ? EPOLLOUT : EPOLLIN | EPOLLRDHUP) | EPOLLONESHOT;
+        if (epoll_ctl(d->epoll, EPOLL_CTL_MOD, c->fd, &ev)) {
+            perror("ERROR: could not watch connection");
+            epoll_ctl(d->epoll, EPOLL_CTL_DEL, c->fd, 0);
+            daemon_close(d, c, 1);
+        }
+    }
+
+    free(buff);
+    return 0;
+}
+
+//receives ursparse streams on sockets until killed
+//
+//addrs, count => sockets to listen on, see open_socket
+//root         => directory destination paths are relative to
+int do_daemon(const char** addrs, int count, const char* root, const struct options* opts)
+{
+    struct daemon d;
+    memset(&d, 0, sizeof(d));
+    d.opts = opts;
+    d.dec_opts = *opts;
+    if (opts->durability == DURABLE_SYNCFS) d.dec_opts.durability = DURABLE_NONE;
+    pthread_mutex_init(&d.sync_lock, 0);
+
+    d.fd_root = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (d.fd_root == -1) {
+        fprintf(stderr, "ERROR: could not open root directory %s: %s\n", root, strerror(errno));
+        return 1;
+    }
+
+    d.epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (d.epoll == -1) {
+        perror("ERROR: could not create epoll");
+        return 1;
+    }
+
+    //client going away fails the answer, not the daemon
+    signal(SIGPIPE, SIG_IGN);
+
+    for (int i = 0; i < count; ++i) {
+        struct connection* l = calloc(1, sizeof(*l));
+        if (!l) return 1;
+        l->listening = 1;
+        l->fd = open_socket(addrs[i], 1);
+        if (l->fd == -1) return 1;
+        fcntl(l->fd, F_SETFL, O_NONBLOCK);
+
+        struct epoll_event ev = { EPOLLIN | EPOLLONESHOT, { .ptr = l } };
+        if (epoll_ctl(d.epoll, EPOLL_CTL_ADD, l->fd, &ev)) {
+            perror("ERROR: could not watch socket");
+            return 1;
+        }
+        fprintf(stderr, "INFO: listening on %s\n", addrs[i]);
+    }
+
+    for (int i = 1; i < opts->threads; ++i) {
+        pthread_t id;
+        if (pthread_create(&id, 0, daemon_worker, &d)) {
+            fprintf(stderr, "ERROR: could not start worker thread\n");
+            return 1;
+        }
+        pthread_detach(id);
+    }
+
+    daemon_worker(&d);
+    return 1;
+}
+
+//decodes file src fetched from daemon at addr
+int do_ursparse_fetch(const char* addr, const char* src, int fd_out, const struct options* opts)
+{
+    int fd = open_socket(addr, 0);
+    if (fd == -1) return 1;
+
+    struct ursparse_decoder dec;
+    int r = ursparse_decoder_init(&dec, fd_out, opts);
+
+    if (!r && (0 > dprintf(fd, "<%s\n", src) || shutdown(fd, SHUT_WR))) {
+        perror("ERROR: could not send fetch request");
+        r = 1;
+    }
+
+    char* buff = malloc(opts->blk_sz);
+    while (!r) {
+        if (output_flush_idle(fd, &dec.out, 1)) {
+            r = 1;
+            break;
+        }
+
+        ssize_t n = buff ? read(fd, buff, opts->blk_sz) : -1;
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1) {
+            perror("ERROR: could not read from daemon");
+            r = 1;
+        }
+        if (n <= 0) break;
+
+        r = ursparse_decoder_feed(&dec, buff, n);
+    }
+
+    if (!r) r = ursparse_decoder_finish(&dec);
+
+    //daemon closes failed fetch without trailer
+    if (!r && !dec.out.ended) {
+        fprintf(stderr, "ERROR: daemon failed to send %s\n", src);
+        r = 1;
+    }
+
+    ursparse_decoder_free(&dec);
+    free(buff);
+    close(fd);
+    return r ? 1 : 0;
+}
+
+//sends stream of sparse input file to daemon at addr as dest
+//
+//missed => output, chunks the daemon did not find, the chunk index forgets them
+int do_sparse_attempt(const char* addr, const char* dest, const struct options* opts, struct chunker* chunks, int* missed)
+{
+    int fd = open_socket(addr, 0);
+    if (fd == -1) return 1;
+
+    int r = 0;
+    if (0 > dprintf(fd, "%s\n", dest)) {
+        perror("ERROR: could not send destination");
+        r = 1;
+    }
+
+    if (!r) r = do_sparse_with(0, fd, opts, chunks);
+
+    //end of stream, then wait for the answer
+    FILE* answer = 0;
+    if (!r && (shutdown(fd, SHUT_WR) || !(answer = fdopen(fd, "r")))) {
+        perror("ERROR: no answer from daemon");
+        r = 1;
+    }
+
+    char line[128] = { 0 };
+    int status = 0;
+    while (answer && fgets(line, sizeof(line), answer)) {
+        unsigned char digest[HASH_SZ];
+        int n = strncmp(line, "MISSING ", 8) || !chunks ? 0 : HASH_SZ;
+        for (int i = 0; i < n; ++i) {
+            unsigned int byte;
+            if (1 != sscanf(line + 8 + 2 * i, "%2x", &byte)) n = 0;
+            digest[i] = byte;
+        }
+        if (n) {
+            chunk_index_forget(chunks, digest);
+            ++*missed;
+        }
+        status = 1;
+    }
+
+    if (!r && !status) {
+        fprintf(stderr, "ERROR: no answer from daemon\n");
+        r = 1;
+    }
+    if (!r && strcmp(line, "OK\n")) {
+        if (!*missed) fprintf(stderr, "ERROR: daemon failed to write %s\n", dest);
+        r = 1;
+    }
+
+    if (answer) fclose(answer);
+    else close(fd);
+    return r;
+}
+
+//encodes sparse input file into daemon at addr as dest, see chunker for
+//chunks the daemon misses
+int do_sparse_send(const char* addr, const char* dest, const struct options* opts)
+{
+    struct chunker chunks;
+    if (opts->chunks && chunker_init(&chunks, opts->chunks)) {
+        chunker_free(&chunks);
+        return 1;
+    }
+
+    //daemon rejecting the stream fails writes with an error instead
+    signal(SIGPIPE, SIG_IGN);
+
+    int r = 0;
+    for (int attempt = 0; attempt <= CHUNK_RETRIES; ++attempt) {
+        int missed = 0;
+        if (opts->chunks) {
+            chunks.refs = attempt < CHUNK_RETRIES;
+            chunks.chunks = chunks.bytes = chunks.novel = chunks.novel_bytes = 0;
+            chunks.cutting = 0;
+        }
+        r = do_sparse_attempt(addr, dest, opts, opts->chunks ? &chunks : 0, &missed);
+        if (!missed) break;
+        fprintf(stderr, "INFO: daemon misses %d chunks of %s, sending it again\n", missed, dest);
+    }
+
+    if (opts->chunks) {
+        if (!r) r = chunker_commit(&chunks);
+        chunker_free(&chunks);
+    }
+    return r ? 1 : 0;
+}
+
+//
+//splitting of sparse file into independent ursparse shards
+//
+//shards cover contiguous ranges of the file with about the same amount of
+//data each, boundaries are computed from the extent map alone; every shard
+//is a complete stream of its range that decodes into the same output file
+//independently of the others, back-references stay within their shard
+//
+//boundaries and data of shards come from rank and select of the
+//allocation bitmap, which also gives progress of all shards as the data
+//share of the file they wrote
+//
+//shards sized by data hold a block of data at least, as boundaries are
+//rounded to blocks, and are at most SPLIT_MAX, all of them open at once
+//
+#define SPLIT_MAX 1024
+
+struct shard {
+    int fd_in;
+    int fd_out;
+    const struct options* opts;
+    const struct extent_list* map;
+    off_t start;
+    off_t end;
+    off_t size; //of file
+    off_t* done; //data bytes written by all shards
+    off_t data;  //of file
+    int r;
+};
+
+void* do_split_shard(void* arg)
+{
+    struct shard* s = arg;
+
+    struct sparse_ctx ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.fd_in = s->fd_in;
+    ctx.fd_out = s->fd_out;
+    ctx.opts = s->opts;
+
+    int r = 0;
+    for (size_t i = 0; i < s->map->count && !r; ++i) {
+        struct extent e = s->map->extents[i];
+        if (!extent_clip(&e, s->start, s->end)) continue;
+
+        r = do_sparse_extent(&e, &ctx);
+        if (r || (e.flags & EXTENT_UNWRITTEN)) continue;
+
+        //reports every percent of data crossed
+        off_t done = __atomic_add_fetch(s->done, e.size, __ATOMIC_RELAXED);
+        if ((done - e.size) * 100 / s->data != done * 100 / s->data)
+            fprintf(stderr, "INFO: split %ld%%\n", done * 100 / s->data);
+    }
+
+    if (!r) r = do_sparse_flush(&ctx);
+    if (!r) r = do_sparse_trailer(&ctx, s->size);
+
+    free(ctx.buff);
+    free(ctx.shared.ranges);
+    s->r = r;
+    return 0;
+}
+
+//writes input file as shards PREFIX.0 ... PREFIX.N-1
+//
+//count      => number of shards, or 0 to size them by data
+//shard_data => data bytes per shard when count is 0
+int do_split(int fd_in, int count, off_t shard_data, const struct options* opts)
+{
+    struct stat st;
+    if (-1 == fstat(fd_in, &st)) {
+        perror("ERROR: could not stat input file");
+        return 1;
+    }
+
+    unsigned keep = EXTENT_UNWRITTEN;
+    if (opts->refs) keep |= EXTENT_SHARED;
+
+    struct extent_list map;
+    memset(&map, 0, sizeof(map));
+    if (walk_extents(fd_in, keep, extent_list_add, &map)) {
+        free(map.extents);
+        return 1;
+    }
+
+    struct alloc_bitmap bitmap;
+    if (alloc_bitmap_init(&bitmap, st.st_size)) {
+        free(map.extents);
+        return 1;
+    }
+    for (size_t i = 0; i < map.count; ++i)
+        alloc_bitmap_add(&map.extents[i], &bitmap);
+    if (alloc_bitmap_index(&bitmap)) {
+        alloc_bitmap_free(&bitmap);
+        free(map.extents);
+        return 1;
+    }
+
+    off_t data = alloc_bitmap_rank_bytes(&bitmap, st.st_size);
+    if (!count) {
+        off_t n = (data + shard_data - 1) / shard_data;
+        if (n > data / (off_t)opts->blk_sz) n = data / opts->blk_sz;
+        if (n > SPLIT_MAX) {
+            fprintf(stderr, "INFO: %ld data bytes make %d split files of %ld data bytes, not %ld of %ld\n",
+                data, SPLIT_MAX, (data + SPLIT_MAX - 1) / SPLIT_MAX, n, shard_data);
+            n = SPLIT_MAX;
+        }
+        count = n > 1 ? n : 1;
+    }
+
+    struct shard* shards = calloc(count, sizeof(*shards));
+    if (!shards) {
+        fprintf(stderr, "ERROR: could not allocate memory for shards\n");
+        alloc_bitmap_free(&bitmap);
+        free(map.extents);
+        return 1;
+    }
+
+    //boundary of shard k is where k/count of data is behind it,
+    //rounded down to block size
+    for (int k = 1; k < count; ++k) {
+        off_t target = data / count * k + data % count * k / count;
+        off_t boundary = alloc_bitmap_select_bytes(&bitmap, target);
+
+        boundary -= boundary % opts->blk_sz;
+        if (boundary < shards[k-1].start) boundary = shards[k-1].start;
+
+        shards[k].start = boundary;
+        shards[k-1].end = boundary;
+    }
+    shards[count-1].end = st.st_size;
+
+    int r = 0;
+    off_t done = 0;
+    for (int k = 0; k < count; ++k) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s.%d", opts->prefix, k);
+
+        shards[k].fd_in = fd_in;
+        shards[k].opts = opts;
+        shards[k].map = &map;
+        shards[k].size = st.st_size;
+        shards[k].fd_out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (shards[k].fd_out == -1) {
+            fprintf(stderr, "ERROR: could not create %s: %s\n", path, strerror(errno));
+            r = 1;
+            break;
+        }
+
+        shards[k].done = &done;
+        shards[k].data = data;
+
+        off_t shard_bytes = alloc_bitmap_rank_bytes(&bitmap, shards[k].end) - alloc_bitmap_rank_bytes(&bitmap, shards[k].start);
+        fprintf(stderr, "INFO: shard %s %ld %ld, %ld data bytes\n", path, shards[k].start, shards[k].end - shards[k].start, shard_bytes);
+    }
+
+    //shards are written in parallel, threads at a time
+    for (int k = 0; k < count && !r; k += opts->threads) {
+        int batch = count - k < opts->threads ? count - k : opts->threads;
+        pthread_t ids[batch];
+        int spawned = 0;
+
+        for (; spawned < batch; ++spawned)
+            if (pthread_create(&ids[spawned], 0, do_split_shard, &shards[k + spawned])) break;
+        for (int i = spawned; i < batch; ++i)
+            do_split_shard(&shards[k + i]);
+        for (int i = 0; i < spawned; ++i)
+            pthread_join(ids[i], 0);
+
+        for (int i = 0; i < batch; ++i)
+            if (shards[k + i].r) r = 1;
+    }
+
+    for (int k = 0; k < count; ++k)
+        if (shards[k].fd_out > 0) close(shards[k].fd_out);
+    free(shards);
+    alloc_bitmap_free(&bitmap);
+    free(map.extents);
+    return r;
+}
+
+//
+//merging of ursparse streams
+//
+//each stream is indexed by parsing its segment lines and seeking over
+//the meat, its segments become pieces pointing at where their meat is
+//in the stream, back-references are resolved to the pieces they copy
+//
+//streams are overlaid in order, later pieces override earlier ones;
+//pieces of a stream are sorted and disjoint, so each overlay is a linear
+//merge of two sorted piece lists; surviving pieces are then copied
+//straight from the input streams
+//
+
+struct piece {
+    off_t offset;
+    off_t size;
+    off_t payload; //stream position of meat, -1 for unwritten pieces
+    int file;
+};
+
+struct piece_list {
+    struct piece* pieces;
+    size_t count;
+    size_t capacity;
+};
+
+int piece_list_add(struct piece_list* l, struct piece p)
+{
+    if (l->count == l->capacity) {
+        size_t capacity = l->capacity ? l->capacity * 2 : 1024;
+        struct piece* pieces = realloc(l->pieces, capacity * sizeof(*pieces));
+        if (!pieces) {
+            fprintf(stderr, "ERROR: could not allocate memory for segments\n");
+            return -1;
+        }
+        l->pieces = pieces;
+        l->capacity = capacity;
+    }
+
+    l->pieces[l->count++] = p;
+    return 0;
+}
+
+//drops first sz bytes of piece
+void piece_clip(struct piece* p, off_t sz)
+{
+    p->offset += sz;
+    p->size -= sz;
+    if (p->payload != -1) p->payload += sz;
+}
+
+struct merge_index {
+    struct piece_list pieces;
+    int file;
+    const char* name;
+    off_t size; //from trailer, -1 when stream has none
+};
+
+//resolves back-reference to pieces of the same stream it copies from
+int merge_index_ref(struct merge_index* m, const struct ursparse* segment)
+{
+    off_t source = segment->source;
+    off_t offset = segment->offset;
+    off_t size = segment->size;
+
+    //pieces so far are sorted by offset
+    size_t lo = 0, hi = m->pieces.count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (m->pieces.pieces[mid].offset + m->pieces.pieces[mid].size <= source)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    while (size > 0) {
+        if (lo >= m->pieces.count || m->pieces.pieces[lo].offset > source || m->pieces.pieces[lo].payload == -1) {
+            fprintf(stderr, "ERROR: %s: back-reference %ld %ld %ld to data not in stream\n",
+                m->name, segment->offset, segment->size, segment->source);
+            return -1;
+        }
+
+        struct piece p = m->pieces.pieces[lo];
+        piece_clip(&p, source - p.offset);
+        if (p.size > size) p.size = size;
+        p.offset = offset;
+
+        if (piece_list_add(&m->pieces, p)) return -1;
+
+        source += p.size;
+        offset += p.size;
+        size -= p.size;
+        ++lo;
+    }
+
+    return 0;
+}
+
+int merge_index_segment(const struct ursparse* segment, off_t pos, void* ctx)
+{
+    struct merge_index* m = ctx;
+
+    if (segment->type == 'h') {
+        m->size = segment->offset;
+        return 0;
+    }
+
+    if (segment->type == 'i') return 0;
+
+    if (m->pieces.count) {
+        const struct piece* last = &m->pieces.pieces[m->pieces.count - 1];
+        if (last->offset + last->size > segment->offset) {
+            fprintf(stderr, "ERROR: %s: segment %ld not in ascending order\n", m->name, segment->offset);
+            return -1;
+        }
+    }
+
+    if (segment->type == 'r') return merge_index_ref(m, segment);
+
+    if (segment->type == 'l' || segment->type == 'z') {
+        fprintf(stderr, "ERROR: %s: compressed segments can not be merged\n", m->name);
+        return -1;
+    }
+
+    if (segment->type == 'c' || segment->type == 'k') {
+        fprintf(stderr, "ERROR: %s: chunks can not be merged\n", m->name);
+        return -1;
+    }
+
+    struct piece p = { segment->offset, segment->size, segment->type == 'u' ? -1 : pos, m->file };
+    return piece_list_add(&m->pieces, p);
+}
+
+//indexes stream, seeking over meat instead of reading it
+int merge_index_stream(struct merge_index* m, int fd, size_t blk_sz)
+{
+    char* read_buff = malloc(blk_sz);
+    if (!read_buff) {
+        fprintf(stderr, "ERROR: could not allocate memory: %ld bytes\n", blk_sz);
+        return -1;
+    }
+
+    struct ursparse_state_data data;
+    memset(&data, 0, sizeof(data));
+    data.on_segment = merge_index_segment;
+    data.ctx = m;
+
+    off_t pos = 0;
+    int ret = 0;
+    while (!ret) {
+        ssize_t nbytes = pread(fd, read_buff, blk_sz, pos);
+
+        if (nbytes == -1) {
+            fprintf(stderr, "ERROR: could not read %s: %s\n", m->name, strerror(errno));
+            ret = -1;
+            break;
+        }
+
+        if (!nbytes) break; //EOF reached
+
+        size_t cursor = 0;
+        while (cursor < nbytes) {
+            size_t out_sz = 0;
+            data.stream_pos = pos + cursor;
+            int r = parse_ursparse(read_buff + cursor, nbytes - cursor, &out_sz, &data);
+
+            if (r < 0) {
+                fprintf(stderr, "ERROR: could not parse %s\n", m->name);
+                ret = -1;
+                break;
+            }
+
+            cursor += out_sz;
+
+            if (data.state == PARSE_MEAT && data.ursparse.size > nbytes - cursor) {
+                //seek over rest of meat
+                cursor += data.ursparse.size;
+                reset_ursparse_state(&data);
+                break;
+            }
+        }
+
+        pos += cursor;
+    }
+
+    if (!ret && data.state != PARSE_START && data.state != PARSE_TYPE) {
+        fprintf(stderr, "ERROR: %s ends in the middle of a segment\n", m->name);
+        ret = -1;
+    }
+
+    if (!ret) {
+        struct stat st;
+        if (!fstat(fd, &st) && pos > st.st_size) {
+            fprintf(stderr, "ERROR: %s ends in the middle of a segment\n", m->name);
+            ret = -1;
+        }
+    }
+
+    free(read_buff);
+    return ret;
+}
+
+//overlays sorted pieces over sorted base, both disjoint
+int merge_overlay(const struct piece_list* base, const struct piece_list* over, struct piece_list* out)
+{
+    size_t j = 0;
+
+    for (size_t i = 0; i < base->count; ++i) {
+        struct piece b = base->pieces[i];
+
+        while (j < over->count && over->pieces[j].offset + over->pieces[j].size <= b.offset)
+            if (piece_list_add(out, over->pieces[j++])) return -1;
+
+        while (b.size > 0) {
+            const struct piece* o = j < over->count ? &over->pieces[j] : 0;
+
+            if (!o || o->offset >= b.offset + b.size) {
+                if (piece_list_add(out, b)) return -1;
+                break;
+            }
+
+            if (o->offset > b.offset) {
+                struct piece head = b;
+                head.size = o->offset - b.offset;
+                if (piece_list_add(out, head)) return -1;
+            }
+
+            off_t o_end = o->offset + o->size;
+            if (o_end >= b.offset + b.size) break;
+
+            //piece over ends inside base piece
+            piece_clip(&b, o_end - b.offset);
+            if (piece_list_add(out, *o)) return -1;
+            ++j;
+        }
+    }
+
+    while (j < over->count)
+        if (piece_list_add(out, over->pieces[j++])) return -1;
+
+    return 0;
+}
+
+//drops pieces past end of file
+void merge_truncate(struct piece_list* l, off_t size)
+{
+    while (l->count && l->pieces[l->count - 1].offset >= size) --l->count;
+
+    if (l->count) {
+        struct piece* last = &l->pieces[l->count - 1];
+        if (last->offset + last->size > size) last->size = size - last->offset;
+    }
+}
+
+//writes merged pieces as ursparse stream
+int merge_write(struct sparse_ctx* c, const struct piece_list* l, const int* fds)
+{
+    for (size_t i = 0; i < l->count; ) {
+        //adjacent pieces of the same kind become one segment
+        size_t end = i + 1;
+        off_t size = l->pieces[i].size;
+        int unwritten = l->pieces[i].payload == -1;
+        while (end < l->count && (l->pieces[end].payload == -1) == unwritten &&
+               l->pieces[end].offset == l->pieces[end-1].offset + l->pieces[end-1].size) {
+            size += l->pieces[end].size;
+            ++end;
+        }
+
+        off_t offset = l->pieces[i].offset;
+
+        if (unwritten) {
+            //they override data of earlier streams
+            if (do_sparse_unwritten(c->fd_out, offset, size)) return -1;
+            i = end;
+            continue;
+        }
+
+        fprintf(stderr, "INFO: processing segment %ld %ld\n", offset, size);
+
+        do_sparse_hash_hole(c, offset);
+
+        if (4 > dprintf(c->fd_out, "%ld %ld\n", offset, size)) {
+            perror("ERROR: could not write segment");
+            return -1;
+        }
+
+        for (; i < end; ++i) {
+            c->fd_in = fds[l->pieces[i].file];
+            if (do_sparse_copy_data(c, l->pieces[i].payload, l->pieces[i].size)) return -1;
+        }
+    }
+
+    return 0;
+}
+
+//merges ursparse streams into one, later streams override earlier ones
+int do_merge(const char** files, int count, int fd_out, const struct options* opts)
+{
+    if (!count) {
+        fprintf(stderr, "ERROR: no streams to merge\n");
+        return 1;
+    }
+
+    int* fds = malloc(count * sizeof(*fds));
+    if (!fds) {
+        fprintf(stderr, "ERROR: could not allocate memory for streams\n");
+        return 1;
+    }
+    for (int i = 0; i < count; ++i) fds[i] = -1;
+
+    struct piece_list merged, next;
+    memset(&merged, 0, sizeof(merged));
+    memset(&next, 0, sizeof(next));
+
+    off_t size = -1;
+    int r = 0;
+
+    for (int i = 0; i < count && !r; ++i) {
+        fds[i] = open(files[i], O_RDONLY);
+        if (fds[i] == -1) {
+            fprintf(stderr, "ERROR: could not open %s: %s\n", files[i], strerror(errno));
+            r = -1;
+            break;
+        }
+
+        struct merge_index m;
+        memset(&m, 0, sizeof(m));
+        m.file = i;
+        m.name = files[i];
+        m.size = -1;
+
+        r = merge_index_stream(&m, fds[i], opts->blk_sz);
+        if (!r) r = merge_overlay(&merged, &m.pieces, &next);
+        free(m.pieces.pieces);
+        if (r) break;
+
+        struct piece_list t = merged;
+        merged = next;
+        next = t;
+        next.count = 0;
+
+        if (m.size != -1) {
+            //stream of whole file, it sets the size
+            size = m.size;
+            merge_truncate(&merged, size);
+        }
+
+        fprintf(stderr, "INFO: merged %s, %ld segments\n", files[i], merged.count);
+    }
+
+    if (!r) {
+        struct sparse_ctx ctx;
+        memset(&ctx, 0, sizeof(ctx));
+        ctx.fd_out = fd_out;
+        ctx.opts = opts;
+
+        struct tree_hash hash;
+        if (opts->verify) {
+            r = tree_hash_init(&hash, opts->threads);
+            if (!r) ctx.hash = &hash;
+        }
+
+        if (!r) r = merge_write(&ctx, &merged, fds);
+
+        if (!r && ctx.hash && size == -1) {
+            //hash covers up to end of last segment
+            const struct piece* last = merged.count ? &merged.pieces[merged.count - 1] : 0;
+            size = last ? last->offset + last->size : 0;
+        }
+        if (!r && size != -1) r = do_sparse_trailer(&ctx, size);
+
+        if (ctx.hash) tree_hash_free(ctx.hash);
+        free(ctx.buff);
+    }
+
+    for (int i = 0; i < count; ++i)
+        if (fds[i] != -1) close(fds[i]);
+    free(fds);
+    free(merged.pieces);
+    free(next.pieces);
+    return r ? 1 : 0;
+}
+
+struct hash_ctx {
+    int fd_in;
+    struct tree_hash hash;
+    char* buff;
+};
+
+int do_hash_extent(const struct extent* e, void* ctx)
+{
+    struct hash_ctx* c = ctx;
+
+    //unwritten extents are hashed as holes
+    if (e->flags & EXTENT_UNWRITTEN) return 0;
+
+    tree_hash_zeros(&c->hash, e->offset - c->hash.size);
+
+    off_t start = e->offset;
+    off_t sz = e->size;
+    while (sz > 0) {
+        ssize_t r = pread(c->fd_in, c->buff, sz > COPY_BUFF_SZ ? COPY_BUFF_SZ : sz, start);
+        if (r == -1) {
+            perror("ERROR: could not read data");
+            return -1;
+        }
+        if (!r) {
+            fprintf(stderr, "ERROR: input file shrunk while reading it\n");
+            return -1;
+        }
+        tree_hash_update(&c->hash, c->buff, r);
+        start += r;
+        sz -= r;
+    }
+
+    return 0;
+}
+
+//prints sparse tree hash of input file, reading only its data
+int do_hash(int fd_in, const struct options* opts)
+{
+    struct stat st;
+    if (-1 == fstat(fd_in, &st)) {
+        perror("ERROR: could not stat input file");
+        return 1;
+    }
+
+    struct hash_ctx ctx;
+    ctx.fd_in = fd_in;
+    ctx.buff = malloc(COPY_BUFF_SZ);
+    if (!ctx.buff) {
+        fprintf(stderr, "ERROR: could not allocate memory: %d bytes\n", COPY_BUFF_SZ);
+        return 1;
+    }
+    if (tree_hash_init(&ctx.hash, opts->threads)) {
+        free(ctx.buff);
+        return 1;
+    }
+
+    int r = walk_extents(fd_in, EXTENT_UNWRITTEN, do_hash_extent, &ctx);
+    if (!r) {
+        tree_hash_zeros(&ctx.hash, st.st_size - ctx.hash.size);
+
+        unsigned char digest[HASH_SZ];
+        char hex[2 * HASH_SZ + 1];
+        tree_hash_final(&ctx.hash, digest);
+        hash_hex(digest, hex);
+        printf("%s %ld\n", hex, st.st_size);
+    }
+
+    tree_hash_free(&ctx.hash);
+    free(ctx.buff);
+    return r ? 1 : 0;
+}
+
+//
+//block hash manifest
+//
+//per block hashes of a sparse file with a merkle tree on top, laid out
+//to be used memory mapped, integers are 64 bit little endian
+//
+//  header
+//  level descriptors, leaves first, root last
+//  per level: runs of stored nodes, then their digests
+//
+//a level stores only nodes with data below them, as runs of consecutive
+//node indexes; nodes outside the runs are complete subtrees of holes whose
+//hashes are well known, so holes take no space and two manifests compare
+//in O(changed) by descending only into nodes that differ
+//
+//  leaf = H(0x00 || block bytes), last block may be short
+//  node = H(0x01 || left || right)
+//
+
+#define MANIFEST_MAGIC "URSMAN01"
+
+struct manifest_header {
+    char magic[8];
+    uint64_t block_sz;
+    uint64_t levels;
+    uint64_t size;
+    uint64_t blocks;
+};
+
+struct manifest_level {
+    uint64_t runs;         //file offset of runs
+    uint64_t run_count;
+    uint64_t digests;      //file offset of digests
+    uint64_t digest_count;
+};
+
+struct manifest_run {
+    uint64_t first;  //index of first node
+    uint64_t count;
+    uint64_t digest; //index of digest of first node
+};
+
+//level of manifest being built or mapped
+struct manifest_view {
+    struct manifest_run* runs;
+    size_t run_count;
+    size_t run_cap;
+    unsigned char* digests;
+    size_t digest_count;
+    size_t digest_cap;
+};
+
+struct manifest {
+    size_t block_sz;
+    off_t size;
+    uint64_t blocks;
+    int levels;
+    struct manifest_view level[HASH_LEVELS];
+    unsigned char zero[HASH_LEVELS][HASH_SZ]; //complete subtrees of holes
+    void* map;
+    size_t map_sz;
+};
+
+void manifest_zero_init(struct manifest* m)
+{
+    unsigned char* block = calloc(1, m->block_sz);
+    EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+    hash_leaf(ctx, block, m->block_sz, m->zero[0]);
+    EVP_MD_CTX_free(ctx);
+    free(block);
+
+    for (int i = 1; i < HASH_LEVELS; ++i)
+        hash_node(m->zero[i-1], m->zero[i-1], m->zero[i]);
+}
+
+//returns digest of node, or 0 when level is above the tree
+const unsigned char* manifest_node(const struct manifest* m, int level, uint64_t index)
+{
+    if (level >= m->levels) return 0;
+
+    const struct manifest_view* v = &m->level[level];
+    size_t lo = 0, hi = v->run_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (le64toh(v->runs[mid].first) + le64toh(v->runs[mid].count) <= index)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo < v->run_count && le64toh(v->runs[lo].first) <= index) {
+        uint64_t digest = le64toh(v->runs[lo].digest) + index - le64toh(v->runs[lo].first);
+        return v->digests + digest * HASH_SZ;
+    }
+
+    return m->zero[level];
+}
+
+//appends nodes [first, first + count) to level, digests are added separately
+int manifest_add_run(struct manifest_view* v, uint64_t first, uint64_t count)
+{
+    if (v->run_count) {
+        struct manifest_run* last = &v->runs[v->run_count - 1];
+        uint64_t end = le64toh(last->first) + le64toh(last->count);
+        if (end >= first) {
+            if (first + count > end) last->count = htole64(first + count - le64toh(last->first));
+            return 0;
+        }
+    }
+
+    if (v->run_count == v->run_cap) {
+        size_t cap = v->run_cap ? v->run_cap * 2 : 256;
+        struct manifest_run* runs = realloc(v->runs, cap * sizeof(*runs));
+        if (!runs) {
+            fprintf(stderr, "ERROR: could not allocate memory for manifest\n");
+            return -1;
+        }
+        v->runs = runs;
+        v->run_cap = cap;
+    }
+
+    uint64_t digest = 0;
+    if (v->run_count) {
+        struct manifest_run* last = &v->runs[v->run_count - 1];
+        digest = le64toh(last->digest) + le64toh(last->count);
+    }
+
+    struct manifest_run run = { htole64(first), htole64(count), htole64(digest) };
+    v->runs[v->run_count++] = run;
+    return 0;
+}
+
+int manifest_reserve_digests(struct manifest_view* v, size_t count)
+{
+    if (v->digest_count + count <= v->digest_cap) return 0;
+
+    size_t cap = v->digest_cap ? v->digest_cap : 1024;
+    while (cap < v->digest_count + count) cap *= 2;
+
+    unsigned char* digests = realloc(v->digests, cap * HASH_SZ);
+    if (!digests) {
+        fprintf(stderr, "ERROR: could not allocate memory for manifest\n");
+        return -1;
+    }
+    v->digests = digests;
+    v->digest_cap = cap;
+    return 0;
+}
+
+void manifest_free(struct manifest* m)
+{
+    if (m->map) {
+        munmap(m->map, m->map_sz);
+    } else {
+        for (int i = 0; i < HASH_LEVELS; ++i) {
+            free(m->level[i].runs);
+            free(m->level[i].digests);
+        }
+    }
+    memset(m, 0, sizeof(*m));
+}
+
+int do_manifest_extent(const struct extent* e, void* ctx)
+{
+    struct manifest* m = ctx;
+
+    //unwritten extents are holes
+    if (e->flags & EXTENT_UNWRITTEN) return 0;
+
+    uint64_t first = e->offset / m->block_sz;
+    uint64_t end = (e->offset + e->size + m->block_sz - 1) / m->block_sz;
+    return manifest_add_run(&m->level[0], first, end - first);
+}
+
+//hashes blocks of level 0 runs, batches of blocks are hashed in parallel
+int manifest_hash_blocks(struct manifest* m, int fd_in, int threads)
+{
+    struct manifest_view* v = &m->level[0];
+
+    size_t batch = (size_t)threads * (4 << 20) / m->block_sz;
+    if (!batch) batch = 1;
+
+    unsigned char* buff = malloc(batch * m->block_sz);
+    if (!buff) {
+        fprintf(stderr, "ERROR: could not allocate memory: %ld bytes\n", batch * m->block_sz);
+        return -1;
+    }
+
+    size_t total = 0;
+    for (size_t i = 0; i < v->run_count; ++i)
+        total += le64toh(v->runs[i].count);
+
+    if (manifest_reserve_digests(v, total)) {
+        free(buff);
+        return -1;
+    }
+
+    EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+    int r = 0;
+
+    for (size_t i = 0; i < v->run_count && !r; ++i) {
+        uint64_t block = le64toh(v->runs[i].first);
+        uint64_t end = block + le64toh(v->runs[i].count);
+
+        while (block < end) {
+            size_t count = end - block < batch ? end - block : batch;
+            off_t offset = block * m->block_sz;
+            size_t sz = count * m->block_sz;
+            if (offset + sz > m->size) sz = m->size - offset;
+
+            for (size_t done = 0; done < sz; ) {
+                ssize_t n = pread(fd_in, buff + done, sz - done, offset + done);
+                if (n == -1) {
+                    perror("ERROR: could not read data");
+                    r = -1;
+                    break;
+                }
+                if (!n) {
+                    fprintf(stderr, "ERROR: input file shrunk while reading it\n");
+                    r = -1;
+                    break;
+                }
+                done += n;
+            }
+            if (r) break;
+
+            unsigned char* digests = v->digests + v->digest_count * HASH_SZ;
+            size_t full = sz / m->block_sz;
+            hash_leaves_parallel(buff, full, m->block_sz, digests, threads);
+            if (full < count)
+                hash_leaf(ctx, buff + full * m->block_sz, sz - full * m->block_sz, digests + full * HASH_SZ);
+
+            v->digest_count += count;
+            block += count;
+        }
+    }
+
+    EVP_MD_CTX_free(ctx);
+    free(buff);
+    return r;
+}
+
+//builds level from the one below it
+int manifest_hash_level(struct manifest* m, int level)
+{
+    struct manifest_view* below = &m->level[level - 1];
+    struct manifest_view* v = &m->level[level];
+
+    for (size_t i = 0; i < below->run_count; ++i) {
+        uint64_t first = le64toh(below->runs[i].first) / 2;
+        uint64_t last = (le64toh(below->runs[i].first) + le64toh(below->runs[i].count) - 1) / 2;
+        if (manifest_add_run(v, first, last - first + 1)) return -1;
+    }
+
+    for (size_t i = 0; i < v->run_count; ++i) {
+        uint64_t index = le64toh(v->runs[i].first);
+        uint64_t end = index + le64toh(v->runs[i].count);
+
+        if (manifest_reserve_digests(v, end - index)) return -1;
+
+        for (; index < end; ++index) {
+            hash_node(manifest_node(m, level - 1, 2 * index), manifest_node(m, level - 1, 2 * index + 1),
+                v->digests + v->digest_count * HASH_SZ);
+            ++v->digest_count;
+        }
+    }
+
+    return 0;
+}
+
+int manifest_write(const struct manifest* m, int fd_out)
+{
+    struct manifest_header header;
+    memcpy(header.magic, MANIFEST_MAGIC, sizeof(header.magic));
+    header.block_sz = htole64(m->block_sz);
+    header.levels = htole64(m->levels);
+    header.size = htole64(m->size);
+    header.blocks = htole64(m->blocks);
+
+    struct manifest_level levels[HASH_LEVELS];
+    uint64_t offset = sizeof(header) + m->levels * sizeof(levels[0]);
+    for (int i = 0; i < m->levels; ++i) {
+        levels[i].runs = htole64(offset);
+        levels[i].run_count = htole64(m->level[i].run_count);
+        offset += m->level[i].run_count * sizeof(struct manifest_run);
+        levels[i].digests = htole64(offset);
+        levels[i].digest_count = htole64(m->level[i].digest_count);
+        offset += m->level[i].digest_count * HASH_SZ;
+    }
+
+    if (write_all(fd_out, (const char*)&header, sizeof(header)) ||
+        write_all(fd_out, (const char*)levels, m->levels * sizeof(levels[0]))) {
+        perror("ERROR: could not write manifest");
+        return -1;
+    }
+
+    for (int i = 0; i < m->levels; ++i) {
+        if (write_all(fd_out, (const char*)m->level[i].runs, m->level[i].run_count * sizeof(struct manifest_run)) ||
+            write_all(fd_out, (const char*)m->level[i].digests, m->level[i].digest_count * HASH_SZ)) {
+            perror("ERROR: could not write manifest");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+//builds manifest of sparse file in memory
+int manifest_build(struct manifest* m, int fd_in, size_t block_sz, int threads)
+{
+    memset(m, 0, sizeof(*m));
+
+    struct stat st;
+    if (-1 == fstat(fd_in, &st)) {
+        perror("ERROR: could not stat input file");
+        return -1;
+    }
+
+    m->block_sz = block_sz;
+    m->size = st.st_size;
+    m->blocks = (st.st_size + block_sz - 1) / block_sz;
+    m->levels = 1;
+    while (((uint64_t)1 << (m->levels - 1)) < m->blocks) ++m->levels;
+    manifest_zero_init(m);
+
+    int r = walk_extents(fd_in, EXTENT_UNWRITTEN, do_manifest_extent, m);
+
+    //short last block is always hashed with its length
+    if (!r && st.st_size % block_sz) r = manifest_add_run(&m->level[0], m->blocks - 1, 1);
+
+    if (!r) r = manifest_hash_blocks(m, fd_in, threads);
+
+    for (int i = 1; i < m->levels && !r; ++i)
+        r = manifest_hash_level(m, i);
+
+    return r;
+}
+
+//writes block hash manifest of sparse input file
+int do_manifest(int fd_in, int fd_out, const struct options* opts)
+{
+    struct manifest m;
+    int r = manifest_build(&m, fd_in, opts->blk_sz, opts->threads);
+    if (!r) r = manifest_write(&m, fd_out);
+
+    if (!r) {
+        char hex[2 * HASH_SZ + 1];
+        hash_hex(manifest_node(&m, m.levels - 1, 0), hex);
+        fprintf(stderr, "INFO: manifest root %s\n", hex);
+    }
+
+    manifest_free(&m);
+    return r ? 1 : 0;
+}
+
+//maps manifest file, checking its layout
+int manifest_map(struct manifest* m, int fd, const char* name)
+{
+    memset(m, 0, sizeof(*m));
+
+    struct stat st;
+    if (-1 == fstat(fd, &st)) {
+        perror("ERROR: could not stat manifest");
+        return -1;
+    }
+
+    if (st.st_size < sizeof(struct manifest_header)) {
+        fprintf(stderr, "ERROR: %s is not a manifest\n", name);
+        return -1;
+    }
+
+    m->map_sz = st.st_size;
+    m->map = mmap(0, m->map_sz, PROT_READ, MAP_SHARED, fd, 0);
+    if (m->map == MAP_FAILED) {
+        m->map = 0;
+        perror("ERROR: could not map manifest");
+        return -1;
+    }
+
+    const struct manifest_header* header = m->map;
+    m->block_sz = le64toh(header->block_sz);
+    m->levels = le64toh(header->levels);
+    m->size = le64toh(header->size);
+    m->blocks = le64toh(header->blocks);
+
+    if (memcmp(header->magic, MANIFEST_MAGIC, sizeof(header->magic)) || !m->block_sz ||
+        m->levels < 1 || m->levels > HASH_LEVELS ||
+        sizeof(*header) + m->levels * sizeof(struct manifest_level) > m->map_sz) {
+        fprintf(stderr, "ERROR: %s is not a manifest\n", name);
+        return -1;
+    }
+
+    const struct manifest_level* levels = (const void*)(header + 1);
+    for (int i = 0; i < m->levels; ++i) {
+        uint64_t runs = le64toh(levels[i].runs);
+        uint64_t run_count = le64toh(levels[i].run_count);
+        uint64_t digests = le64toh(levels[i].digests);
+        uint64_t digest_count = le64toh(levels[i].digest_count);
+
+        if (runs > m->map_sz || run_count > (m->map_sz - runs) / sizeof(struct manifest_run) ||
+            digests > m->map_sz || digest_count > (m->map_sz - digests) / HASH_SZ) {
+            fprintf(stderr, "ERROR: manifest %s is truncated\n", name);
+            return -1;
+        }
+
+        struct manifest_view* v = &m->level[i];
+        v->runs = (struct manifest_run*)((char*)m->map + runs);
+        v->run_count = run_count;
+        v->digests = (unsigned char*)m->map + digests;
+        v->digest_count = digest_count;
+
+        if (run_count) {
+            const struct manifest_run* last = &v->runs[run_count - 1];
+            if (le64toh(last->digest) + le64toh(last->count) > digest_count) {
+                fprintf(stderr, "ERROR: manifest %s is corrupted\n", name);
+                return -1;
+            }
+        }
+    }
+
+    manifest_zero_init(m);
+    return 0;
+}
+
+//called for each changed range, returns non zero to stop the diff
+typedef int (*range_fn)(off_t offset, off_t size, void* ctx);
+
+struct manifest_diff {
+    const struct manifest* a;
+    const struct manifest* b;
+    uint64_t blocks;
+    uint64_t first; //run of changed blocks not reported yet
+    uint64_t count;
+    range_fn fn;
+    void* ctx;
+    int r;          //of fn
+};
+
+void manifest_diff_print(struct manifest_diff* d)
+{
+    if (!d->count || d->r) return;
+
+    size_t block_sz = d->a->block_sz;
+    off_t size = d->a->size > d->b->size ? d->a->size : d->b->size;
+    off_t offset = d->first * block_sz;
+    off_t end = (d->first + d->count) * block_sz;
+    if (end > size) end = size;
+
+    d->r = d->fn(offset, end - offset, d->ctx);
+    d->count = 0;
+}
+
+//descends into nodes that differ, reporting changed blocks in order
+void manifest_diff_node(struct manifest_diff* d, int level, uint64_t index)
+{
+    if (index << level >= d->blocks || d->r) return;
+
+    const unsigned char* a = manifest_node(d->a, level, index);
+    const unsigned char* b = manifest_node(d->b, level, index);
+    if (a && b && !memcmp(a, b, HASH_SZ)) return;
+
+    if (level) {
+        manifest_diff_node(d, level - 1, 2 * index);
+        manifest_diff_node(d, level - 1, 2 * index + 1);
+        return;
+    }
+
+    if (d->count && d->first + d->count == index) {
+        ++d->count;
+        return;
+    }
+
+    manifest_diff_print(d);
+    d->first = index;
+    d->count = 1;
+}
+
+//reports ranges that differ between manifests a and b in ascending order
+//
+//returns non zero when fn stops it
+int manifest_diff(const struct manifest* a, const struct manifest* b, range_fn fn, void* ctx)
+{
+    struct manifest_diff d = { a, b, a->blocks > b->blocks ? a->blocks : b->blocks, 0, 0, fn, ctx, 0 };
+    int top = a->levels > b->levels ? a->levels : b->levels;
+    manifest_diff_node(&d, top - 1, 0);
+    manifest_diff_print(&d);
+    return d.r;
+}
+
+int print_range(off_t offset, off_t size, void* ctx)
+{
+    printf("%ld %ld\n", offset, size);
+    return 0;
+}
+
+//prints ranges that differ between manifest of input and another one
+int do_manifest_diff(int fd_in, const char* other)
+{
+    int fd = open(other, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "ERROR: could not open manifest %s: %s\n", other, strerror(errno));
+        return 1;
+    }
+
+    struct manifest a, b;
+    int r = manifest_map(&a, fd, other);
+    close(fd);
+    if (r) {
+        manifest_free(&a);
+        return 1;
+    }
+
+    r = manifest_map(&b, fd_in, "input file");
+    if (!r && a.block_sz != b.block_sz) {
+        fprintf(stderr, "ERROR: manifests have different block sizes %ld and %ld\n", a.block_sz, b.block_sz);
+        r = -1;
+    }
+
+    if (!r) {
+        if (a.size != b.size)
+            fprintf(stderr, "INFO: size changed from %ld to %ld\n", a.size, b.size);
+
+        manifest_diff(&a, &b, print_range, 0);
+    }
+
+    manifest_free(&a);
+    manifest_free(&b);
+    return r ? 1 : 0;
+}
+
+//
+//continuous replication of a sparse file
+//
+//source is encoded once, then its block hash manifest is kept in memory
+//and rebuilt when the source is modified (or every interval seconds),
+//reading only allocated blocks; blocks whose hash changed are appended to
+//the output stream as delta segments, zeros among them as u records,
+//the decoder applies them as they arrive
+//
+
+#define WATCH_INTERVAL 5     //seconds between rescans when source can not be watched
+#define WATCH_SETTLE_MS 200
+
+struct watch_delta {
+    struct sparse_ctx* c;
+    off_t size;    //of source
+    off_t pos;     //end of range shipped so far
+    off_t ranges;  //changed in round
+    off_t shipped; //data bytes in round
+};
+
+int do_watch_extent(const struct extent* e, void* ctx)
+{
+    struct watch_delta* w = ctx;
+
+    //holes and unwritten ranges read as zeros
+    off_t zeros = e->flags & EXTENT_UNWRITTEN ? e->offset + e->size : e->offset;
+    if (zeros > w->pos) {
+        int r = do_sparse_flush(w->c);
+        if (!r) r = do_sparse_unwritten(w->c->fd_out, w->pos, zeros - w->pos);
+        if (r) return r;
+    }
+
+    w->pos = e->offset + e->size;
+    if (e->flags & EXTENT_UNWRITTEN) return 0;
+
+    w->shipped += e->size;
+    return do_sparse_queue(w->c, e->offset, e->size);
+}
+
+int do_watch_range(off_t offset, off_t size, void* ctx)
+{
+    struct watch_delta* w = ctx;
+
+    off_t end = offset + size < w->size ? offset + size : w->size;
+    if (offset >= end) return 0;
+
+    w->ranges++;
+    w->pos = offset;
+    int r = walk_extents_range(w->c->fd_in, offset, end, EXTENT_UNWRITTEN, do_watch_extent, w);
+
+    if (!r && w->pos < end) {
+        r = do_sparse_flush(w->c);
+        if (!r) r = do_sparse_unwritten(w->c->fd_out, w->pos, end - w->pos);
+    }
+
+    return r;
+}
+
+//waits for source to change
+//
+//returns
+//  0 source changed or interval passed
+//  1 source is gone
+//  negative number on error
+int watch_wait(int fd, int fd_notify, int interval)
+{
+    //removing source only unlinks it, it is kept open here
+    struct stat st;
+    if (!fstat(fd, &st) && !st.st_nlink) return 1;
+
+    if (fd_notify == -1) {
+        sleep(interval);
+        return 0;
+    }
+
+    struct pollfd p = { fd_notify, POLLIN, 0 };
+    int r = poll(&p, 1, interval ? interval * 1000 : -1);
+    if (r == -1 && errno != EINTR) {
+        perror("ERROR: could not wait for changes");
+        return -1;
+    }
+    if (r <= 0) return 0;
+
+    //let burst of writes settle into one round
+    usleep(WATCH_SETTLE_MS * 1000);
+
+    int gone = 0;
+    char buff[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    while (0 < (n = read(fd_notify, buff, sizeof(buff)))) {
+        for (char* e = buff; e < buff + n; e += sizeof(struct inotify_event) + ((struct inotify_event*)e)->len)
+            if (((struct inotify_event*)e)->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) gone = 1;
+    }
+
+    if (!fstat(fd, &st) && !st.st_nlink) gone = 1;
+    return gone;
+}
+
+//replicates source file to output until it is removed
+//
+//interval => seconds between rescans, 0 to rescan on modification only
+int do_watch(const char* path, int fd_out, int interval, const struct options* opts)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "ERROR: could not open %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    int fd_notify = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (fd_notify != -1 && -1 == inotify_add_watch(fd_notify, path, IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)) {
+        close(fd_notify);
+        fd_notify = -1;
+    }
+    if (fd_notify == -1 && !interval) {
+        interval = WATCH_INTERVAL;
+        fprintf(stderr, "INFO: could not watch %s, rescanning every %d s\n", path, interval);
+    }
+
+    struct sparse_ctx ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.fd_in = fd;
+    ctx.fd_out = fd_out;
+    ctx.opts = opts;
+
+    //manifest first, changes made while encoding are shipped again next round
+    struct manifest m;
+    int r = manifest_build(&m, fd, opts->blk_sz, opts->threads);
+    if (!r) r = do_sparse(fd, fd_out, opts);
+    if (!r) r = do_sparse_trailer(&ctx, m.size);
+
+    while (!r) {
+        r = watch_wait(fd, fd_notify, interval);
+        if (r) break;
+
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+
+        struct manifest next;
+        r = manifest_build(&next, fd, opts->blk_sz, opts->threads);
+        if (r) {
+            manifest_free(&next);
+            break;
+        }
+
+        struct watch_delta w;
+        memset(&w, 0, sizeof(w));
+        w.c = &ctx;
+        w.size = next.size;
+
+        r = manifest_diff(&m, &next, do_watch_range, &w);
+        if (!r) r = do_sparse_flush(&ctx);
+        if (!r && next.size != m.size) r = do_sparse_trailer(&ctx, next.size);
+        if (next.size < m.size)
+            fprintf(stderr, "INFO: %s shrank to %ld, output is not truncated\n", path, next.size);
+
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        fprintf(stderr, "INFO: round shipped %ld changed ranges, %ld data bytes in %.3f s\n",
+            w.ranges, w.shipped, (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+
+        manifest_free(&m);
+        m = next;
+    }
+
+    if (r > 0) {
+        fprintf(stderr, "INFO: %s is gone, stopped watching\n", path);
+        r = 0;
+    }
+
+    manifest_free(&m);
+    free(ctx.buff);
+    free(ctx.shared.ranges);
+    if (fd_notify != -1) close(fd_notify);
+    close(fd);
+    return r ? 1 : 0;
+}
+
+//
+//map output
+//
+//text prints offset and length of data extents per line, json an array
+//of objects with them, binary packs them as 64-bit little endian pairs
+//summary prints size, allocated bytes, extent and hole counts and a
+//histogram of extent sizes by powers of two, counted in one pass
+//bitmap writes the allocation bitmap
+//output is written in MAP_BUFF_SZ chunks
+//
+#define MAP_BUFF_SZ (1 << 20)
+#define MAP_LINE_SZ 64 //most bytes of output per extent
+
+enum { MAP_TEXT, MAP_JSON, MAP_BINARY, MAP_SUMMARY, MAP_BITMAP };
+
+struct map_ctx {
+    int format;
+    char* buff;
+    size_t used;
+    off_t end;      //of previous extent
+    uint64_t count; //of extents
+    uint64_t holes;
+    uint64_t allocated;
+    uint64_t histogram[64]; //extents by highest bit of size
+};
+
+//parses --map-format name, returns -1 when unknown
+int map_format(const char* name)
+{
+    if (!strcmp(name, "text")) return MAP_TEXT;
+    if (!strcmp(name, "json")) return MAP_JSON;
+    if (!strcmp(name, "binary")) return MAP_BINARY;
+    if (!strcmp(name, "summary")) return MAP_SUMMARY;
+    if (!strcmp(name, "bitmap")) return MAP_BITMAP;
+    return -1;
+}
+
+//appends decimal number, returns bytes appended
+size_t put_decimal(char* p, uint64_t n)
+{
+    char tmp[20];
+    size_t i = 0;
+    do {
+        tmp[i++] = '0' + n % 10;
+        n /= 10;
+    } while (n);
+
+    for (size_t j = 0; j < i; ++j) p[j] = tmp[i - 1 - j];
+    return i;
+}
+
+int map_flush(struct map_ctx* m)
+{
+    int r = write_all(1, m->buff, m->used);
+    if (r) perror("ERROR: could not write map");
+    m->used = 0;
+    return r;
+}
+
+int map_put(struct map_ctx* m, const char* s, size_t sz)
+{
+    if (m->used + sz > MAP_BUFF_SZ && map_flush(m)) return -1;
+    memcpy(m->buff + m->used, s, sz);
+    m->used += sz;
+    return 0;
+}
+
+int do_map_extent(const struct extent* e, void* ctx)
+{
+    if (e->flags & EXTENT_UNWRITTEN) return 0;
+
+    struct map_ctx* m = ctx;
+    if (e->offset > m->end) m->holes++;
+    m->end = e->offset + e->size;
+    m->allocated += e->size;
+    m->histogram[63 - __builtin_clzll(e->size)]++;
+
+    if (m->format == MAP_SUMMARY) {
+        m->count++;
+        return 0;
+    }
+
+    if (m->used + MAP_LINE_SZ > MAP_BUFF_SZ && map_flush(m)) return -1;
+
+    char* p = m->buff + m->used;
+    if (m->format == MAP_BINARY) {
+        uint64_t le[2] = { htole64(e->offset), htole64(e->size) };
+        memcpy(p, le, sizeof(le));
+        p += sizeof(le);
+    } else if (m->format == MAP_JSON) {
+        static const char offset[] = "\n{\"offset\":", length[] = ",\"length\":";
+        if (m->count) *p++ = ',';
+        memcpy(p, offset, sizeof(offset) - 1);
+        p += sizeof(offset) - 1;
+        p += put_decimal(p, e->offset);
+        memcpy(p, length, sizeof(length) - 1);
+        p += sizeof(length) - 1;
+        p += put_decimal(p, e->size);
+        *p++ = '}';
+    } else {
+        p += put_decimal(p, e->offset);
+        *p++ = ' ';
+        p += put_decimal(p, e->size);
+        *p++ = '\n';
+    }
+    m->used = p - m->buff;
+    m->count++;
+    return 0;
+}
+
+int do_map_summary(struct map_ctx* m, off_t size)
+{
+    char line[128];
+    int n = snprintf(line, sizeof(line), "size %ld\nallocated %lu\nextents %lu\nholes %lu\n",
+                     size, m->allocated, m->count, m->holes + (size > m->end));
+    if (map_put(m, line, n)) return -1;
+
+    for (int i = 0; i < 64; ++i) {
+        if (!m->histogram[i]) continue;
+        n = snprintf(line, sizeof(line), "histogram %lu %lu\n", 1ul << i, m->histogram[i]);
+        if (map_put(m, line, n)) return -1;
+    }
+    return 0;
+}
+
+int do_map (int fd_in, const struct options* opts)
+{
+    struct stat st;
+    if (-1 == fstat(fd_in, &st)) {
+        perror("ERROR: could not stat input file");
+        return 1;
+    }
+    off_t size = S_ISREG(st.st_mode) ? st.st_size : lseek(fd_in, 0, SEEK_END);
+
+    if (opts->map_format == MAP_BITMAP) {
+        struct alloc_bitmap b;
+        if (alloc_bitmap_init(&b, size)) return 1;
+
+        int r = walk_extents_cached(fd_in, 0, INT64_MAX, EXTENT_UNWRITTEN, opts->extent_cache, alloc_bitmap_add, &b);
+        if (!r) r = alloc_bitmap_index(&b);
+        if (!r && alloc_bitmap_write(&b, 1)) {
+            perror("ERROR: could not write map");
+            r = 1;
         }
-    
-        end = lseek(fd_in, start, SEEK_HOLE);
+        alloc_bitmap_free(&b);
+        return r ? 1 : 0;
+    }
 
-        if (end == -1) {
-            if (errno == ENXIO) {
-                 //EOF reached
-                 break; 
+    struct map_ctx m;
+    memset(&m, 0, sizeof(m));
+    m.format = opts->map_format;
+    m.buff = malloc(MAP_BUFF_SZ);
+    if (!m.buff) {
+        fprintf(stderr, "ERROR: could not allocate memory for map\n");
+        return 1;
+    }
+
+    if (m.format == MAP_JSON) map_put(&m, "[", 1);
+
+    int r = walk_extents_cached(fd_in, 0, INT64_MAX, EXTENT_UNWRITTEN, opts->extent_cache, do_map_extent, &m);
+    if (!r && m.format == MAP_JSON) r = map_put(&m, "\n]\n", 3);
+    if (!r && m.format == MAP_SUMMARY) r = do_map_summary(&m, size);
+    if (!r) r = map_flush(&m);
+
+    free(m.buff);
+    return r ? 1 : 0;
+}
+
+//
+//directory tree map
+//
+//directories are scanned by a pool of threads, each keeping a deque of
+//directories still to scan; a thread pushes subdirectories it finds and
+//pops the newest, idle threads steal the oldest from the others
+//directories are opened relative to their parent and read with
+//getdents64, queued ones keep their descriptor up to half of the
+//descriptor limit, left to scanning threads, the rest are reopened by path
+//
+//regular files are mapped like --map, text output prints size,
+//allocated bytes, extent and hole counts and path per file, followed by
+//a summary of all of them; summary output prints the summary only
+//
+#define TREE_DENTS_SZ (64 << 10)
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct tree_dir {
+    int fd;     //-1 when it has to be opened by path
+    char* path;
+};
+
+struct tree_deque {
+    pthread_mutex_t lock;
+    struct tree_dir* dirs;
+    size_t head;  //oldest, taken by thieves
+    size_t tail;  //newest, taken by owner
+    size_t capacity;
+};
+
+struct tree_scan {
+    struct tree_deque* deques;
+    int count;      //of threads
+    size_t pending; //directories queued or being scanned
+    size_t held;     //descriptors of queued directories
+    size_t held_max;
+    pthread_mutex_t out_lock;
+    int format;
+    int failed;
+};
+
+struct tree_worker {
+    struct tree_scan* scan;
+    int id;
+    unsigned seed;  //of victim choice
+    struct map_ctx total;
+    uint64_t files;
+    uint64_t size;  //logical, of files
+    char* dents;
+    int warned;     //some entries could not be mapped
+};
+
+int tree_push(struct tree_deque* q, struct tree_dir d)
+{
+    pthread_mutex_lock(&q->lock);
+    if (q->tail == q->capacity) {
+        //reclaims space of stolen directories before growing
+        if (q->head) {
+            memmove(q->dirs, q->dirs + q->head, (q->tail - q->head) * sizeof(*q->dirs));
+            q->tail -= q->head;
+            q->head = 0;
+        }
+        if (q->tail == q->capacity) {
+            size_t capacity = q->capacity ? q->capacity * 2 : 64;
+            struct tree_dir* dirs = realloc(q->dirs, capacity * sizeof(*dirs));
+            if (!dirs) {
+                pthread_mutex_unlock(&q->lock);
+                fprintf(stderr, "ERROR: could not allocate memory for directory queue\n");
+                return -1;
             }
-            perror("ERROR: could not seek");
-            return 1;
+            q->dirs = dirs;
+            q->capacity = capacity;
         }
+    }
+    q->dirs[q->tail++] = d;
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
 
-        //printf("%ld %ld\n", start, end - start);
-        if (do_sparse_data(fd_in, fd_out, blk_sz, hole_byte, start, end-start)) {
-            return 2;
-        }
-        start = end;
+//takes newest directory when own, oldest otherwise
+int tree_pop(struct tree_deque* q, int own, struct tree_dir* d)
+{
+    pthread_mutex_lock(&q->lock);
+    int r = q->head < q->tail;
+    if (r) *d = own ? q->dirs[--q->tail] : q->dirs[q->head++];
+    if (q->head == q->tail) q->head = q->tail = 0;
+    pthread_mutex_unlock(&q->lock);
+    return r;
+}
+
+int tree_take(struct tree_worker* w, struct tree_dir* d)
+{
+    struct tree_scan* s = w->scan;
+    if (tree_pop(&s->deques[w->id], 1, d)) return 1;
+
+    //steals starting from random victim, so thieves spread over them
+    int first = rand_r(&w->seed) % s->count;
+    for (int i = 0; i < s->count; ++i) {
+        int victim = (first + i) % s->count;
+        if (victim != w->id && tree_pop(&s->deques[victim], 0, d)) return 1;
+    }
+    return 0;
+}
+
+int tree_print(struct tree_worker* w, struct map_ctx* m, off_t size, const char* path, const char* name)
+{
+    char line[MAP_LINE_SZ];
+    char* p = line;
+    p += put_decimal(p, size);
+    *p++ = ' ';
+    p += put_decimal(p, m->allocated);
+    *p++ = ' ';
+    p += put_decimal(p, m->count);
+    *p++ = ' ';
+    p += put_decimal(p, m->holes + (size > m->end));
+    *p++ = ' ';
+
+    size_t path_sz = strlen(path);
+    size_t name_sz = strlen(name);
+    if (w->total.used + (p - line) + path_sz + name_sz + 2 > MAP_BUFF_SZ) {
+        pthread_mutex_lock(&w->scan->out_lock);
+        int r = map_flush(&w->total);
+        pthread_mutex_unlock(&w->scan->out_lock);
+        if (r) return -1;
     }
 
-    if (start != -1 && end != -1) {
-        //printf("%ld %ld\n", start, end - start);
-        if (do_sparse_data(fd_in, fd_out, blk_sz, hole_byte, start, end-start)) {
-            return 3;
-        }
+    map_put(&w->total, line, p - line);
+    map_put(&w->total, path, path_sz);
+    map_put(&w->total, "/", 1);
+    map_put(&w->total, name, name_sz);
+    return map_put(&w->total, "\n", 1);
+}
+
+//maps regular file of directory and adds it to totals of worker
+int tree_map_file(struct tree_worker* w, int dir, const char* path, const char* name)
+{
+    int fd = openat(dir, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "WARNING: could not open %s/%s: %s\n", path, name, strerror(errno));
+        return 1;
+    }
+
+    struct stat st;
+    struct map_ctx m;
+    memset(&m, 0, sizeof(m));
+    m.format = MAP_SUMMARY;
+
+    int r = fstat(fd, &st);
+    if (!r && S_ISREG(st.st_mode)) r = walk_extents_sized(fd, 1, st.st_size, 0, INT64_MAX, EXTENT_UNWRITTEN, do_map_extent, &m);
+    close(fd);
+    if (r) {
+        fprintf(stderr, "WARNING: could not map %s/%s\n", path, name);
+        return 1;
+    }
+    if (!S_ISREG(st.st_mode)) return 0;
+
+    w->files++;
+    w->size += st.st_size;
+    w->total.count += m.count;
+    w->total.holes += m.holes + (st.st_size > m.end);
+    w->total.allocated += m.allocated;
+    for (int i = 0; i < 64; ++i) w->total.histogram[i] += m.histogram[i];
+
+    if (w->scan->format == MAP_SUMMARY) return 0;
+    return tree_print(w, &m, st.st_size, path, name) ? -1 : 0;
+}
+
+//queues subdirectory of directory
+int tree_queue_dir(struct tree_worker* w, int dir, const char* path, const char* name)
+{
+    struct tree_scan* s = w->scan;
+    struct tree_dir d;
+    d.fd = -1;
+    int held = __atomic_add_fetch(&s->held, 1, __ATOMIC_RELAXED) <= s->held_max;
+    if (held) d.fd = openat(dir, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (d.fd == -1) __atomic_sub_fetch(&s->held, 1, __ATOMIC_RELAXED);
+    if (held && d.fd == -1 && errno != EMFILE && errno != ENFILE) {
+        fprintf(stderr, "WARNING: could not open %s/%s: %s\n", path, name, strerror(errno));
+        return 1;
+    }
+
+    size_t sz = strlen(path) + strlen(name) + 2;
+    d.path = malloc(sz);
+    if (!d.path) {
+        if (d.fd != -1) close(d.fd);
+        fprintf(stderr, "ERROR: could not allocate memory for directory queue\n");
+        return -1;
     }
+    snprintf(d.path, sz, "%s/%s", path, name);
 
+    __atomic_add_fetch(&s->pending, 1, __ATOMIC_RELAXED);
+    if (tree_push(&s->deques[w->id], d)) {
+        __atomic_sub_fetch(&s->pending, 1, __ATOMIC_RELAXED);
+        if (d.fd != -1) close(d.fd);
+        free(d.path);
+        return -1;
+    }
     return 0;
 }
 
-int do_map (int fd_in)
+//returns negative number on error, 1 when some entries could not be mapped
+int tree_scan_dir(struct tree_worker* w, struct tree_dir* d)
 {
-    off_t start  = lseek(fd_in, 0, SEEK_SET);
-    if (start == -1) {
-        perror("ERROR: input file is not seekable");
+    if (d->fd == -1) d->fd = open(d->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (d->fd == -1) {
+        fprintf(stderr, "WARNING: could not open %s: %s\n", d->path, strerror(errno));
         return 1;
     }
 
-    off_t end = 0;
-    while (1) {
-        start = lseek(fd_in, start, SEEK_DATA);
-        if (start == -1) {
-            if (errno == ENXIO) {
-                 //EOF reached
-                 break; 
-            }
-            perror("ERROR: could not seek");
+    int failed = 0;
+    for (;;) {
+        long n = syscall(SYS_getdents64, d->fd, w->dents, TREE_DENTS_SZ);
+        if (n == -1) {
+            fprintf(stderr, "WARNING: could not read directory %s: %s\n", d->path, strerror(errno));
             return 1;
         }
-    
-        end = lseek(fd_in, start, SEEK_HOLE);
+        if (!n) break;
 
-        if (end == -1) {
-            if (errno == ENXIO) {
-                 //EOF reached
-                 break; 
+        for (long i = 0; i < n;) {
+            struct linux_dirent64* e = (struct linux_dirent64*)(w->dents + i);
+            i += e->d_reclen;
+
+            const char* name = e->d_name;
+            if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2]))) continue;
+
+            unsigned char type = e->d_type;
+            if (type == DT_UNKNOWN) {
+                struct stat st;
+                if (fstatat(d->fd, name, &st, AT_SYMLINK_NOFOLLOW)) {
+                    fprintf(stderr, "WARNING: could not stat %s/%s: %s\n", d->path, name, strerror(errno));
+                    failed = 1;
+                    continue;
+                }
+                type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
             }
-            perror("ERROR: could not seek");
-            return 1;
-        }
 
-        printf("%ld %ld\n", start, end - start);
-        start = end;
+            int r = 0;
+            if (type == DT_DIR) r = tree_queue_dir(w, d->fd, d->path, name);
+            if (type == DT_REG) r = tree_map_file(w, d->fd, d->path, name);
+            if (r < 0) return r;
+            if (r) failed = 1;
+        }
     }
+    return failed;
+}
+
+void* tree_worker(void* arg)
+{
+    struct tree_worker* w = arg;
+    struct tree_scan* s = w->scan;
+
+    while (!__atomic_load_n(&s->failed, __ATOMIC_RELAXED)) {
+        struct tree_dir d;
+        if (!tree_take(w, &d)) {
+            if (!__atomic_load_n(&s->pending, __ATOMIC_ACQUIRE)) break;
+            //directories being scanned by others may still queue more
+            struct timespec nap = { 0, 50000 };
+            nanosleep(&nap, 0);
+            continue;
+        }
 
-    if (start != -1 && end != -1)
-        printf("%ld %ld\n", start, end - start);
+        if (d.fd != -1) __atomic_sub_fetch(&s->held, 1, __ATOMIC_RELAXED);
+        int r = tree_scan_dir(w, &d);
+        if (d.fd != -1) close(d.fd);
+        free(d.path);
+        if (r < 0) __atomic_store_n(&s->failed, 1, __ATOMIC_RELAXED);
+        if (r > 0) w->warned = 1;
+        __atomic_sub_fetch(&s->pending, 1, __ATOMIC_RELEASE);
+    }
     return 0;
 }
 
+int do_map_tree(const char* root, const struct options* opts)
+{
+    if (opts->map_format != MAP_TEXT && opts->map_format != MAP_SUMMARY) {
+        fprintf(stderr, "ERROR: directory tree map is text or summary\n");
+        return 3;
+    }
+
+    struct tree_dir d;
+    d.fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (d.fd == -1) {
+        fprintf(stderr, "ERROR: could not open directory %s: %s\n", root, strerror(errno));
+        return 1;
+    }
+    d.path = strdup(root);
+
+    //keeps / alone, so paths of entries are root-relative
+    size_t len = d.path ? strlen(d.path) : 0;
+    while (len > 1 && d.path[len - 1] == '/') d.path[--len] = 0;
+    if (len == 1 && d.path[0] == '/') d.path[0] = 0;
+
+    //leaves room for the directories queued
+    struct rlimit rl;
+    if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    //each thread needs descriptors of the directory it scans and the file it maps
+    int count = opts->threads < 1 ? 1 : opts->threads;
+    long fds = getrlimit(RLIMIT_NOFILE, &rl) || rl.rlim_cur > INT_MAX ? 1024 : (long)rl.rlim_cur;
+    fds -= 16 + 2 * count;
+    struct tree_scan s;
+    memset(&s, 0, sizeof(s));
+    s.count = count;
+    s.format = opts->map_format;
+    s.pending = 1;
+    s.held = 1; //of root
+    s.held_max = fds > 0 ? fds / 2 : 0;
+    pthread_mutex_init(&s.out_lock, 0);
+    s.deques = calloc(count, sizeof(*s.deques));
+
+    struct tree_worker* w = calloc(count, sizeof(*w));
+    pthread_t* ids = calloc(count, sizeof(*ids));
+    int r = !d.path || !s.deques || !w || !ids;
+
+    for (int i = 0; i < count && !r; ++i) {
+        pthread_mutex_init(&s.deques[i].lock, 0);
+        w[i].scan = &s;
+        w[i].id = i;
+        w[i].seed = i + 1;
+        w[i].total.format = MAP_SUMMARY;
+        w[i].total.buff = malloc(MAP_BUFF_SZ);
+        w[i].dents = malloc(TREE_DENTS_SZ);
+        r = !w[i].total.buff || !w[i].dents;
+    }
+    if (r) fprintf(stderr, "ERROR: could not allocate memory for directory tree map\n");
+    if (!r) r = tree_push(&s.deques[0], d);
+    if (r) {
+        close(d.fd);
+        free(d.path);
+    }
+
+    //calling thread is the first worker
+    int spawned = 1;
+    if (!r) {
+        for (; spawned < count; ++spawned)
+            if (pthread_create(&ids[spawned], 0, tree_worker, &w[spawned])) break;
+        tree_worker(&w[0]);
+        for (int i = 1; i < spawned; ++i) pthread_join(ids[i], 0);
+        r = s.failed;
+    }
+
+    //sums totals of workers into the first one
+    struct map_ctx* total = &w[0].total;
+    int warned = 0;
+    uint64_t files = 0, size = 0;
+    for (int i = 0; i < count && w; ++i) {
+        if (!r && w[i].total.used) r = map_flush(&w[i].total);
+        files += w[i].files;
+        size += w[i].size;
+        warned |= w[i].warned;
+        if (!i) continue;
+        total->count += w[i].total.count;
+        total->holes += w[i].total.holes;
+        total->allocated += w[i].total.allocated;
+        for (int j = 0; j < 64; ++j) total->histogram[j] += w[i].total.histogram[j];
+    }
+
+    if (!r) {
+        char line[64];
+        int n = snprintf(line, sizeof(line), "files %lu\n", files);
+        r = map_put(total, line, n);
+        total->end = size; //holes are summed per file already
+        if (!r) r = do_map_summary(total, size);
+        if (!r) r = map_flush(total);
+    }
+
+    //leftovers of a failed scan
+    for (int i = 0; i < count && s.deques; ++i) {
+        struct tree_dir left;
+        while (tree_pop(&s.deques[i], 1, &left)) {
+            if (left.fd != -1) close(left.fd);
+            free(left.path);
+        }
+        free(s.deques[i].dirs);
+        if (w) {
+            free(w[i].total.buff);
+            free(w[i].dents);
+        }
+    }
+    free(s.deques);
+    free(w);
+    free(ids);
+    if (r) return 1;
+    return warned ? 2 : 0;
+}
+
 int usage(const char* name)
 {
     fprintf(stderr, "Helper utility to encode/decode sparse files to/from ursparse format\n\n");
@@ -473,12 +8582,120 @@ int usage(const char* name)
     fprintf(stderr, "       -m,    --map       shows map of data blocks for sparse input file\n");
     fprintf(stderr, "       -u,    --ursparse  reads ursparse input file and writes sparse file to output (default option)\n");
     fprintf(stderr, "       -s,    --sparse    reads sparse input file and writes ursparse format to output file\n");
+    fprintf(stderr, "       -H,    --hash      shows sparse tree hash and size of sparse input file\n");
+    fprintf(stderr, "                          only data is read, holes are hashed without reading them\n");
+    fprintf(stderr, "       -M,    --manifest  writes block hash manifest with merkle tree of sparse input file\n");
+    fprintf(stderr, "                          blocks are --blocksize long, holes are not stored\n");
+    fprintf(stderr, "              --manifest-diff=FILE\n");
+    fprintf(stderr, "                          shows ranges that differ between manifest FILE and input manifest\n");
+    fprintf(stderr, "              --listen=ADDR\n");
+    fprintf(stderr, "                          runs as daemon receiving ursparse streams on unix socket ADDR, or TCP\n");
+    fprintf(stderr, "                          socket when ADDR is [HOST]:PORT, repeatable, -j sets worker threads;\n");
+    fprintf(stderr, "                          without HOST it listens on loopback only, 0.0.0.0 or :: listens on\n");
+    fprintf(stderr, "                          all interfaces to unauthenticated clients; paths can not leave root,\n");
+    fprintf(stderr, "                          through .. or symlinks;\n");
+    fprintf(stderr, "                          streams start with destination path and newline, or with <PATH\n");
+    fprintf(stderr, "                          and newline to fetch PATH encoded when --allow-fetch is given\n");
+    fprintf(stderr, "              --allow-fetch\n");
+    fprintf(stderr, "                          daemon: sends any file under root to clients asking for it\n");
+    fprintf(stderr, "              --root=DIR  daemon: destination paths are relative to DIR (defaults to .)\n");
+    fprintf(stderr, "              --connect=ADDR --dest=PATH\n");
+    fprintf(stderr, "                          sparse: sends ursparse to daemon at ADDR to be written to PATH\n");
+    fprintf(stderr, "                          ursparse: fetches PATH from daemon at ADDR and decodes it to output\n");
+    fprintf(stderr, "              --watch SRC writes SRC as ursparse to output, then keeps appending segments\n");
+    fprintf(stderr, "                          of --blocksize blocks changed in SRC until it is removed,\n");
+    fprintf(stderr, "                          -u applies them as they arrive\n");
+    fprintf(stderr, "              --interval=SECONDS\n");
+    fprintf(stderr, "                          watch: rescans SRC this often, by default only when it is written\n");
+    fprintf(stderr, "              --output=FILE\n");
+    fprintf(stderr, "                          sparse, ursparse: writes to FILE instead of output, repeat it to\n");
+    fprintf(stderr, "                          write the same content to more files at once, unix sockets are\n");
+    fprintf(stderr, "                          connected to, FILE is truncated unless decoding a --range\n");
+    fprintf(stderr, "              --queue=SIZE\n");
+    fprintf(stderr, "                          sparse: bytes an output may fall behind others before it stalls\n");
+    fprintf(stderr, "                          them (defaults to 64M)\n");
+    fprintf(stderr, "              --range START:LEN\n");
+    fprintf(stderr, "                          sparse: encodes only bytes START..START+LEN-1 of input file\n");
+    fprintf(stderr, "                          ursparse: decodes only that range, at its offsets into seekable\n");
+    fprintf(stderr, "                          output file, or as the range alone into streamed output\n");
+    fprintf(stderr, "              --compress=CODEC\n");
+    fprintf(stderr, "                          sparse: ships data in blocks compressed with lz4, zstd-1, zstd-3\n");
+    fprintf(stderr, "                          or zstd-9, auto picks per block what gets it through output\n");
+    fprintf(stderr, "                          soonest, measured while output makes writes wait\n");
+    fprintf(stderr, "              --seekable  sparse: ships data in independently decoded blocks of %d bytes,\n", COMPRESS_BLOCK_SZ);
+    fprintf(stderr, "                          compressed with --compress, and ends output with index of them\n");
+    fprintf(stderr, "              --extract   decodes seekable ursparse input file through its index, only the\n");
+    fprintf(stderr, "                          blocks in --range are read, -j threads decode into seekable output\n");
+    fprintf(stderr, "              --chunks=PATH\n");
+    fprintf(stderr, "                          sparse: ships data in content defined chunks, chunks listed in chunk\n");
+    fprintf(stderr, "                          index file PATH as c references and the rest as k records added to it,\n");
+    fprintf(stderr, "                          with --connect once the daemon stored them, chunks it misses are\n");
+    fprintf(stderr, "                          forgotten and shipped again\n");
+    fprintf(stderr, "                          ursparse: keeps chunks of k records in chunk store directory PATH,\n");
+    fprintf(stderr, "                          packed with an index decoders share, and copies c references from\n");
+    fprintf(stderr, "                          it, the chunk index has to list what the store holds\n");
+    fprintf(stderr, "              --store-size=SIZE\n");
+    fprintf(stderr, "                          ursparse: most bytes of chunks the chunk store keeps, least\n");
+    fprintf(stderr, "                          recently used ones are evicted past it (new stores keep 16G), but\n");
+    fprintf(stderr, "                          not those a stream being decoded stored or referenced\n");
+    fprintf(stderr, "              --map-tree=DIR\n");
+    fprintf(stderr, "                          maps regular files in directory tree DIR, scanned by -j threads,\n");
+    fprintf(stderr, "                          printing size, allocated bytes, extent and hole counts and path\n");
+    fprintf(stderr, "                          per file and summary of all; with --map-format=summary only the\n");
+    fprintf(stderr, "                          summary, exit code 2 tells some entries could not be mapped\n");
+    fprintf(stderr, "              --map-format=FORMAT\n");
+    fprintf(stderr, "                          map: text prints offset and length of data extents per line,\n");
+    fprintf(stderr, "                          json an array of offset and length objects, binary 64-bit little\n");
+    fprintf(stderr, "                          endian offset and length pairs, summary prints size, allocated\n");
+    fprintf(stderr, "                          bytes, extent and hole counts and histogram lines counting\n");
+    fprintf(stderr, "                          extents from each power of two size up to the next one, bitmap\n");
+    fprintf(stderr, "                          writes allocation bitmap of %d byte blocks\n", ALLOC_BLOCK_SZ);
+    fprintf(stderr, "              --extent-cache=PATH\n");
+    fprintf(stderr, "                          map, sparse: keeps extent map of input in cache file PATH, or in\n");
+    fprintf(stderr, "                          directory PATH by device and inode, and reuses it while size, mtime\n");
+    fprintf(stderr, "                          and ctime of input stay the same\n");
+    fprintf(stderr, "              --durability=MODE\n");
+    fprintf(stderr, "                          ursparse: none leaves writeback to the kernel (default), fdatasync\n");
+    fprintf(stderr, "                          syncs outputs at the end, writebehind too and starts writeback of\n");
+    fprintf(stderr, "                          every --sync-size bytes written, keeping dirty pages bounded; syncfs\n");
+    fprintf(stderr, "                          syncs file systems of outputs once, the daemon once for all streams\n");
+    fprintf(stderr, "                          ending meanwhile, before answering them\n");
+    fprintf(stderr, "              --sync-size=SIZE\n");
+    fprintf(stderr, "                          bytes written between write-behind syncs (defaults to %dM)\n", SYNC_SIZE >> 20);
+    fprintf(stderr, "              --key=FILE  sparse: encrypts output in authenticated records, ursparse: decrypts\n");
+    fprintf(stderr, "                          input, FILE holds %d random bytes shared by both ends\n", CRYPT_KEY_SZ);
+    fprintf(stderr, "              --cipher=NAME\n");
+    fprintf(stderr, "                          sparse: aes-256-gcm or chacha20-poly1305, defaults to aes-256-gcm\n");
+    fprintf(stderr, "                          when cpu accelerates AES, records are encrypted by -j threads\n");
+    fprintf(stderr, "              --rate=SIZE limits data read by sparse and written by ursparse to SIZE bytes/s\n");
+    fprintf(stderr, "              --iops=N    limits data reads, writes and copies to N per second\n");
+    fprintf(stderr, "              --max-latency=MS\n");
+    fprintf(stderr, "                          adapts rate to keep data operations under MS milliseconds,\n");
+    fprintf(stderr, "                          --rate is the most it goes up to\n");
+    fprintf(stderr, "              --split=N   writes sparse input file as N ursparse files of contiguous ranges\n");
+    fprintf(stderr, "                          with balanced data, each decodes independently into the same file\n");
+    fprintf(stderr, "              --split-size=SIZE\n");
+    fprintf(stderr, "                          same as --split with as many files as needed for SIZE data bytes each,\n");
+    fprintf(stderr, "                          SIZE is a block at least, at most %d files are written\n", SPLIT_MAX);
+    fprintf(stderr, "              --prefix=PREFIX\n");
+    fprintf(stderr, "                          split files are named PREFIX.0, PREFIX.1, ... (defaults to shard)\n");
+    fprintf(stderr, "              --merge BASE DELTA...\n");
+    fprintf(stderr, "                          merges ursparse files into one written to output, later segments\n");
+    fprintf(stderr, "                          override earlier ones, must be the last option\n");
     //fprintf(stderr, "       -s00               reads sparse input file and writes ursparse format to output file\n");
     //fprintf(stderr, "                          all data blocks full of 0x00 will be treated as a hole\n");
     //fprintf(stderr, "       -sFF               reads sparse input file and writes ursparse format to output file\n");
     //fprintf(stderr, "                          all data blocks full of 0xFF will be treated as a hole\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "       -bSIZE,--blocksize=SIZE block size in bytes (defaults to 4096)\n");
+    fprintf(stderr, "       -p,    --prealloc  sparse: ship unwritten (preallocated) extents as u records\n");
+    fprintf(stderr, "                          they are preallocated again when decoded\n");
+    fprintf(stderr, "                          without it they are treated as holes\n");
+    fprintf(stderr, "       -r,    --refs      sparse: ship extents sharing physical blocks (reflinks) once\n");
+    fprintf(stderr, "                          later copies are shipped as r back-references\n");
+    fprintf(stderr, "       -v,    --verify    sparse: append h trailer with file size and sparse tree hash\n");
+    fprintf(stderr, "                          ursparse: hash output while writing it and check it against trailer\n");
+    fprintf(stderr, "       -jN,   --threads=N threads used for hashing (defaults to number of cpus)\n");
 
     return 0;
 }
@@ -487,9 +8704,18 @@ enum actions {
     NONE = 0,
     USAGE,
     MAP,
+    MAP_TREE,
     URSPARSE,
     SPARSE,
-    SPARSE_XX
+    SPARSE_XX,
+    HASH,
+    MANIFEST,
+    MANIFEST_DIFF,
+    MERGE,
+    SPLIT,
+    WATCH,
+    DAEMON,
+    EXTRACT
 };
 
 
@@ -511,43 +8737,321 @@ int byte_from_hex(char a, char b, unsigned char* byte)
     return 0;
 }
 
+//reads key of encrypted streams, file holds exactly CRYPT_KEY_SZ bytes
+int load_key(const char* path, unsigned char* key)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "ERROR: could not open key file %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    char extra;
+    ssize_t r = sink_read(fd, (char*)key, CRYPT_KEY_SZ);
+    if (r == CRYPT_KEY_SZ) r += read(fd, &extra, 1);
+    close(fd);
+
+    if (r != CRYPT_KEY_SZ) {
+        fprintf(stderr, "ERROR: key file %s must hold %d bytes\n", path, CRYPT_KEY_SZ);
+        return -1;
+    }
+    return 0;
+}
+
+//parses size with optional K, M, G or T suffix
+//returns -1 when invalid
+long long parse_size(const char* str)
+{
+    char* end = 0;
+    long long n = strtoll(str, &end, 10);
+    if (end == str || n < 0) return -1;
+
+    switch (*end) {
+    case 'T': case 't': n <<= 10;
+    case 'G': case 'g': n <<= 10;
+    case 'M': case 'm': n <<= 10;
+    case 'K': case 'k': n <<= 10; ++end;
+    }
+
+    return *end ? -1 : n;
+}
+
 int main(int argc, const char* argv[]) 
 {
     enum actions action = URSPARSE;
     unsigned char hole_byte = 0;
 
     int block_size = 4096;
+    int prealloc = 0;
+    int refs = 0;
+    int verify = 0;
+    int allow_fetch = 0;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    const char* manifest = 0;
+    const char** files = 0;
+    int file_count = 0;
+    int split = 0;
+    off_t split_size = 0;
+    const char* prefix = "shard";
+    const char* range = 0;
+    const char* outputs[argc];
+    int output_count = 0;
+    long long queue_sz = 64 << 20;
+    long long rate = 0;
+    int iops = 0;
+    int max_latency = 0;
+    const char* watch = 0;
+    const char* listens[argc];
+    int listen_count = 0;
+    const char* root = ".";
+    const char* connect_addr = 0;
+    const char* dest = 0;
+    const char* key_file = 0;
+    int codec = CODEC_RAW;
+    int seekable = 0;
+    const char* cipher = 0;
+    const char* chunks = 0;
+    long long store_size = 0;
+    const char* extent_cache = 0;
+    int map_fmt = MAP_TEXT;
+    const char* map_tree = 0;
+    int durability = DURABLE_NONE;
+    long long sync_size = SYNC_SIZE;
+    int interval = 0;
 
     for (int i = 1; i < argc; ++i) {
         if (argv[i][0] == '-') {
             if (argv[i][1] == '-') {
                 if (!strcmp("help",     argv[i]+2)) { action = USAGE; break; }
-                if (!strcmp("map",      argv[i]+2)) { action = MAP; break; }
-                if (!strcmp("ursparse", argv[i]+2)) { action = URSPARSE; break; }
-                if (!strcmp("sparse",   argv[i]+2)) { action = SPARSE; break; }
-                if (!strcmp("blocksize=",  argv[i]+2)) { 
-                    block_size = atoi(argv[i]+sizeof("blocksize="));
-                    break; 
+                if (!strcmp("map",      argv[i]+2)) { action = MAP; continue; }
+                if (!strcmp("ursparse", argv[i]+2)) { action = URSPARSE; continue; }
+                if (!strcmp("sparse",   argv[i]+2)) { action = SPARSE; continue; }
+                if (!strcmp("prealloc", argv[i]+2)) { prealloc = 1; continue; }
+                if (!strcmp("refs",     argv[i]+2)) { refs = 1; continue; }
+                if (!strcmp("hash",     argv[i]+2)) { action = HASH; continue; }
+                if (!strcmp("verify",   argv[i]+2)) { verify = 1; continue; }
+                if (!strcmp("allow-fetch", argv[i]+2)) { allow_fetch = 1; continue; }
+                if (!strcmp("manifest", argv[i]+2)) { action = MANIFEST; continue; }
+                if (!strcmp("seekable", argv[i]+2)) { seekable = 1; continue; }
+                if (!strcmp("extract",  argv[i]+2)) { action = EXTRACT; continue; }
+                if (!strncmp("split=",  argv[i]+2, sizeof("split=") - 1)) { 
+                    split = atoi(argv[i]+2+sizeof("split=")-1);
+                    action = SPLIT;
+                    if (split < 1) {
+                        fprintf(stderr, "ERROR: invalid number of split files\n"); 
+                        return 3;
+                    }
+                    continue; 
+                }
+                if (!strncmp("split-size=",  argv[i]+2, sizeof("split-size=") - 1)) { 
+                    split_size = parse_size(argv[i]+2+sizeof("split-size=")-1);
+                    action = SPLIT;
+                    if (split_size < 1) {
+                        fprintf(stderr, "ERROR: invalid split size\n"); 
+                        return 3;
+                    }
+                    continue; 
+                }
+                if (!strncmp("range=",  argv[i]+2, sizeof("range=") - 1)) { 
+                    range = argv[i]+2+sizeof("range=")-1;
+                    continue; 
+                }
+                if (!strcmp("range",    argv[i]+2) && i + 1 < argc) {
+                    range = argv[++i];
+                    continue;
+                }
+                if (!strncmp("output=",  argv[i]+2, sizeof("output=") - 1)) { 
+                    outputs[output_count++] = argv[i]+2+sizeof("output=")-1;
+                    continue; 
+                }
+                if (!strncmp("watch=",  argv[i]+2, sizeof("watch=") - 1)) { 
+                    watch = argv[i]+2+sizeof("watch=")-1;
+                    action = WATCH;
+                    continue; 
+                }
+                if (!strcmp("watch",    argv[i]+2) && i + 1 < argc) {
+                    watch = argv[++i];
+                    action = WATCH;
+                    continue;
+                }
+                if (!strncmp("listen=",  argv[i]+2, sizeof("listen=") - 1)) { 
+                    listens[listen_count++] = argv[i]+2+sizeof("listen=")-1;
+                    action = DAEMON;
+                    continue; 
+                }
+                if (!strncmp("root=",  argv[i]+2, sizeof("root=") - 1)) { 
+                    root = argv[i]+2+sizeof("root=")-1;
+                    continue; 
+                }
+                if (!strncmp("connect=",  argv[i]+2, sizeof("connect=") - 1)) { 
+                    connect_addr = argv[i]+2+sizeof("connect=")-1;
+                    continue; 
+                }
+                if (!strncmp("dest=",  argv[i]+2, sizeof("dest=") - 1)) { 
+                    dest = argv[i]+2+sizeof("dest=")-1;
+                    continue; 
+                }
+                if (!strncmp("interval=",  argv[i]+2, sizeof("interval=") - 1)) { 
+                    interval = atoi(argv[i]+2+sizeof("interval=")-1);
+                    if (interval < 1) {
+                        fprintf(stderr, "ERROR: invalid interval\n"); 
+                        return 3;
+                    }
+                    continue; 
+                }
+                if (!strncmp("compress=",  argv[i]+2, sizeof("compress=") - 1)) { 
+                    const char* name = argv[i]+2+sizeof("compress=")-1;
+                    codec = strcmp(name, "auto") ? codec_find(name) : CODEC_AUTO;
+                    if (codec == CODEC_RAW || (codec == -1 && strcmp(name, "auto"))) {
+                        fprintf(stderr, "ERROR: unknown compression %s\n", name); 
+                        return 3;
+                    }
+                    continue; 
+                }
+                if (!strncmp("key=",  argv[i]+2, sizeof("key=") - 1)) { 
+                    key_file = argv[i]+2+sizeof("key=")-1;
+                    continue; 
+                }
+                if (!strncmp("chunks=",  argv[i]+2, sizeof("chunks=") - 1)) { 
+                    chunks = argv[i]+2+sizeof("chunks=")-1;
+                    continue; 
+                }
+                if (!strncmp("durability=",  argv[i]+2, sizeof("durability=") - 1)) { 
+                    durability = durability_mode(argv[i]+2+sizeof("durability=")-1);
+                    if (durability == -1) {
+                        fprintf(stderr, "ERROR: unknown durability %s\n", argv[i]+2+sizeof("durability=")-1); 
+                        return 3;
+                    }
+                    continue; 
+                }
+                if (!strncmp("sync-size=",  argv[i]+2, sizeof("sync-size=") - 1)) { 
+                    sync_size = parse_size(argv[i]+2+sizeof("sync-size=")-1);
+                    if (sync_size < 1) {
+                        fprintf(stderr, "ERROR: invalid sync size\n"); 
+                        return 3;
+                    }
+                    continue; 
+                }
+                if (!strncmp("map-tree=",  argv[i]+2, sizeof("map-tree=") - 1)) { 
+                    map_tree = argv[i]+2+sizeof("map-tree=")-1;
+                    action = MAP_TREE;
+                    continue; 
+                }
+                if (!strncmp("map-format=",  argv[i]+2, sizeof("map-format=") - 1)) { 
+                    map_fmt = map_format(argv[i]+2+sizeof("map-format=")-1);
+                    if (map_fmt == -1) {
+                        fprintf(stderr, "ERROR: unknown map format %s\n", argv[i]+2+sizeof("map-format=")-1); 
+                        return 3;
+                    }
+                    continue; 
+                }
+                if (!strncmp("extent-cache=",  argv[i]+2, sizeof("extent-cache=") - 1)) { 
+                    extent_cache = argv[i]+2+sizeof("extent-cache=")-1;
+                    continue; 
+                }
+                if (!strncmp("store-size=",  argv[i]+2, sizeof("store-size=") - 1)) { 
+                    store_size = parse_size(argv[i]+2+sizeof("store-size=")-1);
+                    if (store_size < CDC_MAX_SZ) {
+                        fprintf(stderr, "ERROR: invalid chunk store size\n"); 
+                        return 3;
+                    }
+                    continue; 
+                }
+                if (!strncmp("cipher=",  argv[i]+2, sizeof("cipher=") - 1)) { 
+                    cipher = argv[i]+2+sizeof("cipher=")-1;
+                    if (!crypt_cipher(cipher)) {
+                        fprintf(stderr, "ERROR: unknown cipher %s\n", cipher); 
+                        return 3;
+                    }
+                    continue; 
+                }
+                if (!strncmp("rate=",  argv[i]+2, sizeof("rate=") - 1)) { 
+                    rate = parse_size(argv[i]+2+sizeof("rate=")-1);
+                    if (rate < 1) {
+                        fprintf(stderr, "ERROR: invalid rate\n"); 
+                        return 3;
+                    }
+                    continue; 
+                }
+                if (!strncmp("iops=",  argv[i]+2, sizeof("iops=") - 1)) { 
+                    iops = atoi(argv[i]+2+sizeof("iops=")-1);
+                    if (iops < 1) {
+                        fprintf(stderr, "ERROR: invalid iops\n"); 
+                        return 3;
+                    }
+                    continue; 
+                }
+                if (!strncmp("max-latency=",  argv[i]+2, sizeof("max-latency=") - 1)) { 
+                    max_latency = atoi(argv[i]+2+sizeof("max-latency=")-1);
+                    if (max_latency < 1) {
+                        fprintf(stderr, "ERROR: invalid latency\n"); 
+                        return 3;
+                    }
+                    continue; 
+                }
+                if (!strncmp("queue=",  argv[i]+2, sizeof("queue=") - 1)) { 
+                    queue_sz = parse_size(argv[i]+2+sizeof("queue=")-1);
+                    if (queue_sz < 1) {
+                        fprintf(stderr, "ERROR: invalid queue size\n"); 
+                        return 3;
+                    }
+                    continue; 
+                }
+                if (!strncmp("prefix=",  argv[i]+2, sizeof("prefix=") - 1)) { 
+                    prefix = argv[i]+2+sizeof("prefix=")-1;
+                    continue; 
+                }
+                if (!strcmp("merge",    argv[i]+2)) {
+                    action = MERGE;
+                    files = argv + i + 1;
+                    file_count = argc - i - 1;
+                    break;
+                }
+                if (!strncmp("manifest-diff=",  argv[i]+2, sizeof("manifest-diff=") - 1)) { 
+                    manifest = argv[i]+2+sizeof("manifest-diff=")-1;
+                    action = MANIFEST_DIFF;
+                    continue; 
+                }
+                if (!strncmp("threads=",  argv[i]+2, sizeof("threads=") - 1)) { 
+                    threads = atoi(argv[i]+2+sizeof("threads=")-1);
+                    continue; 
+                }
+                if (!strncmp("blocksize=",  argv[i]+2, sizeof("blocksize=") - 1)) { 
+                    block_size = atoi(argv[i]+2+sizeof("blocksize=")-1);
+                    continue; 
                 }
             } 
             else {
                 if (argv[i][1] == 'h' && argv[i][2] == 0) { action = USAGE; break; }
-                if (argv[i][1] == 'm' && argv[i][2] == 0) { action = MAP; break; }
-                if (argv[i][1] == 'u' && argv[i][2] == 0) { action = URSPARSE; break; }
-                if (argv[i][1] == 's' && argv[i][2] == 0) { action = SPARSE; break; }
-                if (argv[i][1] == 's' && argv[i][4] == 0) { 
+                if (argv[i][1] == 'm' && argv[i][2] == 0) { action = MAP; continue; }
+                if (argv[i][1] == 'u' && argv[i][2] == 0) { action = URSPARSE; continue; }
+                if (argv[i][1] == 's' && argv[i][2] == 0) { action = SPARSE; continue; }
+                if (argv[i][1] == 'p' && argv[i][2] == 0) { prealloc = 1; continue; }
+                if (argv[i][1] == 'r' && argv[i][2] == 0) { refs = 1; continue; }
+                if (argv[i][1] == 'H' && argv[i][2] == 0) { action = HASH; continue; }
+                if (argv[i][1] == 'v' && argv[i][2] == 0) { verify = 1; continue; }
+                if (argv[i][1] == 'M' && argv[i][2] == 0) { action = MANIFEST; continue; }
+                if (argv[i][1] == 'j') { 
+                    threads = atoi(argv[i]+2);
+                    continue; 
+                }
+                if (argv[i][1] == 's' && argv[i][2] && argv[i][3] && argv[i][4] == 0) { 
                     if (byte_from_hex(argv[i][2], argv[i][3], &hole_byte)) {
                         usage(argv[0]);
                         return 2;
                     }
-                    action=SPARSE_XX; break; 
+                    action=SPARSE_XX; continue; 
                 }
                 if (argv[i][1] == 'b') { 
-                    block_size = atoi(argv[i]+1);
-                    break; 
+                    block_size = atoi(argv[i]+2);
+                    continue; 
                 }
             }
         }
+
+        fprintf(stderr, "ERROR: unknown option: %s\n", argv[i]);
+        usage(argv[0]);
+        return 2;
     }
     
     if (block_size < 2) {
@@ -555,21 +9059,156 @@ int main(int argc, const char* argv[])
         return 3;
     }
 
+    if (threads < 1) {
+        fprintf(stderr, "ERROR: invalid number of threads\n"); 
+        return 3;
+    }
+
+    struct options opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.blk_sz = block_size;
+    opts.prealloc = prealloc;
+    opts.refs = refs;
+    opts.allow_fetch = allow_fetch;
+    opts.verify = verify;
+    opts.threads = threads;
+    opts.prefix = prefix;
+    opts.queue_sz = queue_sz;
+    opts.codec = codec;
+    opts.seekable = seekable;
+    opts.chunks = chunks;
+    opts.store_size = store_size;
+    opts.extent_cache = extent_cache;
+    opts.map_format = map_fmt;
+    opts.durability = durability;
+    opts.sync_size = sync_size;
+
+    if (seekable && (action != SPARSE || key_file || refs || prealloc)) {
+        fprintf(stderr, "ERROR: --seekable indexes only sparse output of data segments, without --key, -r or -p\n");
+        return 3;
+    }
+
+    if (chunks && (action == MERGE || action == SPLIT || action == EXTRACT || codec != CODEC_RAW || seekable)) {
+        fprintf(stderr, "ERROR: --chunks works with sparse, ursparse, daemon and watch, without --compress or --seekable\n");
+        return 3;
+    }
+
+    struct throttle throttle;
+    if (rate || iops || max_latency) {
+        throttle_init(&throttle, rate, iops, max_latency / 1000.0);
+        opts.throttle = &throttle;
+    }
+
+    unsigned char key[CRYPT_KEY_SZ];
+    if (key_file) {
+        if (load_key(key_file, key)) return 3;
+        if ((action != SPARSE && action != URSPARSE) || connect_addr) {
+            fprintf(stderr, "ERROR: --key encrypts only sparse output and decrypts only ursparse input\n");
+            return 3;
+        }
+        opts.key = key;
+        opts.cipher = cipher ? cipher : crypt_default_cipher();
+    }
+
+    int fd_out = 1;
+
+    if (range) {
+        char* end = 0;
+        long long len = 0;
+        opts.range_start = strtoll(range, &end, 0);
+        if (*end == ':') len = strtoll(end + 1, &end, 0);
+        if (*end || opts.range_start < 0 || len <= 0) {
+            fprintf(stderr, "ERROR: invalid range %s, expected START:LEN\n", range); 
+            return 3;
+        }
+        opts.range_end = opts.range_start + len;
+
+        if (verify) {
+            fprintf(stderr, "ERROR: range can not be verified, the hash covers the whole file\n");
+            return 3;
+        }
+    }
+
     switch (action) {
     case USAGE:
         return usage(argv[0]);
 
     case MAP:
-        return do_map(0);
+        return do_map(0, &opts);
+
+    case MAP_TREE:
+        return do_map_tree(map_tree, &opts);
 
     case URSPARSE:
-        return do_ursparse(0, 1, block_size);
+        if (connect_addr) {
+            if (!dest) {
+                fprintf(stderr, "ERROR: --connect needs --dest\n");
+                return 3;
+            }
+            return do_ursparse_fetch(connect_addr, dest, fd_out, &opts);
+        }
+        if (output_count) return do_ursparse_files(outputs, output_count, &opts);
+        if (opts.key) return do_ursparse_decrypted(0, &fd_out, 1, &opts);
+        return do_ursparse(0, &fd_out, 1, &opts);
 
     case SPARSE:
-        return do_sparse(0, 1, block_size, 0);
+        if (connect_addr) {
+            if (!dest) {
+                fprintf(stderr, "ERROR: --connect needs --dest\n");
+                return 3;
+            }
+            return do_sparse_send(connect_addr, dest, &opts);
+        }
+        if (output_count) return do_sparse_files(outputs, output_count, &opts);
+        return do_sparse_stream(0, 1, &opts);
 
     case SPARSE_XX:
-        return do_sparse(0, 1, block_size, &hole_byte);
+        opts.hole_byte = &hole_byte;
+        return do_sparse(0, 1, &opts);
+
+    case HASH:
+        return do_hash(0, &opts);
+
+    case MANIFEST:
+        return do_manifest(0, 1, &opts);
+
+    case MANIFEST_DIFF:
+        return do_manifest_diff(0, manifest);
+
+    case MERGE:
+        return do_merge(files, file_count, 1, &opts);
+
+    case DAEMON:
+        if (range) {
+            fprintf(stderr, "ERROR: daemon can not restrict streams to a range\n");
+            return 3;
+        }
+        return do_daemon(listens, listen_count, root, &opts);
+
+    case EXTRACT:
+        if (verify || output_count) {
+            fprintf(stderr, "ERROR: extract writes only to output and can not verify the hash\n");
+            return 3;
+        }
+        return do_extract(0, fd_out, &opts);
+
+    case WATCH:
+        if (verify || range) {
+            fprintf(stderr, "ERROR: watched file can not be verified or restricted to a range\n");
+            return 3;
+        }
+        return do_watch(watch, 1, interval, &opts);
+
+    case SPLIT:
+        if (verify) {
+            fprintf(stderr, "ERROR: split files can not be verified, they hold parts of the file\n");
+            return 3;
+        }
+        if (!split && split_size < (off_t)opts.blk_sz) {
+            fprintf(stderr, "ERROR: split size is less than block size %zu\n", opts.blk_sz);
+            return 3;
+        }
+        return do_split(0, split, split_size, &opts);
 
     default:
         usage(argv[0]);
@@ -578,4 +9217,3 @@ int main(int argc, const char* argv[])
 
     return 0;
 }
-